@@ -0,0 +1,103 @@
+/**
+ * Benchmark counting the lines of a cgroup tasks file, comparing the old
+ * fopen()/fgetc() loop with reading big chunks through one cached descriptor
+ * and counting newlines 16 bytes at a time.
+ *
+ * Usage: bench_count [TASKS_FILE]
+ *
+ * Without an argument a 10k-line file like a 10k-thread job's tasks file is
+ * made in /tmp, otherwise the given file (e.g. a real cgroup's tasks) is used.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "util.h"
+
+#define N_TASKS 10000
+#define ITERATIONS 2000
+#define CHUNK 65536
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The way count_newlines() in cgroup.c used to do it */
+static int count_fgetc(const char *path)
+{
+	FILE *fp;
+	int n = 0;
+	int c;
+
+	if(NULL == (fp = fopen(path, "r")))
+		log_exit("Error opening %s", path);
+
+	while((c = fgetc(fp)) != EOF)	{
+		if(c == '\n')
+			++n;
+	}
+
+	fclose(fp);
+	return n;
+}
+
+static void make_tasks_file(char *path)
+{
+	FILE *fp;
+	int fd;
+
+	if((fd = mkstemp(path)) < 0 || (fp = fdopen(fd, "w")) == NULL)
+		log_exit("Error creating %s", path);
+	for(int i = 0; i < N_TASKS; i++)
+		fprintf(fp, "%d\n", 1000000 + i * 7);
+	fclose(fp);
+}
+
+int main(int argc, char *argv[])
+{
+	char tmp[] = "/tmp/bench_tasksXXXXXX";
+	const char *path = tmp;
+	char *buf = xcalloc(CHUNK);
+	uint64_t t0, t_old, t_new;
+	ssize_t n_old = 0, n_new = 0;
+	int fd;
+
+	if(argc > 1)
+		path = argv[1];
+	else
+		make_tasks_file(tmp);
+
+	t0 = now_ns();
+	for(int i = 0; i < ITERATIONS; i++)
+		n_old = count_fgetc(path);
+	t_old = now_ns() - t0;
+
+	if((fd = open(path, O_RDONLY)) < 0)
+		log_exit("Error opening %s", path);
+	t0 = now_ns();
+	for(int i = 0; i < ITERATIONS; i++)
+		n_new = count_lines_fd(fd, buf, CHUNK);
+	t_new = now_ns() - t0;
+	close(fd);
+
+	if(n_old != n_new)
+		log_exit("Line counts differ: %zd vs %zd", n_old, n_new);
+
+	printf("%s: %zd lines, %d iterations\n", path, n_new, ITERATIONS);
+	printf("fopen/fgetc:      %10.1f us/read\n", t_old / 1000.0 / ITERATIONS);
+	printf("pread/count_char: %10.1f us/read\n", t_new / 1000.0 / ITERATIONS);
+	printf("speedup:          %10.1fx\n", (double)t_old / t_new);
+
+	if(path == tmp)
+		unlink(tmp);
+	free(buf);
+	return 0;
+}
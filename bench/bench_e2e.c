@@ -0,0 +1,264 @@
+/**
+ * End-to-end benchmark of condor_cg_graphite and condor_cg_statsd: run them
+ * over a fake cgroup tree, sending to a sink on the loopback interface that
+ * checks every metric parses, and report for each transport how many metrics
+ * arrived, how many were dropped, and how fast and how big they were.
+ *
+ * The metrics a run should send are counted from its -d output, and each
+ * transport gets a fresh sink in a child process.
+ *
+ * Usage: bench_e2e [-2] [-n N_SLOTS] [-r RUNS] [-j N] [-b BINDIR]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <linux/limits.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "cgroup.h"
+#include "fake_cgroup.h"
+#include "sink.h"
+#include "util.h"
+
+struct transport {
+	const char *name;
+	const char *prog;	/* which collector */
+	const char *flag;	/* its flag for this transport, if any */
+	int socktype;
+	enum sink_format format;
+};
+
+static const struct transport transports[] = {
+	{ "graphite udp", "condor_cg_graphite", NULL, SOCK_DGRAM,
+	  SINK_GRAPHITE },
+	{ "graphite tcp", "condor_cg_graphite", "-t", SOCK_STREAM,
+	  SINK_GRAPHITE },
+	{ "graphite pickle", "condor_cg_graphite", "-P", SOCK_STREAM,
+	  SINK_PICKLE },
+	{ "statsd udp", "condor_cg_statsd", NULL, SOCK_DGRAM, SINK_STATSD },
+};
+
+static volatile sig_atomic_t sink_stop = 0;
+
+static void handle_stop(int sig)
+{
+	(void)sig;
+	sink_stop = 1;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+"Usage: %s [-2] [-n N_SLOTS] [-r RUNS] [-j N] [-b BINDIR]\n\n"
+"Run condor_cg_graphite and condor_cg_statsd RUNS times over a fake cgroup\n"
+"tree of N_SLOTS slots, sending over each transport to a local sink, and\n"
+"report what arrived\n\n"
+"\t-2 cgroup v2 unified hierarchy, instead of v1 controllers\n"
+"\t-n N_SLOTS: condor slots in the tree (default 1000)\n"
+"\t-r RUNS: runs of the collector for each transport (default 20)\n"
+"\t-j N: collector reads with N threads (default 1)\n"
+"\t-b BINDIR: where the collectors are (default where this is)\n",
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+/* Run @argv, with its output to @out_fd if that's not -1, returning its exit
+ * status
+ */
+static int run(char *const argv[], int out_fd)
+{
+	int status;
+	pid_t pid;
+
+	if((pid = fork()) < 0)
+		log_exit("fork() failed");
+	if(pid == 0)	{
+		if(out_fd >= 0 && dup2(out_fd, STDOUT_FILENO) < 0)
+			_exit(127);
+		execv(argv[0], argv);
+		fprintf(stderr, "Can't run %s: %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+	if(waitpid(pid, &status, 0) < 0)
+		log_exit("waitpid() failed");
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/* How many metrics one run of @argv (with -d) prints */
+static uint64_t count_metrics(char *const argv[])
+{
+	char path[] = "/tmp/bench_e2e.out.XXXXXX";
+	char buf[65536];
+	ssize_t n;
+	int fd;
+
+	if((fd = mkstemp(path)) < 0)
+		log_exit("Can't make a file in /tmp: %s", strerror(errno));
+	unlink(path);
+	if(run(argv, fd) != 0)
+		log_exit("%s -d failed", argv[0]);
+	if((n = count_lines_fd(fd, buf, sizeof(buf))) < 0)
+		log_exit("Can't read %s -d output: %s", argv[0],
+			 strerror(errno));
+	close(fd);
+	return n;
+}
+
+/* Start a sink for @t in a child, which sends back its counts on @stats_fd
+ * when it's sent SIGTERM
+ */
+static pid_t start_sink(const struct transport *t, int *port, int *stats_fd)
+{
+	int fds[2];
+	int fd;
+	pid_t pid;
+
+	*port = 0;
+	fd = sink_listen(t->socktype, port);
+	if(pipe(fds) != 0)
+		log_exit("pipe() failed");
+	if((pid = fork()) < 0)
+		log_exit("fork() failed");
+
+	if(pid == 0)	{
+		struct sink_stats st;
+
+		close(fds[0]);
+		signal(SIGTERM, handle_stop);
+		sink_run(fd, t->format, &st, &sink_stop);
+		if(write(fds[1], &st, sizeof(st)) != sizeof(st))
+			_exit(1);
+		_exit(0);
+	}
+
+	close(fd);
+	close(fds[1]);
+	*stats_fd = fds[0];
+	return pid;
+}
+
+static void bench(const struct transport *t, const char *bindir,
+		  const char *root, const char *workers, int runs)
+{
+	char prog[PATH_MAX], dest[32];
+	char *argv[12];
+	struct sink_stats st;
+	uint64_t expected, t0, elapsed, lost;
+	int argc = 0, failed = 0;
+	int port, stats_fd;
+	pid_t sink;
+
+	snprintf(prog, sizeof(prog), "%s/%s", bindir, t->prog);
+	argv[argc++] = prog;
+	argv[argc++] = "-r";
+	argv[argc++] = (char *)root;
+	argv[argc++] = "-j";
+	argv[argc++] = (char *)workers;
+	if(t->flag != NULL)
+		argv[argc++] = (char *)t->flag;
+
+	argv[argc] = "-d";
+	argv[argc + 1] = "127.0.0.1";
+	argv[argc + 2] = NULL;
+	expected = count_metrics(argv) * runs;
+
+	sink = start_sink(t, &port, &stats_fd);
+	snprintf(dest, sizeof(dest), "127.0.0.1:%d", port);
+	argv[argc++] = dest;
+	argv[argc] = NULL;
+
+	t0 = monotonic_ns();
+	for(int r = 0; r < runs; r++)
+		failed += run(argv, -1) != 0;
+	elapsed = monotonic_ns() - t0;
+
+	kill(sink, SIGTERM);
+	if(read(stats_fd, &st, sizeof(st)) != sizeof(st))
+		log_exit("The %s sink died", t->name);
+	close(stats_fd);
+	waitpid(sink, NULL, 0);
+
+	lost = expected > st.metrics ? expected - st.metrics : 0;
+	printf("%-16s %10" PRIu64 " %10" PRIu64 " %6" PRIu64 " %8" PRIu64
+	       " %11.0f %8.1f %9" PRIu64 "\n", t->name, expected, st.metrics,
+	       st.bad, lost, st.metrics / (elapsed / 1e9),
+	       st.metrics ? (double)st.bytes / st.metrics : 0.0, st.packets);
+	if(failed > 0)
+		fprintf(stderr, "%s: %d of %d runs failed\n", t->name, failed,
+			runs);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fake_cgroup_opts o = {
+		.n_slots = 1000,
+		.n_tasks = 200,
+		.cg_name = default_cgroup_name,
+		.host = "node001.example.com",
+	};
+	char self[PATH_MAX], root[256];
+	const char *bindir = NULL;
+	const char *workers = "1";
+	const char *tmpdir;
+	ssize_t len;
+	int runs = 20;
+	int c;
+
+	while((c = getopt(argc, argv, "2n:r:j:b:h")) != -1)	{
+		switch(c)	{
+		case '2':
+			o.v2 = true;
+			break;
+		case 'n':
+			o.n_slots = atoi(optarg);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 'j':
+			workers = optarg;
+			break;
+		case 'b':
+			bindir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(optind != argc || o.n_slots <= 0 || runs <= 0 || atoi(workers) <= 0)
+		usage(argv[0]);
+
+	if(bindir == NULL)	{
+		len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+		if(len < 0)
+			log_exit("Can't find where %s is, give -b", argv[0]);
+		self[len] = '\0';
+		bindir = dirname(self);
+	}
+	if((tmpdir = getenv("TMPDIR")) == NULL)
+		tmpdir = "/tmp";
+	snprintf(root, sizeof(root), "%s/bench_e2e.XXXXXX", tmpdir);
+	if(mkdtemp(root) == NULL)
+		log_exit("Can't make a directory in %s: %s", tmpdir,
+			 strerror(errno));
+	fake_cgroup_make(root, &o);
+
+	printf("cgroup %s, %d slots, %d runs of each\n\n", o.v2 ? "v2" : "v1",
+	       o.n_slots, runs);
+	printf("%-16s %10s %10s %6s %8s %11s %8s %9s\n", "transport", "sent",
+	       "received", "bad", "dropped", "metrics/s", "B/metric",
+	       "packets");
+	for(size_t i = 0; i < sizeof(transports) / sizeof(*transports); i++)
+		bench(&transports[i], bindir, root, workers, runs);
+
+	fake_cgroup_remove(root);
+	return 0;
+}
@@ -0,0 +1,220 @@
+/**
+ * Microbenchmark of turning groups into graphite plaintext lines, comparing
+ * the old way (snprintf the name and value, calloc + snprintf the line, copy
+ * it into the buffer) with send_group_metrics() writing straight into the
+ * send buffer. Output goes over TCP-like buffering to a socketpair whose
+ * other end is just drained, so both include the same send() cost.
+ *
+ * Then the same again through a send queue as real TCP sinks are, first
+ * copying the lines into the buffer and then with buf_set_gather(), pointing
+ * to the interned names rather than copying them, for sendmsg() to gather.
+ *
+ * Usage: bench_format [N_GROUPS] [ROUNDS]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "graphite.h"
+#include "metrics.h"
+#include "sendq.h"
+#include "util.h"
+
+#define HOSTNAME "node123.example.com"
+#define NS "htcondor.cgroups"
+#define OLD_BUFSIZE 4096
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char old_buf[OLD_BUFSIZE];
+static size_t old_used = 0;
+
+/* The timestamp, formatted once a round as the new path does */
+static char old_ts[32];
+
+static void old_flush(int fd)
+{
+	size_t sent = 0;
+	ssize_t n;
+
+	while(sent < old_used)	{
+		if((n = send(fd, old_buf + sent, old_used - sent, 0)) < 0)
+			log_exit("send() error");
+		sent += n;
+	}
+	old_used = 0;
+}
+
+/* graphite_send_uint() and util_metric_send() as they used to be, but for
+ * taking the time once a round */
+static int old_send_uint(int fd, const char *metric, uint64_t value)
+{
+	char s[32];
+	size_t len;
+	char *str;
+
+	snprintf(s, sizeof(s), "%lu", value);
+	len = strlen(metric) + strlen(s) + strlen(old_ts) + 2 + 1;
+	str = xcalloc(len);
+	snprintf(str, len, "%s %s %s\n", metric, s, old_ts);
+
+	len = strlen(str);
+	if(old_used + len >= OLD_BUFSIZE)
+		old_flush(fd);
+	memcpy(old_buf + old_used, str, len);
+	old_used += len;
+	free(str);
+	return 0;
+}
+
+static char *sanitize_host(const char *host)
+{
+	char *q = xstrdup(host);
+	for(char *p = q; *p; p++)
+		if(*p == '.')
+			*p = '_';
+	return q;
+}
+
+/* send_group_metrics() as it used to be */
+static void old_send_group(struct condor_group *g, int fd)
+{
+	static const char *suffix[] = { "starttime", "cpu_shares", "tasks",
+		"procs", "cpu_user", "cpu_sys", "rss", "cache", "swap",
+		"memusage", "softmemlimit" };
+	uint64_t val[] = { g->start_time, g->cpu_shares, g->num_tasks,
+		g->num_procs, g->user_cpu_usage, g->sys_cpu_usage, g->rss_used,
+		g->cache_used, g->swap_used, g->mem_usage, g->mem_soft_limit };
+	char *host = sanitize_host(HOSTNAME);
+	size_t b_len = strlen(NS) + strlen(host) + strlen(g->slot_name) + 4;
+	char *base = xcalloc(b_len);
+	char *metric = xcalloc(b_len + 32);
+
+	snprintf(base, b_len, "%s.%s.%s", NS, host, g->slot_name);
+	free(host);
+	for(size_t i = 0; i < sizeof(val) / sizeof(*val); i++)	{
+		snprintf(metric, b_len + 32, "%s.%s", base, suffix[i]);
+		old_send_uint(fd, metric, val[i]);
+	}
+	free(base);
+	free(metric);
+}
+
+/* Time @rounds cycles of sending all @n_groups with send_group_metrics(),
+ * waiting for the send queue to drain at the end of each if there is one
+ */
+static uint64_t time_rounds(struct condor_group *groups, int n_groups,
+			    int rounds, int fd)
+{
+	struct timespec deadline;
+	uint64_t t0 = now_ns();
+
+	for(int r = 0; r < rounds; r++)	{
+		graphite_update_time();
+		for(int i = 0; i < n_groups; i++)
+			send_group_metrics(&groups[i], fd, &graphite_backend);
+		buf_flush(fd);
+		if(sendq_owns(fd))	{
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec += 10;
+			sendq_wait(&deadline);
+		}
+	}
+	return now_ns() - t0;
+}
+
+int main(int argc, char *argv[])
+{
+	int n_groups = (argc > 1) ? atoi(argv[1]) : 200;
+	int rounds = (argc > 2) ? atoi(argv[2]) : 500;
+	struct condor_group *groups;
+	uint64_t t0, t_old, t_new, t_queued, t_gather;
+	double n_metrics;
+	int sv[2];
+	pid_t child;
+
+	if(n_groups <= 0 || rounds <= 0)
+		log_exit("Usage: %s [N_GROUPS] [ROUNDS]", argv[0]);
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+		log_exit("socketpair() failed");
+	if((child = fork()) == 0)	{
+		char drain[65536];
+		close(sv[0]);
+		while(read(sv[1], drain, sizeof(drain)) > 0)
+			;
+		_exit(0);
+	}
+	close(sv[1]);
+
+	groups = xcalloc(n_groups * sizeof(*groups));
+	for(int i = 0; i < n_groups; i++)	{
+		struct condor_group *g = &groups[i];
+		snprintf(g->slot_name, sizeof(g->slot_name), "slot1_%d",
+			 i % 10000 + 1);
+		g->start_time = 1500000000 + i;
+		g->cpu_shares = 100;
+		g->num_tasks = 37 + i;
+		g->num_procs = 3;
+		g->user_cpu_usage = 123456 + i;
+		g->sys_cpu_usage = 2345;
+		g->rss_used = 2147483648ULL + i * 4096;
+		g->cache_used = 104857600;
+		g->swap_used = 0;
+		g->mem_usage = 3221225472ULL;
+		g->mem_soft_limit = 4294967296ULL;
+	}
+	/* 11 metrics per group without CPU rates */
+	n_metrics = 11.0 * n_groups * rounds;
+
+	t0 = now_ns();
+	for(int r = 0; r < rounds; r++)	{
+		snprintf(old_ts, sizeof(old_ts), "%ld", (long)time(NULL));
+		for(int i = 0; i < n_groups; i++)
+			old_send_group(&groups[i], sv[0]);
+		old_flush(sv[0]);
+	}
+	t_old = now_ns() - t0;
+
+	graphite_init();
+	metrics_init(NS, HOSTNAME);
+	t_new = time_rounds(groups, n_groups, rounds, sv[0]);
+
+	sendq_open(sv[0], NULL, NULL, SENDQ_DEFAULT_MAX, false);
+	t_queued = time_rounds(groups, n_groups, rounds, sv[0]);
+	buf_set_gather(sv[0], true);
+	t_gather = time_rounds(groups, n_groups, rounds, sv[0]);
+	buf_close(sv[0]);
+	sendq_close(sv[0]);
+
+	close(sv[0]);
+	waitpid(child, NULL, 0);
+
+	printf("%d groups x %d rounds = %.0f metrics\n", n_groups, rounds,
+	       n_metrics);
+	printf("old snprintf/calloc path: %12.0f metrics/s\n",
+	       n_metrics / (t_old / 1e9));
+	printf("direct-to-buffer path:    %12.0f metrics/s\n",
+	       n_metrics / (t_new / 1e9));
+	printf("speedup:                  %12.1fx\n", (double)t_old / t_new);
+	printf("buffer + send queue:      %12.0f metrics/s\n",
+	       n_metrics / (t_queued / 1e9));
+	printf("gathered + send queue:    %12.0f metrics/s\n",
+	       n_metrics / (t_gather / 1e9));
+	printf("gathered vs buffer:       %12.2fx\n",
+	       (double)t_queued / t_gather);
+	free(groups);
+	return 0;
+}
@@ -0,0 +1,252 @@
+/**
+ * Benchmark of read_condor_cgroup_info() over fake cgroup trees of 10, 1k and
+ * 10k condor slots (or however many are given), reporting the time and the
+ * number of system calls taken by the first scan, which opens every slot's
+ * files, and by later ones that reuse the open descriptors.
+ *
+ * Each size is read in a fresh child process, and the system calls are counted
+ * in another one under ptrace() so that doesn't slow down the timed scans.
+ *
+ * Usage: bench_scan [-2] [-p] [-t TASKS] [-r ROUNDS] [-j N] [N_SLOTS...]
+ */
+#define _GNU_SOURCE	/* for PTRACE_GET_SYSCALL_INFO */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/ptrace.h>
+
+#include "cgroup.h"
+#include "fake_cgroup.h"
+#include "util.h"
+
+struct scan_times {
+	uint64_t cold_ns;	/* first scan */
+	uint64_t warm_ns;	/* mean of the rest */
+};
+
+struct scan_syscalls {
+	uint64_t cold;
+	uint64_t warm;
+};
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+"Usage: %s [-2] [-p] [-t TASKS] [-r ROUNDS] [-j N] [N_SLOTS...]\n\n"
+"Time scanning fake cgroup trees of N_SLOTS condor slots each (default 10,\n"
+"1000 and 10000) made under $TMPDIR, and count the system calls it takes\n\n"
+"\t-2 cgroup v2 unified hierarchy, instead of v1 controllers\n"
+"\t-p with the pids controller, so tasks files aren't counted\n"
+"\t-t TASKS: lines in each slot's tasks file (default 200)\n"
+"\t-r ROUNDS: scans to time after the first (default 20)\n"
+"\t-j N: read with N threads when timing (default 1)\n",
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+/* Time the first and then @rounds more scans of @root with @workers threads,
+ * in a child process so each tree gets a fresh start
+ */
+static struct scan_times time_scans(const char *root, int rounds, int workers)
+{
+	struct scan_times t = {0};
+	int fds[2];
+	pid_t pid;
+
+	if(pipe(fds) != 0)
+		log_exit("pipe() failed");
+	if((pid = fork()) < 0)
+		log_exit("fork() failed");
+
+	if(pid == 0)	{
+		uint64_t t0;
+
+		close(fds[0]);
+		set_cgroup_root(root);
+		set_read_workers(workers);
+
+		t0 = monotonic_ns();
+		read_condor_cgroup_info(default_cgroup_name);
+		t.cold_ns = monotonic_ns() - t0;
+
+		t0 = monotonic_ns();
+		for(int r = 0; r < rounds; r++)
+			read_condor_cgroup_info(default_cgroup_name);
+		t.warm_ns = (monotonic_ns() - t0) / rounds;
+
+		if(write(fds[1], &t, sizeof(t)) != sizeof(t))
+			_exit(1);
+		cleanup_groups();
+		_exit(0);
+	}
+
+	close(fds[1]);
+	if(read(fds[0], &t, sizeof(t)) != sizeof(t))
+		log_exit("Scanning %s failed", root);
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+	return t;
+}
+
+/* Count the system calls of a first and a second scan of @root, in a traced
+ * child that marks where each scan starts and ends with a getppid() call. It's
+ * single-threaded, as the threads would have to be traced too.
+ */
+static struct scan_syscalls count_syscalls(const char *root)
+{
+	struct scan_syscalls sc = {0};
+	uint64_t *counting = NULL;
+	int markers = 0;
+	int status;
+	pid_t pid;
+
+	if((pid = fork()) < 0)
+		log_exit("fork() failed");
+
+	if(pid == 0)	{
+		if(ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+			_exit(1);
+		raise(SIGSTOP);
+		set_cgroup_root(root);
+		getppid();
+		read_condor_cgroup_info(default_cgroup_name);
+		getppid();
+		read_condor_cgroup_info(default_cgroup_name);
+		getppid();
+		_exit(0);
+	}
+
+	if(waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))
+		log_exit("Couldn't trace the scan, is ptrace() allowed?");
+	ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD);
+
+	for(;;)	{
+		struct ptrace_syscall_info si;
+
+		if(ptrace(PTRACE_SYSCALL, pid, NULL, NULL) != 0 ||
+		   waitpid(pid, &status, 0) < 0 || WIFEXITED(status) ||
+		   WIFSIGNALED(status))
+			break;
+		if(!WIFSTOPPED(status) || WSTOPSIG(status) != (SIGTRAP | 0x80))
+			continue;
+		if(ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(si), &si) <= 0 ||
+		   si.op != PTRACE_SYSCALL_INFO_ENTRY)
+			continue;
+
+		if(si.entry.nr == SYS_getppid)	{
+			markers++;
+			counting = (markers == 1) ? &sc.cold :
+				   (markers == 2) ? &sc.warm : NULL;
+		} else if(counting != NULL)	{
+			(*counting)++;
+		}
+	}
+	if(markers != 3)
+		log_exit("Scan of %s didn't finish under ptrace()", root);
+	return sc;
+}
+
+/* Every slot keeps its files open, so make sure there are enough descriptors
+ * to go round -- which needs root past the hard limit
+ */
+static void ensure_fd_limit(int n_slots)
+{
+	struct rlimit rl;
+	rlim_t want = (rlim_t)n_slots * SLOT_FDS + FD_RESERVE;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur >= want)
+		return;
+	rl.rlim_cur = want;
+	if(rl.rlim_max < want)
+		rl.rlim_max = want;
+	if(setrlimit(RLIMIT_NOFILE, &rl) != 0)
+		fprintf(stderr, "Can't allow %lu open files for %d slots (%s), "
+			"some will be reopened on every scan\n",
+			(unsigned long)want, n_slots, strerror(errno));
+}
+
+int main(int argc, char *argv[])
+{
+	static const int default_sizes[] = { 10, 1000, 10000 };
+	struct fake_cgroup_opts o = {
+		.n_tasks = 200,
+		.cg_name = default_cgroup_name,
+		.host = "node001.example.com",
+	};
+	int rounds = 20, workers = 1;
+	int n_sizes;
+	const char *tmpdir;
+	char root[256];
+	int c;
+
+	while((c = getopt(argc, argv, "2pt:r:j:h")) != -1)	{
+		switch(c)	{
+		case '2':
+			o.v2 = true;
+			break;
+		case 'p':
+			o.pids = true;
+			break;
+		case 't':
+			o.n_tasks = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'j':
+			workers = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(o.n_tasks <= 0 || rounds <= 0 || workers <= 0)
+		usage(argv[0]);
+	n_sizes = (optind < argc) ? argc - optind : 3;
+	if((tmpdir = getenv("TMPDIR")) == NULL)
+		tmpdir = "/tmp";
+
+	printf("cgroup %s, %d tasks per slot%s, %d thread(s)\n\n",
+	       o.v2 ? "v2" : "v1", o.n_tasks, o.pids ? " (pids.current)" : "",
+	       workers);
+	printf("%8s  %12s %12s %10s  %10s %10s %8s\n", "slots", "first scan",
+	       "later scans", "per slot", "syscalls", "later", "per slot");
+
+	for(int i = 0; i < n_sizes; i++)	{
+		struct scan_times t;
+		struct scan_syscalls sc;
+
+		o.n_slots = (optind < argc) ? atoi(argv[optind + i]) :
+					      default_sizes[i];
+		if(o.n_slots <= 0)
+			usage(argv[0]);
+
+		snprintf(root, sizeof(root), "%s/bench_scan.XXXXXX", tmpdir);
+		if(mkdtemp(root) == NULL)
+			log_exit("Can't make a directory in %s: %s", tmpdir,
+				 strerror(errno));
+		fake_cgroup_make(root, &o);
+		ensure_fd_limit(o.n_slots);
+
+		t = time_scans(root, rounds, workers);
+		sc = count_syscalls(root);
+		fake_cgroup_remove(root);
+
+		printf("%8d  %10.3fms %10.3fms %8.2fus  %10" PRIu64
+		       " %10" PRIu64 " %8.1f\n", o.n_slots, t.cold_ns / 1e6, t.warm_ns / 1e6,
+		       t.warm_ns / 1e3 / o.n_slots, sc.cold, sc.warm,
+		       (double)sc.warm / o.n_slots);
+		fflush(stdout);
+	}
+	return 0;
+}
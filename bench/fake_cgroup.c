@@ -0,0 +1,264 @@
+/**
+ * Make fake v1 or v2 cgroup trees of condor slots to benchmark reading them
+ * without needing thousands of real jobs
+ */
+#define _XOPEN_SOURCE 700	/* for nftw() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <sys/stat.h>
+
+#include "fake_cgroup.h"
+#include "util.h"
+
+/* Same numbers every run, but different for each slot */
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rnd(uint64_t max)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state % max;
+}
+
+static void make_dir(const char *dir)
+{
+	if(mkdir(dir, 0755) != 0 && errno != EEXIST)
+		log_exit("Can't make %s: %s", dir, strerror(errno));
+}
+
+/* Make @root/[@ctrl/]@cg[/@name] and the directories on the way, leaving
+ * the path in @dir
+ */
+static void make_dirs(char *dir, const char *root, const char *ctrl,
+		      const char *cg, const char *name)
+{
+	const char *parts[] = { ctrl, cg, name };
+	size_t len;
+
+	len = snprintf(dir, PATH_MAX, "%s", root);
+	for(size_t i = 0; i < sizeof(parts) / sizeof(*parts); i++)	{
+		if(parts[i] == NULL)
+			continue;
+		len += snprintf(dir + len, PATH_MAX - len, "/%s", parts[i]);
+		if(len >= PATH_MAX)
+			log_exit("Path too long under %s", root);
+		make_dir(dir);
+	}
+}
+
+static FILE *open_file(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+
+	if((fp = fopen(join_path(path, sizeof(path), dir, name), "w")) == NULL)
+		log_exit("Can't write %s: %s", path, strerror(errno));
+	return fp;
+}
+
+static void put(const char *dir, const char *name, const char *fmt, ...)
+{
+	FILE *fp = open_file(dir, name);
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(fp, fmt, ap);
+	va_end(ap);
+	fclose(fp);
+}
+
+/* One pid per line, from @first */
+static void put_pids(const char *dir, const char *name, uint64_t first, int n)
+{
+	FILE *fp = open_file(dir, name);
+
+	for(int i = 0; i < n; i++)
+		fprintf(fp, "%" PRIu64 "\n", first + i);
+	fclose(fp);
+}
+
+/* What a slot is using, made up */
+struct usage {
+	uint64_t rss, cache, swap, mapped, user_ticks, sys_ticks, usage_ns;
+	uint64_t soft_limit, first_pid;
+	int procs;
+};
+
+static void v1_memory_stat(const char *dir, const struct usage *u)
+{
+	FILE *fp = open_file(dir, "memory.stat");
+	const uint64_t pgfault = rnd(50000000), pgmajfault = rnd(2000);
+	const uint64_t pgin = rnd(80000000), pgout = rnd(80000000);
+
+	/* The slot's own counts, then its totals including any children */
+	for(int total = 0; total < 2; total++)	{
+		const char *t = total ? "total_" : "";
+		fprintf(fp,
+			"%scache %" PRIu64 "\n%srss %" PRIu64 "\n"
+			"%srss_huge %" PRIu64 "\n%sshmem 0\n"
+			"%smapped_file %" PRIu64 "\n%sdirty 135168\n"
+			"%swriteback 0\n%sswap %" PRIu64 "\n"
+			"%spgpgin %" PRIu64 "\n%spgpgout %" PRIu64 "\n"
+			"%spgfault %" PRIu64 "\n%spgmajfault %" PRIu64 "\n"
+			"%sinactive_anon %" PRIu64 "\n"
+			"%sactive_anon %" PRIu64 "\n"
+			"%sinactive_file %" PRIu64 "\n"
+			"%sactive_file %" PRIu64 "\n"
+			"%sunevictable 0\n",
+			t, u->cache, t, u->rss, t, u->rss / 4, t, t, u->mapped,
+			t, t, t, u->swap, t, pgin, t, pgout, t, pgfault, t,
+			pgmajfault, t, u->rss / 8, t, u->rss - u->rss / 8, t,
+			u->cache / 3, t, u->cache - u->cache / 3, t);
+		if(!total)
+			fprintf(fp, "hierarchical_memory_limit "
+				"9223372036854771712\nhierarchical_memsw_limit "
+				"9223372036854771712\n");
+	}
+	fclose(fp);
+}
+
+static void v2_memory_stat(const char *dir, const struct usage *u)
+{
+	FILE *fp = open_file(dir, "memory.stat");
+
+	fprintf(fp,
+		"anon %" PRIu64 "\nfile %" PRIu64 "\nkernel 4227072\n"
+		"kernel_stack 393216\npagetables 1421312\nsec_pagetables 0\n"
+		"percpu 2880\nsock 0\nvmalloc 0\nshmem 0\nzswap 0\nzswapped 0\n"
+		"file_mapped %" PRIu64 "\nfile_dirty 135168\nfile_writeback 0\n"
+		"swapcached 0\nanon_thp %" PRIu64 "\nfile_thp 0\nshmem_thp 0\n"
+		"inactive_anon %" PRIu64 "\nactive_anon %" PRIu64 "\n"
+		"inactive_file %" PRIu64 "\nactive_file %" PRIu64 "\n"
+		"unevictable 0\nslab_reclaimable 1283040\n"
+		"slab_unreclaimable 632848\nslab 1915888\n"
+		"workingset_refault_anon 0\nworkingset_refault_file 1331\n"
+		"workingset_activate_anon 0\nworkingset_activate_file 212\n"
+		"workingset_restore_anon 0\nworkingset_restore_file 0\n"
+		"workingset_nodereclaim 0\npgscan 0\npgsteal 0\n"
+		"pgscan_kswapd 0\npgscan_direct 0\npgsteal_kswapd 0\n"
+		"pgsteal_direct 0\npgfault %" PRIu64 "\n"
+		"pgmajfault %" PRIu64 "\n"
+		"pgrefill 0\npgactivate 7921\npgdeactivate 0\npglazyfree 0\n"
+		"pglazyfreed 0\nthp_fault_alloc 12\nthp_collapse_alloc 0\n",
+		u->rss, u->cache, u->mapped, u->rss / 4, u->rss / 8,
+		u->rss - u->rss / 8, u->cache / 3, u->cache - u->cache / 3,
+		rnd(50000000), rnd(2000));
+	fclose(fp);
+}
+
+static void make_v1_slot(const char *root, const char *cg, const char *name,
+			 const struct usage *u,
+			 const struct fake_cgroup_opts *o)
+{
+	char dir[PATH_MAX];
+
+	make_dirs(dir, root, "cpu", cg, name);
+	put(dir, "cpu.shares", "%d\n", 100 * u->procs);
+	put(dir, "cpuacct.stat", "user %" PRIu64 "\nsystem %" PRIu64 "\n",
+	    u->user_ticks, u->sys_ticks);
+	put(dir, "cpuacct.usage", "%" PRIu64 "\n", u->usage_ns);
+	put_pids(dir, "cgroup.procs", u->first_pid, u->procs);
+	put_pids(dir, "tasks", u->first_pid, o->n_tasks);
+
+	make_dirs(dir, root, "memory", cg, name);
+	v1_memory_stat(dir, u);
+	put(dir, "memory.soft_limit_in_bytes", "%" PRIu64 "\n", u->soft_limit);
+	put(dir, "memory.usage_in_bytes", "%" PRIu64 "\n",
+	    u->rss + u->cache + u->swap);
+	put_pids(dir, "cgroup.procs", u->first_pid, u->procs);
+	put_pids(dir, "tasks", u->first_pid, o->n_tasks);
+
+	if(o->pids)	{
+		make_dirs(dir, root, "pids", cg, name);
+		put(dir, "pids.current", "%d\n", o->n_tasks);
+		put_pids(dir, "cgroup.procs", u->first_pid, u->procs);
+		put_pids(dir, "tasks", u->first_pid, o->n_tasks);
+	}
+}
+
+static void make_v2_slot(const char *root, const char *cg, const char *name,
+			 const struct usage *u,
+			 const struct fake_cgroup_opts *o)
+{
+	char dir[PATH_MAX];
+	uint64_t user_usec = u->user_ticks * 10000;
+	uint64_t sys_usec = u->sys_ticks * 10000;
+
+	make_dirs(dir, root, NULL, cg, name);
+	put(dir, "cpu.stat", "usage_usec %" PRIu64 "\nuser_usec %" PRIu64 "\n"
+	    "system_usec %" PRIu64 "\nnr_periods 0\nnr_throttled 0\n"
+	    "throttled_usec 0\nnr_bursts 0\nburst_usec 0\n",
+	    user_usec + sys_usec, user_usec, sys_usec);
+	put(dir, "cpu.weight", "%d\n", 4 * u->procs);
+	v2_memory_stat(dir, u);
+	put(dir, "memory.current", "%" PRIu64 "\n", u->rss + u->cache);
+	put(dir, "memory.high", "%" PRIu64 "\n", u->soft_limit);
+	put(dir, "memory.swap.current", "%" PRIu64 "\n", u->swap);
+	put_pids(dir, "cgroup.procs", u->first_pid, u->procs);
+	put_pids(dir, "cgroup.threads", u->first_pid, o->n_tasks);
+	put(dir, "cgroup.events", "populated 1\nfrozen 0\n");
+	if(o->pids)
+		put(dir, "pids.current", "%d\n", o->n_tasks);
+}
+
+void fake_cgroup_make(const char *root, const struct fake_cgroup_opts *o)
+{
+	char name[NAME_MAX];
+	char dir[PATH_MAX];
+
+	if(o->v2)	{
+		put(root, "cgroup.controllers", "cpuset cpu io memory pids\n");
+		make_dirs(dir, root, NULL, o->cg_name, NULL);
+		put(dir, "cgroup.procs", "");
+	}
+
+	for(int i = 1; i <= o->n_slots; i++)	{
+		struct usage u;
+
+		u.rss = (64 + rnd(4032)) << 20;
+		u.cache = (1 + rnd(1024)) << 20;
+		u.swap = rnd(8) ? 0 : rnd(256) << 20;
+		u.mapped = u.cache / 4;
+		u.user_ticks = rnd(100000000);
+		u.sys_ticks = u.user_ticks / (4 + rnd(16));
+		u.usage_ns = (u.user_ticks + u.sys_ticks) * 10000000;
+		u.soft_limit = (uint64_t)(1 + rnd(8)) << 31;
+		u.first_pid = 100000 + (uint64_t)i * o->n_tasks;
+		u.procs = 1 + o->n_tasks / 8;
+
+		/* What condor names them, after its execute directory */
+		snprintf(name, sizeof(name),
+			 "condor_var_lib_condor_execute_slot1_%d@%s", i,
+			 o->host);
+		if(o->v2)
+			make_v2_slot(root, o->cg_name, name, &u, o);
+		else
+			make_v1_slot(root, o->cg_name, name, &u, o);
+	}
+}
+
+static int remove_one(const char *path, const struct stat *st, int flag,
+		      struct FTW *ftw)
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	if(remove(path) != 0)
+		fprintf(stderr, "Can't remove %s: %s\n", path, strerror(errno));
+	return 0;
+}
+
+void fake_cgroup_remove(const char *root)
+{
+	nftw(root, remove_one, 64, FTW_DEPTH | FTW_PHYS);
+}
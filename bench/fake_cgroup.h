@@ -0,0 +1,29 @@
+#ifndef _FAKE_CGROUP_H
+#define _FAKE_CGROUP_H
+
+#include <stdbool.h>
+
+/* What sort of fake cgroup tree to make */
+struct fake_cgroup_opts {
+	bool v2;		/* unified hierarchy, not v1 controllers */
+	bool pids;		/* with the pids controller, so pids.current */
+	int n_slots;		/* dynamic slots, slot1_1 to slot1_N */
+	int n_tasks;		/* lines in each slot's tasks file */
+	const char *cg_name;	/* condor's cgroup, e.g. htcondor */
+	const char *host;	/* the @host in slot cgroup names */
+};
+
+/**
+ * Make a fake cgroup filesystem under @root, laid out like /sys/fs/cgroup and
+ * with files that look like a busy condor execute node's, to be read with
+ * set_cgroup_root(@root). Exits on any error.
+ *
+ * @param[in] root existing (empty) directory to make it in
+ * @param[in] o what to make
+ */
+void fake_cgroup_make(const char *root, const struct fake_cgroup_opts *o);
+
+/* Remove everything under @root, and @root itself */
+void fake_cgroup_remove(const char *root);
+
+#endif
@@ -0,0 +1,88 @@
+/**
+ * Receive metrics on the loopback interface like carbon or statsd would, check
+ * each one parses and say how many came when stopped with ^C or SIGTERM
+ *
+ * Usage: metric_sink [-t] [-f graphite|statsd|pickle|influx] [PORT]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "sink.h"
+#include "util.h"
+
+static volatile sig_atomic_t stop = 0;
+
+static void handle_stop(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+"Usage: %s [-t] [-f graphite|statsd|pickle|influx] [PORT]\n\n"
+"Receive metrics on 127.0.0.1:PORT (default any free port), checking each\n"
+"one parses, and print how many there were when stopped with ^C\n\n"
+"\t-t listen for TCP connections instead of UDP datagrams\n"
+"\t-f FORMAT: what's sent (default graphite, pickle implies -t)\n",
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	enum sink_format f = SINK_GRAPHITE;
+	int socktype = SOCK_DGRAM;
+	struct sink_stats st;
+	int port = 0;
+	int fd, c;
+
+	while((c = getopt(argc, argv, "tf:h")) != -1)	{
+		switch(c)	{
+		case 't':
+			socktype = SOCK_STREAM;
+			break;
+		case 'f':
+			if(strcmp(optarg, "graphite") == 0)
+				f = SINK_GRAPHITE;
+			else if(strcmp(optarg, "statsd") == 0)
+				f = SINK_STATSD;
+			else if(strcmp(optarg, "pickle") == 0)
+				f = SINK_PICKLE;
+			else if(strcmp(optarg, "influx") == 0)
+				f = SINK_INFLUX;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(optind + 1 < argc)
+		usage(argv[0]);
+	if(optind < argc && (port = atoi(argv[optind])) <= 0)
+		usage(argv[0]);
+	if(f == SINK_PICKLE)
+		socktype = SOCK_STREAM;
+
+	signal(SIGINT, handle_stop);
+	signal(SIGTERM, handle_stop);
+	fd = sink_listen(socktype, &port);
+	printf("Listening on 127.0.0.1:%d/%s\n", port,
+	       socktype == SOCK_STREAM ? "tcp" : "udp");
+	fflush(stdout);
+
+	sink_run(fd, f, &st, &stop);
+	close(fd);
+	printf("%" PRIu64 " metrics, %" PRIu64 " bad, %" PRIu64 " bytes in %"
+	       PRIu64 " %s, %" PRIu64 " connections\n", st.metrics, st.bad,
+	       st.bytes, st.packets,
+	       socktype == SOCK_STREAM ? "frames" : "datagrams", st.conns);
+	return st.bad > 0;
+}
@@ -0,0 +1,72 @@
+/**
+ * Make a fake cgroup tree of condor slots, to point condor_cg_graphite -r at
+ *
+ * Usage: mkcgtree [-2] [-p] [-t TASKS] [-c CGROUP] [-H HOST] DIR N_SLOTS
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <string.h>
+
+#include "fake_cgroup.h"
+#include "cgroup.h"
+#include "util.h"
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+"Usage: %s [-2] [-p] [-t TASKS] [-c CGROUP] [-H HOST] DIR N_SLOTS\n\n"
+"Make a fake cgroup filesystem in DIR (made if it doesn't exist) with N_SLOTS\n"
+"condor slots, to read with condor_cg_graphite -r DIR\n\n"
+"\t-2 cgroup v2 unified hierarchy, instead of v1 controllers\n"
+"\t-p with the pids controller\n"
+"\t-t TASKS: lines in each slot's tasks file (default 200)\n"
+"\t-c CGROUP: condor cgroup name (default %s)\n"
+"\t-H HOST: host in the slot cgroup names (default node001.example.com)\n",
+		progname, default_cgroup_name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct fake_cgroup_opts o = {
+		.n_tasks = 200,
+		.cg_name = default_cgroup_name,
+		.host = "node001.example.com",
+	};
+	int c;
+
+	while((c = getopt(argc, argv, "2pt:c:H:h")) != -1)	{
+		switch(c)	{
+		case '2':
+			o.v2 = true;
+			break;
+		case 'p':
+			o.pids = true;
+			break;
+		case 't':
+			o.n_tasks = atoi(optarg);
+			break;
+		case 'c':
+			o.cg_name = optarg;
+			break;
+		case 'H':
+			o.host = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(optind + 2 != argc || (o.n_slots = atoi(argv[optind + 1])) <= 0 ||
+	   o.n_tasks <= 0)
+		usage(argv[0]);
+
+	if(mkdir(argv[optind], 0755) != 0 && errno != EEXIST)
+		log_exit("Can't make %s: %s", argv[optind], strerror(errno));
+	fake_cgroup_make(argv[optind], &o);
+	printf("Made %d %s slots in %s\n", o.n_slots, o.v2 ? "v2" : "v1",
+	       argv[optind]);
+	return 0;
+}
@@ -0,0 +1,277 @@
+/**
+ * Round-trip check of the graphite pickle sender: send a known set of uint,
+ * int and float metrics over a GRAPHITE_PICKLE connection to ourselves,
+ * decode the length-prefixed frames that arrive and check every path,
+ * timestamp and value came back as sent, in order. Enough metrics are sent
+ * by default for the batch to be split over more than one frame.
+ *
+ * Usage: pickle_check [N_METRICS]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "graphite.h"
+#include "util.h"
+
+#define CHECK_SHOW_BAD 5
+#define CHECK_MAX_PATH 256
+
+/* What each metric is sent as */
+enum kind { K_UINT, K_INT, K_FLOAT };
+
+struct expected {
+	enum kind kind;
+	uint64_t u;
+	int64_t i;
+	float f;
+};
+
+/* Values that take each of the sender's encodings: BININT, the 9-byte
+ * unsigned and 8-byte signed LONG1s, and BINFLOAT */
+static const struct expected values[] = {
+	{ K_UINT, .u = 0 },
+	{ K_UINT, .u = 1 },
+	{ K_UINT, .u = INT32_MAX },
+	{ K_UINT, .u = (uint64_t)INT32_MAX + 1 },
+	{ K_UINT, .u = UINT32_MAX },
+	{ K_UINT, .u = 1ULL << 40 },
+	{ K_UINT, .u = (1ULL << 56) - 1 },
+	{ K_INT, .i = -1 },
+	{ K_INT, .i = INT32_MIN },
+	{ K_INT, .i = (int64_t)INT32_MIN - 1 },
+	{ K_INT, .i = INT32_MAX },
+	{ K_INT, .i = -(1LL << 50) },
+	{ K_FLOAT, .f = 0.5f },
+	{ K_FLOAT, .f = -3.25f },
+	{ K_FLOAT, .f = 1e10f },
+};
+#define N_VALUES (sizeof(values) / sizeof(*values))
+
+/* Everything received, read by its own thread so the sender never waits */
+static int listen_fd;
+static char *received = NULL;
+static size_t received_len = 0;
+
+static uint64_t bad = 0;
+
+static void _bad(size_t n, const char *what)
+{
+	if(bad++ < CHECK_SHOW_BAD)
+		fprintf(stderr, "pickle_check: metric %zu: bad %s\n", n, what);
+}
+
+static void *reader(void *arg)
+{
+	size_t size = 1 << 20;
+	ssize_t n;
+	int fd;
+
+	(void)arg;
+	if((fd = accept(listen_fd, NULL, NULL)) < 0)
+		log_exit("accept() failed: %s", strerror(errno));
+	received = xcalloc(size);
+	while((n = read(fd, received + received_len,
+			size - received_len)) > 0)	{
+		received_len += n;
+		if(received_len == size &&
+		   (received = realloc(received, size *= 2)) == NULL)
+			log_exit("Realloc error on received frames");
+	}
+	close(fd);
+	return NULL;
+}
+
+static void metric_name(char *name, size_t len, size_t n)
+{
+	snprintf(name, len, "bench.pickle_check.node001_example_com.slot1_%zu."
+		 "metric_%zu", n / N_VALUES, n % N_VALUES);
+}
+
+static uint64_t le(const unsigned char *p, int len)
+{
+	uint64_t v = 0;
+
+	for(int i = len - 1; i >= 0; i--)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/* An integer at @p, as BININT or LONG1, its two's complement bits in @bits
+ * and whether it's negative in @neg. Returns where it ends or NULL.
+ */
+static const unsigned char *_int(const unsigned char *p,
+				 const unsigned char *end, uint64_t *bits,
+				 bool *neg)
+{
+	if(end - p >= 5 && p[0] == 'J')	{
+		*bits = (uint64_t)(int64_t)(int32_t)le(p + 1, 4);
+		*neg = (p[4] & 0x80) != 0;
+		return p + 5;
+	}
+	if(end - p >= 2 && p[0] == (unsigned char)'\x8a' &&
+	   (p[1] == 8 || (p[1] == 9 && end - p >= 11 && p[10] == 0)) &&
+	   end - p >= 2 + p[1])	{
+		*bits = le(p + 2, 8);
+		*neg = p[1] == 8 && (p[9] & 0x80);
+		return p + 2 + p[1];
+	}
+	return NULL;
+}
+
+/* Check that the tuple at @p is metric @n as sent at @ts, returning where it
+ * ends or NULL if it can't be decoded at all
+ */
+static const unsigned char *_tuple(const unsigned char *p,
+				   const unsigned char *end, size_t n,
+				   int64_t ts)
+{
+	const struct expected *e = &values[n % N_VALUES];
+	char name[CHECK_MAX_PATH];
+	uint64_t bits;
+	size_t len;
+	bool neg;
+
+	if(end - p < 5 || p[0] != 'X')
+		return NULL;
+	len = le(p + 1, 4);
+	p += 5;
+	if((size_t)(end - p) < len)
+		return NULL;
+	metric_name(name, sizeof(name), n);
+	if(len != strlen(name) || memcmp(p, name, len) != 0)
+		_bad(n, "path");
+	p += len;
+
+	if((p = _int(p, end, &bits, &neg)) == NULL)
+		return NULL;
+	if((int64_t)bits != ts)
+		_bad(n, "timestamp");
+
+	if(e->kind == K_FLOAT)	{
+		uint64_t b;
+		double d;
+
+		if(end - p < 9 || p[0] != 'G')
+			return NULL;
+		b = 0;
+		for(int i = 1; i <= 8; i++)
+			b = (b << 8) | p[i];
+		memcpy(&d, &b, sizeof(d));
+		if(d != (double)e->f)
+			_bad(n, "float");
+		p += 9;
+	} else	{
+		if((p = _int(p, end, &bits, &neg)) == NULL)
+			return NULL;
+		if(e->kind == K_UINT ? (neg || bits != e->u) :
+		   ((int64_t)bits != e->i || neg != (e->i < 0)))
+			_bad(n, "integer");
+	}
+
+	if(end - p < 2 || p[0] != (unsigned char)'\x86' ||
+	   p[1] != (unsigned char)'\x86')
+		return NULL;
+	return p + 2;
+}
+
+/* Decode the frames, checking they hold metrics 0 to @n_metrics - 1 in
+ * order, returning how many frames there were
+ */
+static int check_frames(size_t n_metrics, int64_t ts)
+{
+	const unsigned char *p = (const unsigned char *)received;
+	const unsigned char *end = p + received_len;
+	size_t n = 0;
+	int frames = 0;
+
+	while(p < end)	{
+		const unsigned char *f_end;
+		uint32_t len;
+
+		if(end - p < 4)
+			log_exit("Frame length cut short");
+		len = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+		if(len > PICKLE_MAX_FRAME || (size_t)(end - p - 4) < len)
+			log_exit("Frame %d is %u bytes", frames, len);
+		f_end = p + 4 + len;
+		p += 4;
+		frames++;
+
+		/* PROTO 2, EMPTY_LIST, MARK, the tuples, APPENDS, STOP */
+		if(len < 6 || memcmp(p, "\x80\x02](", 4) != 0 ||
+		   memcmp(f_end - 2, "e.", 2) != 0)
+			log_exit("Frame %d isn't a list of tuples", frames);
+		for(p += 4; p < f_end - 2; n++)
+			if(n >= n_metrics ||
+			   (p = _tuple(p, f_end - 2, n, ts)) == NULL)
+				log_exit("Frame %d can't be decoded at metric "
+					 "%zu", frames, n);
+		p = f_end;
+	}
+	if(n != n_metrics)
+		log_exit("%zu metrics sent, %zu came back", n_metrics, n);
+	return frames;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t n_metrics = (argc > 1) ? (size_t)atol(argv[1]) : 20000;
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t addr_len = sizeof(addr);
+	char port[16], name[CHECK_MAX_PATH];
+	pthread_t tid;
+	time_t ts;
+	int fd, frames;
+
+	if(n_metrics == 0)
+		log_exit("Usage: %s [N_METRICS]", argv[0]);
+
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	   bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	   listen(listen_fd, 1) != 0 ||
+	   getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) != 0)
+		log_exit("Can't listen: %s", strerror(errno));
+	snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+	if(pthread_create(&tid, NULL, reader, NULL) != 0)
+		log_exit("Can't start reader thread");
+
+	/* The sender's timestamp is taken at graphite_update_time(), so make
+	 * sure it's not in a different second to ours */
+	graphite_init();
+	do	{
+		ts = time(NULL);
+		graphite_update_time();
+	} while(time(NULL) != ts);
+	fd = graphite_connect("127.0.0.1", port, GRAPHITE_PICKLE, false);
+	for(size_t n = 0; n < n_metrics; n++)	{
+		const struct expected *e = &values[n % N_VALUES];
+
+		metric_name(name, sizeof(name), n);
+		if(e->kind == K_UINT)
+			graphite_send_uint(fd, name, e->u);
+		else if(e->kind == K_INT)
+			graphite_send_int(fd, name, e->i);
+		else
+			graphite_send_float(fd, name, e->f);
+	}
+	graphite_close(fd);
+	pthread_join(tid, NULL);
+	close(listen_fd);
+
+	frames = check_frames(n_metrics, ts);
+	printf("%zu metrics in %d frames (%zu bytes), %lu bad\n", n_metrics,
+	       frames, received_len, (unsigned long)bad);
+	free(received);
+	return bad > 0;
+}
@@ -0,0 +1,276 @@
+/**
+ * Scrape a collector's /metrics like Prometheus would, from several threads
+ * at once, checking every response is well-formed text exposition format and
+ * reporting how long the scrapes took
+ *
+ * Usage: prom_scrape [-n SCRAPES] [-c CLIENTS] [HOST:]PORT
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "sink.h"
+#include "util.h"
+
+#define SCRAPE_SHOW_BAD 5
+#define SCRAPE_MAX_NAME 256
+
+static const char *host = "localhost";
+static const char *port;
+static int n_scrapes = 100, n_clients = 4;
+
+/* Each scrape's time in ns, in the order they were taken */
+static uint64_t *times;
+static int next_scrape = 0;
+static uint64_t total_samples = 0, total_bytes = 0, bad = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage(const char *progname)
+{
+	fprintf(stderr,
+"Usage: %s [-n SCRAPES] [-c CLIENTS] [HOST:]PORT\n\n"
+"GET /metrics SCRAPES times from HOST (default localhost) over CLIENTS\n"
+"connections at once, check each response parses as the Prometheus text\n"
+"format and report how long they took\n\n"
+"\t-n SCRAPES: scrapes to make in all (default 100)\n"
+"\t-c CLIENTS: scrapes made at once (default 4)\n",
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+static void _bad(const char *what, const char *s, size_t len)
+{
+	pthread_mutex_lock(&lock);
+	if(bad++ < SCRAPE_SHOW_BAD)
+		fprintf(stderr, "scrape: bad %s: '%.*s'\n", what,
+			(int)(len > 200 ? 200 : len), s);
+	pthread_mutex_unlock(&lock);
+}
+
+/* [a-zA-Z_:][a-zA-Z0-9_:]*, returning where it ends or NULL */
+static const char *_name(const char *s, const char *end)
+{
+	if(s == end || !(isalpha((unsigned char)*s) || *s == '_' || *s == ':'))
+		return NULL;
+	for(s++; s < end; s++)
+		if(!(isalnum((unsigned char)*s) || *s == '_' || *s == ':'))
+			break;
+	return s;
+}
+
+/* {name="value",...} at @s, returning where it ends or NULL */
+static const char *_labels(const char *s, const char *end)
+{
+	if(s == end || *s != '{')
+		return s;
+	for(s++; s < end && *s != '}'; )	{
+		if((s = _name(s, end)) == NULL || end - s < 2 ||
+		   s[0] != '=' || s[1] != '"')
+			return NULL;
+		for(s += 2; s < end && *s != '"'; s++)
+			if(*s == '\\' && ++s == end)
+				return NULL;
+		if(s == end)
+			return NULL;
+		if(++s < end && *s == ',')
+			s++;
+	}
+	return s < end ? s + 1 : NULL;
+}
+
+/* Is the family @name of @len bytes, with type [type, end) after a space, a
+ * counter without the _total that OpenMetrics requires */
+static bool _counter_misnamed(const char *name, size_t len, const char *type,
+			      const char *end)
+{
+	static const char suffix[] = "_total";
+	const size_t s_len = sizeof(suffix) - 1;
+
+	if(end - type != 8 || memcmp(type, " counter", 8) != 0)
+		return false;
+	return len < s_len || memcmp(name + len - s_len, suffix, s_len) != 0;
+}
+
+/* Check the body a line at a time: every sample has to follow the TYPE of its
+ * family, and be name{labels} value. Returns how many samples there were.
+ */
+static uint64_t _body(const char *s, const char *end)
+{
+	char family[SCRAPE_MAX_NAME] = "";
+	size_t family_len = 0;
+	uint64_t samples = 0;
+
+	while(s < end)	{
+		const char *nl = memchr(s, '\n', end - s);
+		const char *p;
+
+		if(nl == NULL)	{
+			_bad("last line", s, end - s);
+			break;
+		}
+		if(strncmp(s, "# TYPE ", 7) == 0)	{
+			if((p = _name(s + 7, nl)) == NULL || *p != ' ' ||
+			   (size_t)(p - s - 7) >= sizeof(family))	{
+				_bad("TYPE", s, nl - s);
+			} else	{
+				family_len = p - s - 7;
+				memcpy(family, s + 7, family_len);
+				if(_counter_misnamed(family, family_len, p, nl))
+					_bad("counter name", s, nl - s);
+			}
+		} else if(*s != '#')	{
+			if((p = _name(s, nl)) == NULL)
+				_bad("name", s, nl - s);
+			else if((size_t)(p - s) != family_len ||
+				memcmp(s, family, family_len) != 0)
+				_bad("sample before its TYPE", s, nl - s);
+			else if((p = _labels(p, nl)) == NULL || *p != ' ')
+				_bad("labels", s, nl - s);
+			else if(!sink_number(p + 1, nl))
+				_bad("value", s, nl - s);
+			else
+				samples++;
+		}
+		s = nl + 1;
+	}
+	return samples;
+}
+
+/* One scrape, checked, returning how long it took */
+static uint64_t scrape(void)
+{
+	static const char req[] = "GET /metrics HTTP/1.1\r\n"
+				  "Host: localhost\r\n"
+				  "Accept: text/plain\r\n\r\n";
+	size_t len = 0, size = 1 << 16;
+	char *buf = xcalloc(size);
+	uint64_t t0 = monotonic_ns(), t;
+	const char *body;
+	ssize_t n;
+	int fd;
+
+	fd = server_connect(host, port, SOCK_STREAM);
+	if(write(fd, req, sizeof(req) - 1) != (ssize_t)sizeof(req) - 1)
+		log_exit("Can't send request: %s", strerror(errno));
+	/* The collector closes the connection after each response */
+	while((n = read(fd, buf + len, size - len - 1)) > 0)	{
+		len += n;
+		if(len + 1 == size &&
+		   (buf = realloc(buf, size *= 2)) == NULL)
+			log_exit("Realloc error on response");
+	}
+	t = monotonic_ns() - t0;
+	close(fd);
+	buf[len] = '\0';
+
+	if(strncmp(buf, "HTTP/1.1 200 ", 13) != 0)	{
+		_bad("status", buf, strcspn(buf, "\r\n"));
+	} else if((body = strstr(buf, "\r\n\r\n")) == NULL)	{
+		_bad("headers", buf, len);
+	} else if(strstr(buf, "\r\nContent-Type: text/plain; version=0.0.4")
+		  == NULL || strstr(buf, "\r\nContent-Type") > body)	{
+		_bad("content type", buf, body - buf);
+	} else	{
+		uint64_t samples = _body(body + 4, buf + len);
+
+		pthread_mutex_lock(&lock);
+		total_samples += samples;
+		total_bytes += len;
+		pthread_mutex_unlock(&lock);
+	}
+	free(buf);
+	return t;
+}
+
+static void *client(void *arg)
+{
+	(void)arg;
+	for(;;)	{
+		uint64_t t;
+		int i;
+
+		pthread_mutex_lock(&lock);
+		i = next_scrape++;
+		pthread_mutex_unlock(&lock);
+		if(i >= n_scrapes)
+			break;
+		t = scrape();
+		times[i] = t;
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t *threads;
+	uint64_t t0, wall;
+	char *colon;
+	int c;
+
+	while((c = getopt(argc, argv, "n:c:h")) != -1)	{
+		switch(c)	{
+		case 'n':
+			if((n_scrapes = atoi(optarg)) <= 0)
+				usage(argv[0]);
+			break;
+		case 'c':
+			if((n_clients = atoi(optarg)) <= 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(optind + 1 != argc)
+		usage(argv[0]);
+	port = argv[optind];
+	if((colon = strrchr(argv[optind], ':')) != NULL)	{
+		*colon = '\0';
+		host = argv[optind];
+		port = colon + 1;
+		/* [::1]:PORT */
+		if(host[0] == '[' && colon[-1] == ']')	{
+			colon[-1] = '\0';
+			host++;
+		}
+	}
+
+	times = xcalloc(n_scrapes * sizeof(*times));
+	threads = xcalloc(n_clients * sizeof(*threads));
+	t0 = monotonic_ns();
+	for(int i = 0; i < n_clients; i++)
+		if(pthread_create(&threads[i], NULL, client, NULL) != 0)
+			log_exit("Can't start client thread");
+	for(int i = 0; i < n_clients; i++)
+		pthread_join(threads[i], NULL);
+	wall = monotonic_ns() - t0;
+
+	qsort(times, n_scrapes, sizeof(*times), cmp_u64);
+	printf("%d scrapes by %d clients in %.3fs (%.1f/s), %lu bad\n",
+	       n_scrapes, n_clients, wall / 1e9, n_scrapes * 1e9 / wall,
+	       (unsigned long)bad);
+	printf("%.1f samples, %.1fKB a scrape\n",
+	       (double)total_samples / n_scrapes,
+	       total_bytes / 1024.0 / n_scrapes);
+	printf("latency ms: min %.3f median %.3f p99 %.3f max %.3f\n",
+	       times[0] / 1e6, times[n_scrapes / 2] / 1e6,
+	       times[(n_scrapes * 99) / 100] / 1e6,
+	       times[n_scrapes - 1] / 1e6);
+	free(threads);
+	free(times);
+	return bad > 0;
+}
@@ -0,0 +1,514 @@
+/**
+ * A stand-in for carbon or statsd on the loopback interface, which checks that
+ * every metric it's sent parses and counts them
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sink.h"
+#include "util.h"
+
+#define SINK_BUFSIZE 65536
+#define SINK_RCVBUF (8 << 20)
+#define SINK_MAX_FRAME (16 << 20)
+#define SINK_SHOW_BAD 5
+
+/* One TCP sender, and what it's sent that isn't a whole line or frame yet */
+struct sink_conn {
+	int fd;
+	char *buf;
+	size_t len, size;
+};
+
+int sink_listen(int socktype, int *port)
+{
+	struct sockaddr_in sa = {
+		.sin_family = AF_INET,
+		.sin_port = htons(*port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(sa);
+	int rcvbuf = SINK_RCVBUF;
+	int one = 1;
+	int fd;
+
+	if((fd = socket(AF_INET, socktype, 0)) < 0)
+		log_exit("socket() failed: %s", strerror(errno));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	/* Give bursts of datagrams somewhere to go, as much as we're let */
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if(bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+		log_exit("Can't listen on port %d: %s", *port, strerror(errno));
+	if(socktype == SOCK_STREAM && listen(fd, 64) != 0)
+		log_exit("listen() failed: %s", strerror(errno));
+	if(getsockname(fd, (struct sockaddr *)&sa, &len) != 0)
+		log_exit("getsockname() failed: %s", strerror(errno));
+	*port = ntohs(sa.sin_port);
+	return fd;
+}
+
+static void _bad(struct sink_stats *st, const char *what, const char *s,
+		 size_t len)
+{
+	if(st->bad++ >= SINK_SHOW_BAD)
+		return;
+	if(len > 0)
+		fprintf(stderr, "sink: bad %s: '%.*s'\n", what,
+			(int)(len > 200 ? 200 : len), s);
+	else
+		fprintf(stderr, "sink: bad %s\n", what);
+}
+
+bool sink_number(const char *s, const char *end)
+{
+	char tmp[64];
+	char *e;
+	double d;
+
+	if(s == end || end - s >= (long)sizeof(tmp))
+		return false;
+	memcpy(tmp, s, end - s);
+	tmp[end - s] = '\0';
+	d = strtod(tmp, &e);
+	return *e == '\0' && isfinite(d);
+}
+
+/* A metric path: no spaces or control characters, and not empty */
+static bool _path(const char *s, const char *end)
+{
+	if(s == end)
+		return false;
+	for(; s < end; s++)
+		if(*s <= ' ' || *s == 0x7f)
+			return false;
+	return true;
+}
+
+/* "path value timestamp" */
+static bool _graphite_line(const char *s, size_t len)
+{
+	const char *end = s + len;
+	const char *sp1, *sp2;
+
+	if((sp1 = memchr(s, ' ', len)) == NULL ||
+	   (sp2 = memchr(sp1 + 1, ' ', end - sp1 - 1)) == NULL)
+		return false;
+	if(!_path(s, sp1) || !sink_number(sp1 + 1, sp2) || sp2 + 1 == end)
+		return false;
+	for(const char *p = sp2 + 1; p < end; p++)
+		if(!isdigit((unsigned char)*p))
+			return false;
+	return true;
+}
+
+/* "path:value|type" */
+static bool _statsd_line(const char *s, size_t len)
+{
+	const char *end = s + len;
+	const char *colon, *bar;
+	size_t tlen;
+
+	if((colon = memchr(s, ':', len)) == NULL ||
+	   (bar = memchr(colon, '|', end - colon)) == NULL)
+		return false;
+	if(!_path(s, colon) || !sink_number(colon + 1, bar))
+		return false;
+	tlen = end - bar - 1;
+	return (tlen == 1 && (bar[1] == 'g' || bar[1] == 'c' ||
+			      bar[1] == 's')) ||
+	       (tlen == 2 && memcmp(bar + 1, "ms", 2) == 0);
+}
+
+/* Where the next space not escaped with a backslash is in [s, end), or NULL */
+static const char *_unescaped_space(const char *s, const char *end)
+{
+	for(; s < end; s++)	{
+		if(*s == '\\')
+			s++;
+		else if(*s == ' ')
+			return s;
+	}
+	return NULL;
+}
+
+/* "measurement,tag=value,... field=123i,... timestamp", adding how many fields
+ * there were to @n_fields
+ */
+static bool _influx_line(const char *s, size_t len, uint64_t *n_fields)
+{
+	const char *end = s + len;
+	const char *sp1, *sp2, *p;
+	uint64_t n = 0;
+
+	if((sp1 = _unescaped_space(s, end)) == NULL ||
+	   (sp2 = _unescaped_space(sp1 + 1, end)) == NULL || sp1 == s ||
+	   *s == ',')
+		return false;
+	/* Each tag and field is key=value, and every field value a number
+	 * (integers with an i after) */
+	for(p = s; p < sp1 && (p = memchr(p, ',', sp1 - p)) != NULL; p++)
+		if(memchr(p, '=', sp1 - p) == NULL)
+			return false;
+	for(p = sp1 + 1; p < sp2; n++)	{
+		const char *comma = memchr(p, ',', sp2 - p);
+		const char *eq, *vend = comma ? comma : sp2;
+
+		if((eq = memchr(p, '=', vend - p)) == NULL || eq == p)
+			return false;
+		if(vend > eq + 1 && vend[-1] == 'i')
+			vend--;
+		if(!sink_number(eq + 1, vend))
+			return false;
+		p = (comma ? comma : sp2) + 1;
+	}
+	if(sp2 + 1 == end)
+		return false;
+	for(p = sp2 + 1; p < end; p++)
+		if(!isdigit((unsigned char)*p))
+			return false;
+	*n_fields += n;
+	return true;
+}
+
+/* Check and count the newline-ended lines in @data, returning how many bytes
+ * of it that was
+ */
+static size_t _lines(enum sink_format f, const char *data, size_t len,
+		     struct sink_stats *st)
+{
+	const char *p = data;
+	const char *nl;
+
+	while((nl = memchr(p, '\n', data + len - p)) != NULL)	{
+		size_t n = nl - p;
+
+		if(n > 0 && p[n - 1] == '\r')
+			n--;
+		if(f == SINK_INFLUX)	{
+			if(!_influx_line(p, n, &st->metrics))
+				_bad(st, "line", p, n);
+		} else if(f == SINK_STATSD ? _statsd_line(p, n) :
+					     _graphite_line(p, n))	{
+			st->metrics++;
+		} else	{
+			_bad(st, "line", p, n);
+		}
+		p = nl + 1;
+	}
+	return p - data;
+}
+
+/* What's on the pickle machine's stack, as far as metrics go */
+enum pk_item {
+	PK_MARK, PK_NUM, PK_STR, PK_PAIR, PK_METRIC, PK_LIST, PK_OTHER,
+};
+
+/* Decode one pickle and count the (path, (timestamp, value)) tuples in the
+ * list it holds. Only the opcodes the graphite sender and python's pickle
+ * module use for such a list are known. @stack has room for @len items, as
+ * every one pushed takes at least a byte.
+ */
+static bool _unpickle(const unsigned char *p, size_t len,
+		      enum pk_item *stack, uint64_t *good, uint64_t *bad)
+{
+	const unsigned char *end = p + len;
+	size_t sp = 0;
+	size_t n;
+
+#define NEED(k) do { if((size_t)(end - p) < (size_t)(k)) return false; } \
+		while(0)
+#define PUSH(t) (stack[sp++] = (t))
+
+	while(p < end)	{
+		switch(*p++)	{
+		case 0x80:	/* PROTO */
+			NEED(1);
+			p++;
+			break;
+		case 0x95:	/* FRAME */
+			NEED(8);
+			p += 8;
+			break;
+		case 0x94:	/* MEMOIZE */
+			break;
+		case 'q':	/* BINPUT */
+			NEED(1);
+			p++;
+			break;
+		case 'r':	/* LONG_BINPUT */
+			NEED(4);
+			p += 4;
+			break;
+		case ']':	/* EMPTY_LIST */
+			PUSH(PK_LIST);
+			break;
+		case '(':	/* MARK */
+			PUSH(PK_MARK);
+			break;
+		case 'K':	/* BININT1 */
+			NEED(1);
+			p += 1;
+			PUSH(PK_NUM);
+			break;
+		case 'M':	/* BININT2 */
+			NEED(2);
+			p += 2;
+			PUSH(PK_NUM);
+			break;
+		case 'J':	/* BININT */
+			NEED(4);
+			p += 4;
+			PUSH(PK_NUM);
+			break;
+		case 'G':	/* BINFLOAT */
+			NEED(8);
+			p += 8;
+			PUSH(PK_NUM);
+			break;
+		case 0x8a:	/* LONG1 */
+			NEED(1);
+			n = *p++;
+			NEED(n);
+			p += n;
+			PUSH(PK_NUM);
+			break;
+		case 0x8c:	/* SHORT_BINUNICODE */
+		case 'U':	/* SHORT_BINSTRING */
+			NEED(1);
+			n = *p++;
+			NEED(n);
+			p += n;
+			PUSH(PK_STR);
+			break;
+		case 'X':	/* BINUNICODE */
+		case 'T':	/* BINSTRING */
+			NEED(4);
+			n = (size_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+			p += 4;
+			NEED(n);
+			p += n;
+			PUSH(PK_STR);
+			break;
+		case 0x86:	/* TUPLE2 */
+			if(sp < 2)
+				return false;
+			sp--;
+			if(stack[sp - 1] == PK_NUM && stack[sp] == PK_NUM)
+				stack[sp - 1] = PK_PAIR;
+			else if(stack[sp - 1] == PK_STR && stack[sp] == PK_PAIR)
+				stack[sp - 1] = PK_METRIC;
+			else
+				stack[sp - 1] = PK_OTHER;
+			break;
+		case 'a':	/* APPEND */
+			if(sp < 2 || stack[sp - 2] != PK_LIST)
+				return false;
+			if(stack[--sp] == PK_METRIC)
+				(*good)++;
+			else
+				(*bad)++;
+			break;
+		case 'e':	/* APPENDS */
+			while(sp > 0 && stack[sp - 1] != PK_MARK)	{
+				if(stack[--sp] == PK_METRIC)
+					(*good)++;
+				else
+					(*bad)++;
+			}
+			if(sp < 2 || stack[sp - 2] != PK_LIST)
+				return false;
+			sp--;
+			break;
+		case '.':	/* STOP */
+			return p == end && sp == 1 && stack[0] == PK_LIST;
+		default:
+			return false;
+		}
+	}
+	return false;
+#undef NEED
+#undef PUSH
+}
+
+/* Check and count the length-prefixed pickles in @data, returning how many
+ * bytes of it that was
+ */
+static size_t _frames(const char *data, size_t len, struct sink_stats *st)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	enum pk_item *stack = NULL;
+	size_t used = 0;
+
+	while(len - used >= 4)	{
+		size_t flen = (size_t)p[used] << 24 | p[used + 1] << 16 |
+			      p[used + 2] << 8 | p[used + 3];
+		uint64_t good = 0, bad = 0;
+
+		if(len - used - 4 < flen)
+			break;
+		st->packets++;
+		stack = realloc(stack, (flen + 1) * sizeof(*stack));
+		if(stack == NULL)
+			log_exit("Out of memory");
+		if(_unpickle(p + used + 4, flen, stack, &good, &bad))	{
+			st->metrics += good;
+			for(uint64_t i = 0; i < bad; i++)
+				_bad(st, "pickled item", NULL, 0);
+		} else {
+			_bad(st, "pickle frame", NULL, 0);
+		}
+		used += 4 + flen;
+	}
+	free(stack);
+	return used;
+}
+
+/* Read what there is from a TCP sender, returning false once it's closed */
+static bool _conn_read(struct sink_conn *c, enum sink_format f,
+		       struct sink_stats *st)
+{
+	ssize_t n;
+	size_t used;
+
+	if(c->size - c->len < SINK_BUFSIZE)	{
+		c->size = c->len + SINK_BUFSIZE;
+		if((c->buf = realloc(c->buf, c->size)) == NULL)
+			log_exit("Out of memory");
+	}
+	n = recv(c->fd, c->buf + c->len, c->size - c->len, MSG_DONTWAIT);
+	if(n < 0 && (errno == EAGAIN || errno == EINTR))
+		return true;
+	if(n <= 0)	{
+		if(c->len > 0)
+			_bad(st, "unfinished data", c->buf, c->len);
+		return false;
+	}
+
+	st->bytes += n;
+	c->len += n;
+	used = (f == SINK_PICKLE) ? _frames(c->buf, c->len, st) :
+				    _lines(f, c->buf, c->len, st);
+	memmove(c->buf, c->buf + used, c->len - used);
+	c->len -= used;
+	if(f == SINK_PICKLE && c->len > SINK_MAX_FRAME)	{
+		_bad(st, "pickle frame length", NULL, 0);
+		return false;
+	}
+	return true;
+}
+
+/* Read the datagrams waiting on @fd, returning false if there weren't any */
+static bool _dgram_read(int fd, enum sink_format f, char *buf,
+			struct sink_stats *st)
+{
+	bool any = false;
+	ssize_t n;
+
+	while((n = recv(fd, buf, SINK_BUFSIZE, MSG_DONTWAIT)) >= 0)	{
+		any = true;
+		st->bytes += n;
+		st->packets++;
+		/* Each datagram has only whole lines, maybe without the
+		 * last newline
+		 */
+		if(n > 0 && buf[n - 1] != '\n')
+			buf[n++] = '\n';
+		_lines(f, buf, n, st);
+	}
+	return any;
+}
+
+void sink_run(int fd, enum sink_format f, struct sink_stats *st,
+	      volatile sig_atomic_t *stop)
+{
+	struct sink_conn *conns = NULL;
+	struct pollfd *pfds = NULL;
+	size_t n_conns = 0;
+	socklen_t len = sizeof(int);
+	char *dgram;
+	int socktype;
+
+	if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &socktype, &len) != 0)
+		log_exit("getsockopt() failed: %s", strerror(errno));
+	dgram = xcalloc(SINK_BUFSIZE + 1);
+	memset(st, 0, sizeof(*st));
+
+	for(;;)	{
+		bool finishing = *stop;
+		bool busy = false;
+		size_t polled = n_conns;
+		int ready;
+
+		pfds = realloc(pfds, (n_conns + 1) * sizeof(*pfds));
+		if(pfds == NULL)
+			log_exit("Out of memory");
+		pfds[0] = (struct pollfd){ .fd = fd, .events = POLLIN };
+		for(size_t i = 0; i < n_conns; i++)
+			pfds[i + 1] = (struct pollfd){ .fd = conns[i].fd,
+						       .events = POLLIN };
+
+		/* Once stopped, keep on only while there's still more */
+		ready = poll(pfds, polled + 1, finishing ? 10 : 100);
+		if(ready < 0 && errno != EINTR)
+			log_exit("poll() failed: %s", strerror(errno));
+		if(ready <= 0)	{
+			if(finishing)
+				break;
+			continue;
+		}
+
+		if(pfds[0].revents && socktype == SOCK_DGRAM)	{
+			busy |= _dgram_read(fd, f, dgram, st);
+		} else if(pfds[0].revents)	{
+			int cfd = accept(fd, NULL, NULL);
+
+			if(cfd >= 0)	{
+				conns = realloc(conns, (n_conns + 1) *
+						sizeof(*conns));
+				if(conns == NULL)
+					log_exit("Out of memory");
+				conns[n_conns].fd = cfd;
+				conns[n_conns].buf = NULL;
+				conns[n_conns].len = conns[n_conns].size = 0;
+				n_conns++;
+				st->conns++;
+				busy = true;
+			}
+		}
+
+		/* Only those polled, not any just accepted. Going down, a
+		 * closed one's place is taken by one already looked at or
+		 * only just accepted, so pfds still lines up below it. */
+		for(size_t i = polled; i-- > 0;)	{
+			if(!pfds[i + 1].revents)
+				continue;
+			busy = true;
+			if(_conn_read(&conns[i], f, st))
+				continue;
+			close(conns[i].fd);
+			free(conns[i].buf);
+			conns[i] = conns[--n_conns];
+		}
+		if(finishing && !busy)
+			break;
+	}
+
+	for(size_t i = 0; i < n_conns; i++)	{
+		close(conns[i].fd);
+		free(conns[i].buf);
+	}
+	free(conns);
+	free(pfds);
+	free(dgram);
+}
@@ -0,0 +1,51 @@
+#ifndef _SINK_H
+#define _SINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+
+/* What the sink expects to be sent */
+enum sink_format {
+	SINK_GRAPHITE,		/* "path value timestamp" lines */
+	SINK_STATSD,		/* "path:value|type" lines */
+	SINK_PICKLE,		/* graphite pickle protocol frames */
+	SINK_INFLUX,		/* "measurement,tags fields timestamp" lines */
+};
+
+struct sink_stats {
+	uint64_t metrics;	/* lines, influx fields or pickled tuples that
+				 * parsed */
+	uint64_t bad;		/* ones that didn't, or undecodable frames */
+	uint64_t bytes;		/* everything received */
+	uint64_t packets;	/* datagrams, or pickle frames */
+	uint64_t conns;		/* TCP connections accepted */
+};
+
+/**
+ * Listen for metrics on the loopback interface
+ *
+ * @param[in] socktype SOCK_DGRAM or SOCK_STREAM
+ * @param[in,out] port port to listen on, 0 for any, set to the one it got
+ * @return socket
+ */
+int sink_listen(int socktype, int *port);
+
+/**
+ * Receive and check metrics on @fd until @stop is set, then read what's left
+ * and return. Stray lines are printed to stderr, the first few of them.
+ *
+ * @param[in] fd socket from sink_listen()
+ * @param[in] f how the metrics are sent
+ * @param[out] st counts, zeroed first
+ * @param[in] stop set (by a signal handler) to finish
+ */
+void sink_run(int fd, enum sink_format f, struct sink_stats *st,
+	      volatile sig_atomic_t *stop);
+
+/**
+ * Whether [@s, @end) is all a number, and a finite one
+ */
+bool sink_number(const char *s, const char *end);
+
+#endif
@@ -11,80 +11,359 @@
 #include <mntent.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/resource.h>
 
 #include "cgroup.h"
+#include "owner.h"
+#include "selfstats.h"
+#include "slottab.h"
+#include "slotwatch.h"
 #include "util.h"
 
-/* Data structure is just an array of group structures */
-static struct condor_group *groups = NULL;
-
-/* Keep track of size of above */
+/* Groups read successfully in the latest call */
 static int n_groups = 0;
 
 const char *default_cgroup_name = "htcondor";
 
-typedef void (*read_fn)(const char *, struct condor_group *);
+/* Where to find the controllers if not from /proc/mounts */
+static const char *cgroup_root = NULL;
 
-/* Utility structures used only in this file's functions */
-struct found_groups {
-	char *name;
-	struct found_groups *next;
+/* Files read from each slot's cgroup, the descriptors for which are cached in
+ * a struct slot_cache below and indexed by this enum. The CG2_ ones are only
+ * in the cgroup v2 unified hierarchy.
+ */
+enum cg_file {
+	CG_MEMORY_STAT,
+	CG_MEMORY_SOFT_LIMIT,
+	CG_MEMORY_USAGE,
+	CG_CPUACCT_STAT,
+	CG_CPUACCT_USAGE,
+	CG_CPU_SHARES,
+	CG_PROCS,
+	CG_TASKS,
+	CG_PIDS_CURRENT,
+	CG2_CPU_STAT,
+	CG2_MEMORY_STAT,
+	CG2_CPU_WEIGHT,
+	CG2_MEMORY_CURRENT,
+	CG2_MEMORY_HIGH,
+	CG2_MEMORY_SWAP,
+	CG2_THREADS,
+	CG_NUM_FILES
+};
+
+/* Optional files are read as empty when they don't exist, e.g. cpu.weight is
+ * only there if the cpu controller is enabled for the subtree in v2
+ */
+static const struct cg_file_info {
+	const char *name;
+	bool optional;
+} cg_files[CG_NUM_FILES] = {
+	[CG_MEMORY_STAT]	= { "memory.stat" },
+	[CG_MEMORY_SOFT_LIMIT]	= { "memory.soft_limit_in_bytes" },
+	[CG_MEMORY_USAGE]	= { "memory.usage_in_bytes" },
+	[CG_CPUACCT_STAT]	= { "cpuacct.stat" },
+	[CG_CPUACCT_USAGE]	= { "cpuacct.usage" },
+	[CG_CPU_SHARES]		= { "cpu.shares" },
+	[CG_PROCS]		= { "cgroup.procs" },
+	[CG_TASKS]		= { "tasks" },
+	[CG_PIDS_CURRENT]	= { "pids.current", true },
+	[CG2_CPU_STAT]		= { "cpu.stat" },
+	[CG2_MEMORY_STAT]	= { "memory.stat" },
+	[CG2_CPU_WEIGHT]	= { "cpu.weight", true },
+	[CG2_MEMORY_CURRENT]	= { "memory.current" },
+	[CG2_MEMORY_HIGH]	= { "memory.high" },
+	[CG2_MEMORY_SWAP]	= { "memory.swap.current", true },
+	[CG2_THREADS]		= { "cgroup.threads" },
+};
+
+/**
+ * Values read from the "key value" lines of the stat files:
+ * X(file, key, field, scale) sets @field of struct condor_group to the value
+ * of @key in @file, times @scale. Any other keys are skipped without being
+ * parsed, so adding more costs a line here and (if it's to be sent) one in
+ * GROUP_METRICS, and nothing per line read.
+ */
+#define STAT_KEYS(X) \
+	X(CG_MEMORY_STAT,  total_rss,   rss_used,       1) \
+	X(CG_MEMORY_STAT,  total_swap,  swap_used,      1) \
+	X(CG_MEMORY_STAT,  total_cache, cache_used,     1) \
+	X(CG_CPUACCT_STAT, user,        user_cpu_usage, 1) \
+	X(CG_CPUACCT_STAT, system,      sys_cpu_usage,  1) \
+	X(CG2_CPU_STAT,    usage_usec,  cpu_usage_ns,   1000) \
+	X(CG2_CPU_STAT,    user_usec,   cpu_user_ns,    1000) \
+	X(CG2_CPU_STAT,    system_usec, cpu_sys_ns,     1000) \
+	X(CG2_MEMORY_STAT, anon,        rss_used,       1) \
+	X(CG2_MEMORY_STAT, file,        cache_used,     1)
+
+enum stat_key {
+#define X(file, key, field, scale) SK_##file##_##key,
+	STAT_KEYS(X)
+#undef X
+	SK_NUM
+};
+
+static const struct {
+	enum cg_file file;
+	const char *key;
+} stat_keys[SK_NUM] = {
+#define X(file, key, field, scale) [SK_##file##_##key] = { file, #key },
+	STAT_KEYS(X)
+#undef X
+};
+
+/* Open-addressed hash of the stat keys on file and key name, holding each
+ * one's stat_key + 1 (0 for empty). With at least twice as many buckets as
+ * keys, a lookup is usually one hash and one strcmp().
+ */
+#define STAT_HASH_SIZE 64
+static uint8_t stat_hash[STAT_HASH_SIZE];
+
+/* Descriptor value for an optional file that doesn't exist */
+#define CG_FILE_ABSENT -2
+
+/* Starting size of a read_buf, grown as files need */
+#define READ_BUF_INIT 4096
+
+/* Size of reads when counting lines in tasks files, which can be big */
+#define COUNT_CHUNK 65536
+
+/* Most controllers read for a slot, cpu, memory and pids with v1 */
+#define MAX_CONTROLLERS 3
+
+/* Buffer that files are read into, grown as needed and reused. There is one
+ * per reading thread.
+ */
+struct read_buf {
+	char *data;
+	size_t size;
+	/* For the collector's own stats, to add up at the end of each cycle */
+	uint64_t files;
+	uint64_t populate_ns[MAX_CONTROLLERS];
+};
+
+/* What each controller's read function gets to work with for one slot */
+struct cg_reader {
+	struct slot_cache *slot;
+	int dirfd;		/* the slot's directory under this controller */
+	int pids_dirfd;		/* where pids.current would be, or -1 */
+	struct read_buf *buf;
 };
 
+typedef int (*read_fn)(struct cg_reader *, struct condor_group *);
+
+/* Utility structures used only in this file's functions */
 struct cg_stat {
 	char *name, *value;
 };
 
 /* Controllers to read and the functions to call on each path prototyped and
- * defined here -- a static array of controllers we can iterate through below
+ * defined here -- a static array of controllers we can iterate through below.
+ * With cgroup v1 each controller is its own hierarchy, with v2 there's just
+ * the one unified hierarchy holding everything.
+ */
+static int read_cpu_group(struct cg_reader *r, struct condor_group *g);
+static int read_memory_group(struct cg_reader *r, struct condor_group *g);
+static int read_unified_group(struct cg_reader *r, struct condor_group *g);
+static int sample_cpu_group(struct cg_reader *r, struct condor_group *g);
+static int sample_memory_group(struct cg_reader *r, struct condor_group *g);
+static int sample_unified_group(struct cg_reader *r, struct condor_group *g);
+
+/* Optional controllers don't need to be mounted, or to have the slot's cgroup
+ * in them, and may just provide files for the others to read
  */
-void read_cpu_group(const char *path, struct condor_group *g);
-void read_memory_group(const char *path, struct condor_group *g);
-
 struct controller {
 	char *mount;		/* to be filled out when parsing cgroup tree */
 	const char *name;
 	read_fn populate;	/* these two below ... */
-} controllers [] = {
-	{ .name = "cpu",	.populate = read_cpu_group},
-	{ .name = "memory",	.populate = read_memory_group},
+	read_fn sample;		/* just what cgroup_sample_fast() wants */
+	bool optional;
+};
+
+static struct controller v1_controllers[] = {
+	{ .name = "cpu",	.populate = read_cpu_group,
+	  .sample = sample_cpu_group},
+	{ .name = "memory",	.populate = read_memory_group,
+	  .sample = sample_memory_group},
+	{ .name = "pids",	.optional = true},
+};
+
+/* Index of the v1 pids controller, whose pids.current counts tasks */
+#define V1_PIDS 2
+
+static struct controller v2_controllers[] = {
+	{ .name = "unified",	.populate = read_unified_group,
+	  .sample = sample_unified_group},
+};
+
+/* Which of the above sets we're using, picked in init_controller_paths() */
+static struct controller *controllers = v1_controllers;
+static size_t n_controllers = 3;
+
+/* Time spent in each controller's read function, across all the slots, in
+ * listing the slots, and in the whole of read_condor_cgroup_info()
+ */
+static struct stat_timer *populate_timers[MAX_CONTROLLERS];
+static struct stat_timer *scan_timer, *read_timer, *fast_timer;
+
+/* Running min, max and sum of the samples of one metric */
+struct run_stat {
+	uint64_t min, max, sum;
+	uint32_t n;
 };
 
-#define NUM_CONTROLLERS sizeof(controllers)/sizeof(*controllers)
+/* The metrics sampled between reads, X(name, field of struct condor_group),
+ * each giving the FAST metrics name_min and name_max, and the mean sent as
+ * the field itself. CPU use is worked out from the samples and done
+ * separately.
+ */
+#define FAST_STATS(X) \
+	X(rss, rss_used) \
+	X(cache, cache_used) \
+	X(swap, swap_used)
 
 #define for_each_controller(c) \
-for(struct controller *c = controllers; c < (controllers + NUM_CONTROLLERS); ++c)
+for(struct controller *c = controllers; c < (controllers + n_controllers); ++c)
+
+/* Each slot's entry in the slot table, keyed on the cgroup name and dropped
+ * when the cgroup is no longer found in a directory scan. It holds the slot's
+ * latest sample, and open file-descriptors for its cgroup kept between calls
+ * so each sample is just a pread() per file.
+ *
+ * With slots being watched, a v2 slot's counters are also read as soon as its
+ * cgroup.events says the job's processes have all gone. If the cgroup is then
+ * removed before the next read, the entry stays on (unlinked from the table
+ * and @gone) long enough for that final sample to be sent.
+ */
+struct slot_cache {
+	struct slot_key key;	/* first, for the slot table */
+	struct condor_group group;
+	bool ok;		/* group was read in the latest call */
+	int dirfd[MAX_CONTROLLERS];
+	int fd[CG_NUM_FILES];
+	bool seen;		/* found in the latest directory scan */
+	bool cached;		/* descriptors kept open between reads */
+	char owner[sizeof(((struct condor_group *)0)->owner)];
+	time_t owner_start;	/* start_time of the job owner was found for */
+	int events_wd;		/* watch on cgroup.events, or -1 */
+	bool has_final;		/* final holds the counters at job exit */
+	bool gone;		/* cgroup removed, final yet to be sent */
+	bool final_sent;	/* ... and now it has been */
+	struct condor_group final;
+	struct cpu_sample {	/* previous sample to get CPU rates from */
+		uint64_t time;	/* monotonic ns, 0 if there's no sample */
+		time_t start_time;
+		uint64_t usage, user, sys;
+	} prev;
+	struct fast_stats {	/* samples since the last read */
+#define X(name, field) struct run_stat name;
+		FAST_STATS(X)
+#undef X
+		struct run_stat cpu_util;
+		uint64_t *rss_samples;	/* for the rss percentile */
+		uint32_t n_rss;
+		uint64_t time;	/* the last sample's, 0 if there's none */
+		uint64_t usage;
+	} fast;
+};
+
+static struct slot_table slots = { .entry_size = sizeof(struct slot_cache) };
+
+/* Names of cgroups skipped for not being named like a slot, so each is only
+ * warned about once while it's there */
+static struct slot_table skipped = { .entry_size = sizeof(struct slot_key) };
+
+/* Once there are as many slots cached as the open files limit allows (see
+ * SLOT_FDS), the rest are opened and closed again on every read */
+static int max_cached_slots = 0;
+static int n_cached_slots = 0;
+
+/* With slots watched, the directory is only listed every RESCAN_SECS, or when
+ * inotify lost events, to catch anything missed
+ */
+#define RESCAN_SECS 60
+
+static bool watch_slots = false;
+static bool rescan_needed = false;
+
+/* Most samples taken between reads, 0 if they aren't */
+static int fast_samples = 0;
+
+/* The read in progress is a peek_condor_cgroup_info(), which leaves each
+ * slot's previous sample, fast samples and final counters for the next read
+ */
+static bool peek_read = false;
+static uint64_t next_rescan = 0;
+
+/* Held by whoever is reading or changing the slot table, so that a thread
+ * serving scrapes can share it with the sampling loop, and when it was last
+ * read
+ */
+static pthread_mutex_t groups_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t last_read = 0;
+
+/* Slots are read by the calling thread plus (n_workers - 1) threads that are
+ * started on the first read, each thread taking the next unclaimed slot off
+ * the work list until it is exhausted
+ */
+static int n_workers = 1;
+
+struct worker {
+	pthread_t tid;
+	struct read_buf buf;
+};
+
+static struct {
+	struct worker *workers;
+	int started;		/* threads running, besides the caller */
+	int n;			/* slots to read, the slot table's live[] */
+	int next;		/* index of next slot to be claimed */
+	int busy;		/* threads yet to finish this pass */
+	unsigned int pass;	/* bumped to start workers on a new pass */
+	bool quit;
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+} work = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
 
 /*
  * Get slot name from @cgroup_name under condor/ folder.
  * format: "components_in_scratch_path_SLOTNAME@host"
  * We scan for first "slot" string, then count up to first "@"-sign, then
- * copy bytes between into buffer @slot_name as slot's name
+ * copy bytes between into buffer @slot_name as slot's name, cut short to fit
  *
  * WARNING: This function assumes format of cgroup name created by condor!
+ *
+ * Return: 0, or -1 if @cgroup_name isn't in that format
  */
-static void extract_slot_name(char *slot_name, const char *cgroup_name)
+static int extract_slot_name(char *slot_name, const char *cgroup_name)
 {
+	const size_t max_len =
+		sizeof(((struct condor_group *)0)->slot_name) - 1;
 	size_t i = 0;
 	char *p = strstr(cgroup_name, "slot");
 
-	if(p == NULL)	{
-		fprintf(stderr, "Invalid cgroup-name, needs 'slot' in it!\n");
-		exit(EXIT_FAILURE);
-	}
+	if(p == NULL)
+		return -1;
 
 	/* Run up to first '@' sign */
 	while(++p && *p != '@' && *p != '\0')
 		i++;
 
-	if(*p != '@')	{
-		fprintf(stderr, "Invalid cgroup-name, should have @-sign!\n");
-		exit(EXIT_FAILURE);
-	}
-	/* Really!? This is the way to access a structure-member's size? */
-	strncpy(slot_name, (p - i - 1),
-		sizeof(((struct condor_group *)0)->slot_name) - 1);
-	*(slot_name + i + 1) = '\0';
+	if(*p != '@')
+		return -1;
+	/* The name is the i + 1 bytes from "slot" up to the '@' */
+	p -= i + 1;
+	if(i + 1 > max_len)
+		i = max_len - 1;
+	memcpy(slot_name, p, i + 1);
+	slot_name[i + 1] = '\0';
+	return 0;
 }
 
 /* Transform a slot-id string into an sortable integer, if slots are
@@ -105,12 +384,26 @@ static uint32_t get_slot_number(const char *slot)
 	return n;
 }
 
-static int groupsort(const void *a, const void *b)
+/* Order the slot table by slot-id, then name if they're the same */
+static int groupsort(const struct slot_key *a, const struct slot_key *b)
 {
-	int i = ((struct condor_group *)a)->sort_order;
-	int j = ((struct condor_group *)b)->sort_order;
+	uint32_t i = ((const struct slot_cache *)a)->group.sort_order;
+	uint32_t j = ((const struct slot_cache *)b)->group.sort_order;
+
+	int rv;
 
-	return i - j;
+	if(i != j)
+		return (i < j) ? -1 : 1;
+	if((rv = strcmp(a->name, b->name)) != 0)
+		return rv;
+	// A removed cgroup's last sample goes before the one that replaced it
+	return (int)a->indexed - (int)b->indexed;
+}
+
+/* Order the skipped names, which only matters in that it frees the removed */
+static int skipsort(const struct slot_key *a, const struct slot_key *b)
+{
+	return strcmp(a->name, b->name);
 }
 
 bool groups_empty(void)
@@ -135,202 +428,812 @@ static uint64_t parse_num(const char *str)
 }
 
 /**
- * Get the number of tasks / pids in a cgroup from appropriate files @path
- * works by counting newlines in @path, since PIDs/tasks are one-per-line
+ * Iterate through the slot table without exposing underlying structure
+ * Called via the macro for_each_group() in this file's header, which keeps
+ * the position in @*pos so loops can nest
+ *
+ * Return: the group at or after @*pos that was read, moving @*pos to it, or
+ * NULL when out of groups
  */
-static int count_newlines(const char *path)
+struct condor_group *__group_next(size_t *pos)
 {
-	FILE *fp;
-	int n = 0;
-	char c;
+	for(; *pos < slots.n_live; (*pos)++)	{
+		struct slot_cache *sc = (struct slot_cache *)slots.live[*pos];
 
-	if(NULL == (fp = fopen(path, "r")))	{
-		fprintf(stderr, "Error opening %s", path);
-		exit(EXIT_FAILURE);
+		if(sc->ok)
+			return &sc->group;
 	}
+	return NULL;
+}
 
-	while((c = fgetc(fp)) != EOF)	{
-		if(c == '\n')
-			++n;
-	}
 
-	fclose(fp);
-	return n;
-}
+static void stop_workers(void);
 
+static void slot_cache_close_fds(struct slot_cache *sc)
+{
+	for(size_t i = 0; i < n_controllers; i++)	{
+		if(sc->dirfd[i] >= 0)
+			close(sc->dirfd[i]);
+		sc->dirfd[i] = -1;
+	}
+	for(int i = 0; i < CG_NUM_FILES; i++)	{
+		if(sc->fd[i] >= 0)
+			close(sc->fd[i]);
+		sc->fd[i] = -1;
+	}
+	if(sc->cached)	{
+		__sync_fetch_and_sub(&n_cached_slots, 1);
+		sc->cached = false;
+	}
+}
 
+/* Close all cached descriptors of @sc, leaving them to be reopened */
+static void slot_cache_close(struct slot_cache *sc)
+{
+	slot_cache_close_fds(sc);
+	// If we're reopening, the cgroup may belong to a new job
+	sc->prev.time = 0;
+	sc->fast.time = 0;
+}
 
-/**
- * Iterate through group-array without exposing underlying structure
- * Called via the macro for_each_group() in this file's header
- *
- * Return: true = valid group next, false = out of groups
+/* Find the slot table entry for cgroup @name, adding it if it's new, or NULL
+ * if it isn't named like a slot's cgroup (saying so the first time)
  */
-bool __group_for_each(struct condor_group **g)
+static struct slot_cache *slot_cache_get(const char *name)
 {
-	static int n;
+	char slot_name[sizeof(((struct condor_group *)0)->slot_name)];
+	struct slot_cache *sc;
 
-	assert(g != NULL);
+	if((sc = slottab_find(&slots, name)) != NULL)
+		return sc;
+
+	if(extract_slot_name(slot_name, name) < 0)	{
+		if(slottab_find(&skipped, name) == NULL)	{
+			fprintf(stderr, "Skipping cgroup %s, not named "
+				"like slotN@host\n", name);
+			slottab_add(&skipped, name);
+		}
+		return NULL;
+	}
+	sc = slottab_add(&slots, name);
+	strcpy(sc->group.slot_name, slot_name);
+	sc->group.sort_order = get_slot_number(sc->group.slot_name);
+	for(size_t i = 0; i < MAX_CONTROLLERS; i++)
+		sc->dirfd[i] = -1;
+	for(int i = 0; i < CG_NUM_FILES; i++)
+		sc->fd[i] = -1;
+	sc->events_wd = -1;
+	if(slotwatch_active() && controllers == v2_controllers)	{
+		char path[PATH_MAX];
+
+		join_path(path, sizeof(path), controllers[0].mount, name);
+		sc->events_wd = slotwatch_add_events(path);
+	}
+	return sc;
+}
 
-	if(*g == NULL)
-		n = 0;
+static void slot_cache_retire(struct slot_cache *sc)
+{
+	slotwatch_rm(sc->events_wd);
+	sc->events_wd = -1;
+	slot_cache_close(sc);
+	free(sc->fast.rss_samples);
+	sc->fast.rss_samples = NULL;
+	slottab_retire(&slots, sc);
+}
 
-	if(n >= n_groups)	{
-		return false;
-	} else	{
-		*g = &groups[n++];
-		return true;
+/* The cgroup of @sc was removed: retire it, unless there's a final sample to
+ * send first, in which case a new cgroup of the same name can come in beside
+ * it until then
+ */
+static void slot_removed(struct slot_cache *sc)
+{
+	if(!sc->has_final)	{
+		slot_cache_retire(sc);
+		return;
 	}
+	slotwatch_rm(sc->events_wd);
+	sc->events_wd = -1;
+	slot_cache_close_fds(sc);
+	slottab_unlink(&slots, sc);
+	sc->gone = true;
 }
 
+/* Retire entries for cgroups that weren't seen in the last scan, or all of
+ * them if @all is set, and put the rest in order
+ */
+static void slot_cache_sweep(bool all)
+{
+	for(size_t i = 0; i < slots.n_entries; i++)	{
+		struct slot_cache *sc = (struct slot_cache *)slots.live[i];
+
+		if(!sc->key.live)
+			continue;
+		if(all)
+			slot_cache_retire(sc);
+		else if(!sc->seen && !sc->gone)
+			slot_removed(sc);
+	}
+	slottab_order(&slots, groupsort);
+}
 
 void cleanup_groups()
 {
 	n_groups = 0;
-	if(groups)
-		free(groups);
+
+	stop_workers();
+	slot_cache_sweep(true);
+	slottab_free(&slots);
+	slottab_free(&skipped);
+	slotwatch_close();
+	rescan_needed = false;
+	next_rescan = 0;
+	last_read = 0;
+
+	for_each_controller(c)	{
+		free(c->mount);
+		c->mount = NULL;
+	}
+	controllers = v1_controllers;
+	n_controllers = 3;
 }
 
-/* Iterate through stat-file represented by @path, reading lines like:
- * "key_name value" (one space separating key / value)
- * and return a pointer to a stat-structure with the key/values in the fields
- *
- * NOTE: Call multiple times until NULL is returned to finish parsing one file
+/* A cgroup that was removed out from under us gives ENOENT when opening its
+ * files, or ENODEV when reading a descriptor opened before it went away
  */
-struct cg_stat *read_stats(const char *path)
+static bool cgroup_vanished(int err)
+{
+	return (err == ENOENT || err == ENODEV);
+}
+
+/* Get the descriptor for file @f in the reader's directory, opening it if
+ * it's not already cached. Returns -1 if the cgroup is gone, or
+ * CG_FILE_ABSENT for a missing optional file.
+ */
+static int cg_file_fd(struct cg_reader *r, enum cg_file f)
+{
+	int *fd = &r->slot->fd[f];
+
+	if(*fd == -1)	{
+		*fd = openat(r->dirfd, cg_files[f].name, O_RDONLY | O_CLOEXEC);
+		if(*fd < 0 && errno == ENOENT && cg_files[f].optional)
+			*fd = CG_FILE_ABSENT;
+		else if(*fd < 0 && !cgroup_vanished(errno))
+			log_exit("Error opening %s/%s: %s", r->slot->key.name,
+				 cg_files[f].name, strerror(errno));
+	}
+	return *fd;
+}
 
+/* Read file @f from the start with pread() into the reader's buffer
+ * (nul-terminated), growing it until the whole file fits. Returns the length,
+ * or -1 if the cgroup is gone. A missing optional file reads as empty.
+ */
+static ssize_t cg_read(struct cg_reader *r, enum cg_file f)
 {
-	static FILE *fp = NULL;
-	static struct cg_stat s;
-	static char linebuf[128] = {0};
+	struct read_buf *b = r->buf;
+	int fd = cg_file_fd(r, f);
+	size_t len = 0;
+	ssize_t n;
+
+	if(fd == -1)
+		return -1;
 
+	if(b->data == NULL)	{
+		b->size = READ_BUF_INIT;
+		b->data = xcalloc(b->size);
+	}
+
+	if(fd == CG_FILE_ABSENT)	{
+		b->data[0] = '\0';
+		return 0;
+	}
 
-	if(fp == NULL)	{
-		if((fp = fopen(path, "r")) == NULL)
-			log_exit("Error opening %s", path);
+	while((n = pread(fd, b->data + len, b->size - len - 1, len)) != 0)	{
+		if(n < 0)	{
+			if(errno == EINTR)
+				continue;
+			if(cgroup_vanished(errno))
+				return -1;
+			log_exit("Error reading %s/%s: %s", r->slot->key.name,
+				 cg_files[f].name, strerror(errno));
+		}
+		len += n;
+		if(len == b->size - 1)	{
+			b->size *= 2;
+			if((b->data = realloc(b->data, b->size)) == NULL)
+				log_exit("Realloc error on read buffer");
+		}
 	}
+	b->data[len] = '\0';
+	b->files++;
+	return len;
+}
 
-	if(fgets(linebuf, sizeof(linebuf), fp) != NULL)	{
-		char *p = linebuf;
-		s.name = p;
-		// Count up to first space
-		while(*++p != ' ')
-			;
-		// and replace with \0 and arange pointers in stat such
-		// that key,value are at right place in buffer
-		if(*p == ' ' && *(p + 1) != '\0')	{
-			*p++ = '\0';
-			s.value = p;
-			return &s;
+/* Iterate through lines like "key_name value" (one space separating key /
+ * value) in @*pos, filling in @s with pointers to the key and value and
+ * advancing @*pos to the following line. Returns false at the end.
+ */
+static bool next_stat(char **pos, struct cg_stat *s)
+{
+	char *p = *pos;
+	char *eol, *sp;
+
+	while(*p != '\0')	{
+		if((eol = strchr(p, '\n')) != NULL)
+			*eol++ = '\0';
+		else
+			eol = p + strlen(p);
+
+		if((sp = strchr(p, ' ')) != NULL && *(sp + 1) != '\0')	{
+			*sp = '\0';
+			s->name = p;
+			s->value = sp + 1;
+			*pos = eol;
+			return true;
 		}
+		p = eol;
 	}
+	*pos = p;
+	return false;
+}
 
-	if(feof(fp))	{
-		fclose(fp);
-		fp = NULL;
-	} else {
-		log_exit("Error occured reading %s", path);
+/* FNV-1a of stat @key, seeded with the file it's from */
+static uint32_t stat_key_hash(enum cg_file f, const char *key)
+{
+	uint32_t h = 2166136261u ^ f;
+
+	for(; *key != '\0'; key++)	{
+		h ^= (unsigned char)*key;
+		h *= 16777619u;
 	}
-	return NULL;
+	return h;
 }
 
-/* Read a single number from a file at @path and return it as an integer */
-uint64_t read_num(const char *path)
+static void init_stat_keys(void)
 {
-	FILE *fp = fopen(path, "r");
-	char buf[64];
-	if(fp == NULL)
-		log_exit("Error opening %s", path);
-	fgets(buf, sizeof(buf), fp);
-	if(ferror(fp))
-		log_exit("Error reading %s", path);
-	fclose(fp);
-	return parse_num(buf);
+	assert(2 * SK_NUM <= STAT_HASH_SIZE);
+	memset(stat_hash, 0, sizeof(stat_hash));
+	for(int k = 0; k < SK_NUM; k++)	{
+		uint32_t h = stat_key_hash(stat_keys[k].file, stat_keys[k].key);
+
+		while(stat_hash[h % STAT_HASH_SIZE] != 0)
+			h++;
+		stat_hash[h % STAT_HASH_SIZE] = k + 1;
+	}
 }
 
-void read_memory_group(const char *path, struct condor_group *g)	{
-	struct cg_stat *s;
-	struct stat st;
-	const char *statpath = join_path(path, "memory.stat");
-
-	while((s = read_stats(statpath)) != NULL)	{
-		if STREQ(s->name, "total_rss")	{
-			g->rss_used = parse_num(s->value);
-		} else if STREQ(s->name, "total_swap") {
-			g->swap_used = parse_num(s->value);
-		} else if STREQ(s->name, "total_cache") {
-			g->cache_used = parse_num(s->value);
+/* Which of STAT_KEYS @key in file @f is, or -1 if it's not one */
+static int find_stat_key(enum cg_file f, const char *key)
+{
+	uint32_t h = stat_key_hash(f, key);
+	int k;
+
+	for(; (k = stat_hash[h % STAT_HASH_SIZE] - 1) >= 0; h++)
+		if(stat_keys[k].file == f && STREQ(stat_keys[k].key, key))
+			return k;
+	return -1;
+}
+
+/* Read stat file @f, filling in the fields of @g that STAT_KEYS has for it.
+ * Returns -1 if the cgroup is gone.
+ */
+static int cg_read_stats(struct cg_reader *r, enum cg_file f,
+			 struct condor_group *g)
+{
+	struct cg_stat s;
+	char *pos;
+
+	if(cg_read(r, f) < 0)
+		return -1;
+
+	pos = r->buf->data;
+	while(next_stat(&pos, &s))	{
+		switch(find_stat_key(f, s.name))	{
+#define X(file, key, field, scale) \
+		case SK_##file##_##key: \
+			g->field = parse_num(s.value) * (scale); \
+			break;
+		STAT_KEYS(X)
+#undef X
 		}
 	}
-	if(stat(path, &st) != 0)
-		log_exit("Error calling stat() on %d", path);
-	g->start_time = st.st_ctime;
-	g->mem_soft_limit = read_num(join_path(path, "memory.soft_limit_in_bytes"));
+	return 0;
 }
 
-void read_cpu_group(const char *path, struct condor_group *g)	{
-	long int hz = sysconf(_SC_CLK_TCK);
+/* Read a single number from file @f into @n, returns -1 if cgroup is gone */
+static int cg_read_num(struct cg_reader *r, enum cg_file f, uint64_t *n)
+{
+	if(cg_read(r, f) < 0)
+		return -1;
+	*n = parse_num(r->buf->data);
+	return 0;
+}
+
+/**
+ * Get the number of tasks / pids in a cgroup from file @f, works by counting
+ * newlines since PIDs/tasks are one-per-line. The file is read in big chunks
+ * rather than all at once, as jobs can have many thousands of threads.
+ */
+static int cg_count_lines(struct cg_reader *r, enum cg_file f, uint32_t *n)
+{
+	struct read_buf *b = r->buf;
+	int fd = cg_file_fd(r, f);
+	ssize_t count;
+
+	if(fd == -1)
+		return -1;
+
+	if(b->size < COUNT_CHUNK)	{
+		b->size = COUNT_CHUNK;
+		if((b->data = realloc(b->data, b->size)) == NULL)
+			log_exit("Realloc error on read buffer");
+	}
 
-	struct cg_stat *s;
-	const char *statpath = join_path(path, "cpuacct.stat");
+	if((count = count_lines_fd(fd, b->data, b->size)) < 0)	{
+		if(cgroup_vanished(errno))
+			return -1;
+		log_exit("Error reading %s/%s: %s", r->slot->key.name,
+			 cg_files[f].name, strerror(errno));
+	}
+	b->files++;
+	*n = count;
+	return 0;
+}
 
-	while((s = read_stats(statpath)) != NULL)	{
-		if STREQ(s->name, "user")	{
-			g->user_cpu_usage = parse_num(s->value);
-		} else if STREQ(s->name, "system")	{
-			g->sys_cpu_usage = parse_num(s->value);
+/* Get the number of tasks from pids.current if the pids controller is there
+ * for this slot, which is much cheaper than counting the lines of @f. Note
+ * this also counts tasks in any sub-cgroups, as condor doesn't make any.
+ */
+static int cg_count_tasks(struct cg_reader *r, enum cg_file f, uint32_t *n)
+{
+	if(r->pids_dirfd >= 0)	{
+		struct cg_reader pr = *r;
+		ssize_t len;
+
+		pr.dirfd = r->pids_dirfd;
+		if((len = cg_read(&pr, CG_PIDS_CURRENT)) < 0)
+			return -1;
+		if(len > 0)	{
+			*n = parse_num(r->buf->data);
+			return 0;
 		}
 	}
+	return cg_count_lines(r, f, n);
+}
+
+static int read_memory_group(struct cg_reader *r, struct condor_group *g)
+{
+	struct stat st;
+
+	if(cg_read_stats(r, CG_MEMORY_STAT, g) < 0)
+		return -1;
+	if(fstat(r->dirfd, &st) != 0)
+		log_exit("Error calling fstat() on %s", r->slot->key.name);
+	g->start_time = st.st_ctime;
+	if(cg_read_num(r, CG_MEMORY_USAGE, &g->mem_usage) < 0 ||
+	   cg_read_num(r, CG_MEMORY_SOFT_LIMIT, &g->mem_soft_limit) < 0)
+		return -1;
+	return 0;
+}
+
+static int read_cpu_group(struct cg_reader *r, struct condor_group *g)
+{
+	long int hz = sysconf(_SC_CLK_TCK);
+
+	if(cg_read_stats(r, CG_CPUACCT_STAT, g) < 0)
+		return -1;
+
+	/* The user/sys split is only in ticks, keep it in ns for the rates */
+	g->cpu_user_ns = g->user_cpu_usage * (1000000000 / hz);
+	g->cpu_sys_ns = g->sys_cpu_usage * (1000000000 / hz);
 
 	/* Divide by HZ from _SC_CLK_TCK to get usage in seconds */
 	g->user_cpu_usage /= hz;
 	g->sys_cpu_usage /= hz;
-	g->cpu_shares = read_num(join_path(path, "cpu.shares"));
-	g->num_procs = count_newlines(join_path(path, "cgroup.procs"));
-	g->num_tasks = count_newlines(join_path(path, "tasks"));
+	if(cg_read_num(r, CG_CPUACCT_USAGE, &g->cpu_usage_ns) < 0 ||
+	   cg_read_num(r, CG_CPU_SHARES, &g->cpu_shares) < 0 ||
+	   cg_count_lines(r, CG_PROCS, &g->num_procs) < 0 ||
+	   cg_count_tasks(r, CG_TASKS, &g->num_tasks) < 0)
+		return -1;
+	return 0;
+}
+
+/* The v1 memory.soft_limit_in_bytes value for "no limit", used when v2 says
+ * "max" so either hierarchy reports the same
+ */
+#define CG_NO_LIMIT 0x7ffffffffffff000ULL
+
+/* Read everything from the one cgroup v2 directory, mapping onto the v1
+ * fields as closely as possible: anon/file memory for rss/cache, memory.high
+ * for the soft limit and the raw cpu.weight for shares (condor sets this to
+ * 100 * cpus, as it does cpu.shares in v1)
+ */
+static int read_unified_group(struct cg_reader *r, struct condor_group *g)
+{
+	struct stat st;
+
+	if(cg_read_stats(r, CG2_CPU_STAT, g) < 0)
+		return -1;
+	g->user_cpu_usage = g->cpu_user_ns / 1000000000;
+	g->sys_cpu_usage = g->cpu_sys_ns / 1000000000;
+
+	if(cg_read_stats(r, CG2_MEMORY_STAT, g) < 0)
+		return -1;
+
+	if(fstat(r->dirfd, &st) != 0)
+		log_exit("Error calling fstat() on %s", r->slot->key.name);
+	g->start_time = st.st_ctime;
+
+	if(cg_read(r, CG2_MEMORY_HIGH) < 0)
+		return -1;
+	if(strncmp(r->buf->data, "max", 3) == 0)
+		g->mem_soft_limit = CG_NO_LIMIT;
+	else
+		g->mem_soft_limit = parse_num(r->buf->data);
+
+	if(cg_read_num(r, CG2_MEMORY_CURRENT, &g->mem_usage) < 0 ||
+	   cg_read_num(r, CG2_MEMORY_SWAP, &g->swap_used) < 0 ||
+	   cg_read_num(r, CG2_CPU_WEIGHT, &g->cpu_shares) < 0 ||
+	   cg_count_lines(r, CG_PROCS, &g->num_procs) < 0 ||
+	   cg_count_tasks(r, CG2_THREADS, &g->num_tasks) < 0)
+		return -1;
+	return 0;
+}
+
+/* Just the memory.stat and CPU usage, for the samples between reads */
+static int sample_cpu_group(struct cg_reader *r, struct condor_group *g)
+{
+	return cg_read_num(r, CG_CPUACCT_USAGE, &g->cpu_usage_ns);
+}
+
+static int sample_memory_group(struct cg_reader *r, struct condor_group *g)
+{
+	return cg_read_stats(r, CG_MEMORY_STAT, g);
+}
+
+static int sample_unified_group(struct cg_reader *r, struct condor_group *g)
+{
+	if(cg_read_stats(r, CG2_CPU_STAT, g) < 0 ||
+	   cg_read_stats(r, CG2_MEMORY_STAT, g) < 0 ||
+	   cg_read_num(r, CG2_MEMORY_SWAP, &g->swap_used) < 0)
+		return -1;
+	return 0;
+}
+
+static inline void run_stat_add(struct run_stat *s, uint64_t v)
+{
+	if(s->n == 0 || v < s->min)
+		s->min = v;
+	if(s->n == 0 || v > s->max)
+		s->max = v;
+	s->sum += v;
+	s->n++;
+}
+
+/* Add sample @g taken at @now to @sc's samples since the last read, the CPU
+ * use being what it used since the sample before (if it didn't go backwards,
+ * as it does for a new job)
+ */
+static void fast_add(struct slot_cache *sc, const struct condor_group *g,
+		     uint64_t now)
+{
+	struct fast_stats *f = &sc->fast;
+
+#define X(name, field) run_stat_add(&f->name, g->field);
+	FAST_STATS(X)
+#undef X
+	if(f->rss_samples == NULL)
+		f->rss_samples =
+			xcalloc(fast_samples * sizeof(*f->rss_samples));
+	if(f->n_rss < (uint32_t)fast_samples)
+		f->rss_samples[f->n_rss++] = g->rss_used;
+
+	if(f->time != 0 && now > f->time && g->cpu_usage_ns >= f->usage)
+		run_stat_add(&f->cpu_util,
+			     ((g->cpu_usage_ns - f->usage) * 1000 +
+			      (now - f->time) / 2) / (now - f->time));
+	f->time = now;
+	f->usage = g->cpu_usage_ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Add read @g to the samples taken since the last one, and fill in its FAST
+ * metrics from them all -- if any of them were taken between reads -- then
+ * start again for the next read. A @peek only looks at the samples so far.
+ */
+static void fast_fold(struct slot_cache *sc, struct condor_group *g,
+		      uint64_t now, bool peek)
+{
+	struct fast_stats *f = &sc->fast;
+
+	if(!peek)
+		fast_add(sc, g, now);
+	if(f->cpu_util.n > 0)	{
+#define X(name, field) \
+		g->name##_min = f->name.min; \
+		g->name##_max = f->name.max;
+		FAST_STATS(X)
+		X(cpu_util, -)
+#undef X
+		// The means go out instead of the reading itself, so there's
+		// no more sent than needed; cpu_util is already the mean CPU
+		// use since the last read
+#define X(name, field) g->field = f->name.sum / f->name.n;
+		FAST_STATS(X)
+#undef X
+		// Nearest rank, the smallest that 95% of samples are under
+		qsort(f->rss_samples, f->n_rss, sizeof(*f->rss_samples),
+		      cmp_u64);
+		g->rss_p95 = f->rss_samples[(f->n_rss * 95 + 99) / 100 - 1];
+		g->has_fast = true;
+	}
+	if(peek)
+		return;
+
+#define X(name, field) memset(&f->name, 0, sizeof(f->name));
+	FAST_STATS(X)
+	X(cpu_util, -)
+#undef X
+	f->n_rss = 0;
+}
+
+/* Work out the CPU used since the last sample of this slot (if there was one)
+ * in thousandths of a core and in seconds, then remember this sample for next
+ * time unless it's a @peek. The total comes from the nanosecond usage counter,
+ * and is split between user and system in proportion to how those counters
+ * moved. No rates are given if the counters went backwards or the cgroup's
+ * start time changed, as it's then a new job that reused the slot's cgroup
+ * name.
+ */
+static void update_cpu_rates(struct slot_cache *sc, struct condor_group *g,
+			     uint64_t now, bool peek)
+{
+	struct cpu_sample *prev = &sc->prev;
+
+	if(prev->time != 0 && now > prev->time &&
+	   g->start_time == prev->start_time &&
+	   g->cpu_usage_ns >= prev->usage &&
+	   g->cpu_user_ns >= prev->user && g->cpu_sys_ns >= prev->sys)	{
+		uint64_t elapsed = now - prev->time;
+		uint64_t used = g->cpu_usage_ns - prev->usage;
+		uint64_t user = g->cpu_user_ns - prev->user;
+		uint64_t sys = g->cpu_sys_ns - prev->sys;
+
+		g->cpu_util = (used * 1000 + elapsed / 2) / elapsed;
+		/* Whole seconds, so the deltas add up to the running totals */
+		g->cpu_user_delta = g->user_cpu_usage - prev->user / 1000000000;
+		g->cpu_sys_delta = g->sys_cpu_usage - prev->sys / 1000000000;
+		if(user + sys > 0)	{
+			g->cpu_util_user = (g->cpu_util * user + (user + sys) / 2)
+					   / (user + sys);
+			g->cpu_util_sys = g->cpu_util - g->cpu_util_user;
+		}
+		g->has_cpu_util = true;
+	}
+	if(peek)
+		return;
+
+	prev->time = now;
+	prev->start_time = g->start_time;
+	prev->usage = g->cpu_usage_ns;
+	prev->user = g->cpu_user_ns;
+	prev->sys = g->cpu_sys_ns;
+}
+
+/* Fill in the owner of @g, looking it up from the first process in its
+ * cgroup.procs (left open by the read) only when it's a new job
+ */
+static void find_owner(struct slot_cache *sc, struct condor_group *g)
+{
+	int fd = sc->fd[CG_PROCS];
+	char pids[32];
+	ssize_t n;
+
+	if(sc->owner[0] == '\0' || sc->owner_start != g->start_time)	{
+		sc->owner[0] = '\0';
+		if(fd >= 0 && (n = pread(fd, pids, sizeof(pids) - 1, 0)) > 0) {
+			pids[n] = '\0';
+			if(pid_owner(atoi(pids), sc->owner, sizeof(sc->owner)))
+				sc->owner_start = g->start_time;
+		}
+	}
+	memcpy(g->owner, sc->owner, sizeof(g->owner));
+}
+
+/* Fill in @g for slot @sc by running each controller's read function on it,
+ * opening the directories if they're not cached, and for a @peek leaving the
+ * slot's previous samples as they are. Returns -1 if the cgroup has gone away.
+ */
+static int populate_group(struct slot_cache *sc, struct condor_group *g,
+			  struct read_buf *buf, bool peek)
+{
+	uint64_t now = monotonic_ns();
+	struct condor_group blank = {
+		.sort_order = g->sort_order,
+		.metric_names = g->metric_names,
+	};
+
+	// Start afresh, but for the names worked out when the slot was added
+	memcpy(blank.slot_name, g->slot_name, sizeof(blank.slot_name));
+	*g = blank;
+
+	// Keep this slot's descriptors if there are enough to go round
+	if(sc->dirfd[0] == -1)	{
+		sc->cached = __sync_add_and_fetch(&n_cached_slots, 1) <=
+			     max_cached_slots;
+		if(!sc->cached)
+			__sync_fetch_and_sub(&n_cached_slots, 1);
+	}
+
+	for(size_t i = 0; i < n_controllers; i++)	{
+		struct controller *ctrl = &controllers[i];
+		char path[PATH_MAX];
+
+		if(sc->dirfd[i] != -1)
+			continue;
+		if(ctrl->mount == NULL)	{
+			sc->dirfd[i] = CG_FILE_ABSENT;
+			continue;
+		}
+		join_path(path, sizeof(path), ctrl->mount, sc->key.name);
+		sc->dirfd[i] = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if(sc->dirfd[i] < 0)	{
+			if(ctrl->optional && errno == ENOENT)	{
+				sc->dirfd[i] = CG_FILE_ABSENT;
+				continue;
+			}
+			if(cgroup_vanished(errno))
+				return -1;
+			log_exit("Cannot open directory %s/%s: %s",
+				 ctrl->mount, sc->key.name, strerror(errno));
+		}
+	}
+
+	for(size_t i = 0; i < n_controllers; i++)	{
+		struct cg_reader r = { .slot = sc, .buf = buf };
+		uint64_t t0;
+		int rv;
+
+		if(controllers[i].populate == NULL)
+			continue;
+		r.dirfd = sc->dirfd[i];
+		if(controllers == v2_controllers)
+			r.pids_dirfd = r.dirfd;
+		else
+			r.pids_dirfd = (sc->dirfd[V1_PIDS] >= 0) ?
+				       sc->dirfd[V1_PIDS] : -1;
+		t0 = monotonic_ns();
+		rv = controllers[i].populate(&r, g);
+		buf->populate_ns[i] += monotonic_ns() - t0;
+		if(rv < 0)
+			return -1;
+	}
+	update_cpu_rates(sc, g, now, peek);
+	if(fast_samples > 0)
+		fast_fold(sc, g, now, peek);
+	find_owner(sc, g);
+	if(!sc->cached)
+		slot_cache_close_fds(sc);
+	return 0;
+}
+
+/* Set @c's mount to @dir/@path */
+static void set_controller_mount(struct controller *c, const char *dir,
+				 const char *path)
+{
+	c->mount = xcalloc(strlen(dir) + strlen(path) + 2);
+	sprintf(c->mount, "%s/%s", dir, path);
 }
 
-void init_controller_paths(const char *path, struct found_groups **ccg)
+/* Find cgroup-labeled mounts points in /proc/mounts and fill in the
+ * struct controller .mount member with <mount>/@path
+ */
+static void find_mounts(const char *path)
 {
 	FILE *fp;
-	DIR *dir;
 	struct mntent *m;
-	struct dirent *d;
-
-	*ccg = NULL;
 
-	// Find cgroup-labeled mounts points in /proc/mounts to fill into the
-	// struct controller .mount member
 	if(NULL == (fp = fopen("/proc/mounts", "r")))	{
 		fprintf(stderr, "Error opening /proc/mounts\n");
 		exit(EXIT_FAILURE);
 	}
 
 	while( (m = getmntent(fp)) != NULL)	{
+		// Remember the v2 mount in case the v1 controllers aren't there,
+		// a hybrid setup may have both with the controllers in v1
+		if STREQ(m->mnt_type, "cgroup2")	{
+			struct controller *c = &v2_controllers[0];
+			if(c->mount == NULL)
+				set_controller_mount(c, m->mnt_dir, path);
+			continue;
+		}
 		if STRNEQ(m->mnt_type, "cgroup")
 			continue;
 		// Find mount options with "controller"-name
 		for_each_controller(c) {
-			if(hasmntopt(m, c->name))	{
-				c->mount = xcalloc(strlen(m->mnt_dir) + strlen(path) + 2);
-				sprintf(c->mount, "%s/%s", m->mnt_dir, path);
-			}
+			if(hasmntopt(m, c->name))
+				set_controller_mount(c, m->mnt_dir, path);
 		}
 	}
 	fclose(fp);
+}
+
+/* Find the controllers under cgroup_root laid out like /sys/fs/cgroup, with
+ * either a directory named after each v1 controller or the v2 hierarchy
+ * itself
+ */
+static void find_root_mounts(const char *path)
+{
+	char dir[PATH_MAX];
+	struct stat st;
+
+	for_each_controller(c)	{
+		join_path(dir, sizeof(dir), cgroup_root, c->name);
+		if(stat(dir, &st) == 0 && S_ISDIR(st.st_mode))
+			set_controller_mount(c, dir, path);
+	}
+
+	join_path(dir, sizeof(dir), cgroup_root, "cgroup.controllers");
+	if(stat(dir, &st) == 0)
+		set_controller_mount(&v2_controllers[0], cgroup_root, path);
+}
+
+/* Find the controllers' cgroups at @path, and whether it's v1 or v2 -- only
+ * needs doing once per run, as the mounts don't move around under us
+ */
+static void init_controller_paths(const char *path)
+{
+	bool have_v1 = true;
+
+	if(cgroup_root != NULL)
+		find_root_mounts(path);
+	else
+		find_mounts(path);
 
 	for_each_controller(c)
-		if(c->mount == NULL)
+		if(c->mount == NULL && !c->optional)
+			have_v1 = false;
+
+	if(!have_v1)	{
+		if(v2_controllers[0].mount == NULL)
 			log_exit("Error reading all controller cgroups!");
+		for_each_controller(c)	{
+			free(c->mount);
+			c->mount = NULL;
+		}
+		controllers = v2_controllers;
+		n_controllers = 1;
+	} else {
+		free(v2_controllers[0].mount);
+		v2_controllers[0].mount = NULL;
+	}
+}
+
+/* Scan the first controller's directory for per-slot cgroups, marking their
+ * entries in the slot cache as seen (and adding any new ones)
+ */
+static void list_condor_groups(void)
+{
+	struct slot_cache *sc;
+	DIR *dir;
+	struct dirent *d;
 
-	// Create quick linked-list of per-slot-named cgroups by going through
-	// the first controller's subdirectory named <mount>/@path/
+	// Go through the first controller's subdirectory named <mount>/@path/
 	// NOTE: Assumption here is that subdirs are named the same between
 	//       multiple controllers (if a job exits between the dir-scan and
 	//       reading the data there could be a race / error...
-	struct found_groups **cgitr = ccg;
 	struct controller *c = &controllers[0];
 
+	for(size_t i = 0; i < slots.n_entries; i++)
+		((struct slot_cache *)slots.live[i])->seen = false;
+
 	dir = opendir(c->mount);
 	if(dir == NULL)
 		log_exit("Cannot open directory: %s", c->mount);
@@ -348,56 +1251,435 @@ SEE man 3 readdir for more details on _DIRENT_HAVE_D_TYPE
 #else
 		if(d->d_type == DT_DIR) {
 #endif
-
-			*cgitr = xcalloc(sizeof(struct found_groups));
-			(*cgitr)->next = NULL;
-			(*cgitr)->name = xstrdup(d->d_name);
-			cgitr = &(*cgitr)->next;
+			if((sc = slot_cache_get(d->d_name)) != NULL)
+				sc->seen = true;
 		}
 	}
-	if(*ccg == NULL)
-		log_exit("No %s cgroups found", path);
 	closedir(dir);
 
+	// Cgroups that went away since the last scan get their files closed,
+	// and new ones go in their place in the order
+	slot_cache_sweep(false);
 }
 
-void read_condor_cgroup_info(const char *cg_name)
+/* Whether v2 cgroup @sc still has processes in it, going by cgroup.events */
+static bool slot_populated(struct slot_cache *sc)
+{
+	char path[PATH_MAX], buf[256];
+	ssize_t n;
+	int fd;
+
+	join_path(path, sizeof(path), controllers[0].mount, sc->key.name);
+	strncat(path, "/cgroup.events", sizeof(path) - strlen(path) - 1);
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return true;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(n <= 0)
+		return true;
+	buf[n] = '\0';
+	return strstr(buf, "populated 0") == NULL;
+}
+
+/* Find the entry whose cgroup.events is watched as @wd */
+static struct slot_cache *slot_cache_by_wd(int wd)
+{
+	for(size_t i = 0; i < slots.n_entries; i++)	{
+		struct slot_cache *sc = (struct slot_cache *)slots.live[i];
+
+		if(sc->key.live && !sc->gone && sc->events_wd == wd)
+			return sc;
+	}
+	return NULL;
+}
+
+/* Apply a change to condor's cgroup directory seen by the slot watch. This is
+ * only called between reads, so the workers aren't using the slot table.
+ */
+static void slot_event(enum slot_event ev, const char *name, int wd)
+{
+	struct slot_cache *sc;
+	struct slot_key *key;
+
+	switch(ev)	{
+	case SLOT_ADDED:
+		if((sc = slot_cache_get(name)) != NULL)
+			sc->seen = true;
+		break;
+	case SLOT_REMOVED:
+		if((sc = slottab_find(&slots, name)) != NULL)
+			slot_removed(sc);
+		else if((key = slottab_find(&skipped, name)) != NULL)	{
+			slottab_retire(&skipped, key);
+			slottab_order(&skipped, skipsort);
+		}
+		break;
+	case SLOT_EVENTS:
+		// The job's last process exited, so read its counters while
+		// the cgroup is still there to be read
+		sc = slot_cache_by_wd(wd);
+		if(sc == NULL || sc->has_final || slot_populated(sc))
+			break;
+		sc->final = sc->group;
+		if(populate_group(sc, &sc->final, &work.workers[0].buf,
+				  false) == 0)
+			sc->has_final = true;
+		break;
+	case SLOT_RESCAN:
+		rescan_needed = true;
+		break;
+	}
+}
+
+/* Bring the slot table up to date with condor's cgroup directory, from the
+ * slot watch's events if there is one, else by listing it
+ */
+static void find_condor_groups(void)
+{
+	uint64_t now = monotonic_ns();
+
+	// Slots whose final sample went out last time are done with
+	for(size_t i = 0; i < slots.n_live; i++)	{
+		struct slot_cache *sc = (struct slot_cache *)slots.live[i];
+
+		if(sc->final_sent)
+			slot_cache_retire(sc);
+	}
+
+	if(slotwatch_active())	{
+		slotwatch_read(slot_event);
+		if(!rescan_needed && now < next_rescan)	{
+			slottab_order(&slots, groupsort);
+			return;
+		}
+	}
+	list_condor_groups();
+	rescan_needed = false;
+	next_rescan = now + RESCAN_SECS * 1000000000ULL;
+}
+
+/* Check whether all of @sc's controller directories still exist */
+static bool slot_exists(struct slot_cache *sc)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	for_each_controller(c)	{
+		if(c->optional)
+			continue;
+		join_path(path, sizeof(path), c->mount, sc->key.name);
+		if(stat(path, &st) != 0)
+			return false;
+	}
+	return true;
+}
+
+/* Read slot @i of the slot table, noting if it succeeded */
+static void read_one_group(int i, struct read_buf *buf)
+{
+	struct slot_cache *sc = (struct slot_cache *)slots.live[i];
+
+	sc->ok = true;
+	if(sc->gone)	{
+		sc->group = sc->final;
+		sc->final_sent = !peek_read;
+		return;
+	}
+
+	// A cached descriptor may belong to an older cgroup of the same
+	// name that was removed and recreated, so reopen and retry once.
+	// If it's still failing, the job has just exited so skip it (or
+	// send its final counters if we got them), unless it's still there
+	// and just missing a file we need.
+	if(populate_group(sc, &sc->group, buf, peek_read) < 0)	{
+		slot_cache_close(sc);
+		if(populate_group(sc, &sc->group, buf, peek_read) < 0)	{
+			if(slot_exists(sc))
+				log_exit("Error reading cgroup files of %s",
+					 sc->key.name);
+			if(sc->has_final)
+				sc->group = sc->final;
+			else
+				sc->ok = false;
+		}
+	}
+	if(!peek_read)
+		sc->has_final = false;
+}
+
+/* Claim and read slots from the work list until none are left */
+static void read_groups(struct read_buf *buf)
+{
+	int i;
+
+	for(;;)	{
+		pthread_mutex_lock(&work.lock);
+		i = work.next++;
+		pthread_mutex_unlock(&work.lock);
+		if(i >= work.n)
+			break;
+		read_one_group(i, buf);
+	}
+
+	// Add what this thread did to the collector's own stats
+	stats_count(STAT_FILES_READ, buf->files);
+	buf->files = 0;
+	for(size_t c = 0; c < n_controllers; c++)	{
+		if(buf->populate_ns[c] > 0)
+			stats_time(populate_timers[c], buf->populate_ns[c]);
+		buf->populate_ns[c] = 0;
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int pass = 0;
+
+	pthread_mutex_lock(&work.lock);
+	for(;;)	{
+		while(work.pass == pass && !work.quit)
+			pthread_cond_wait(&work.start, &work.lock);
+		if(work.quit)
+			break;
+		pass = work.pass;
+		pthread_mutex_unlock(&work.lock);
+
+		read_groups(&w->buf);
+
+		pthread_mutex_lock(&work.lock);
+		if(--work.busy == 0)
+			pthread_cond_signal(&work.done);
+	}
+	pthread_mutex_unlock(&work.lock);
+	return NULL;
+}
+
+static void start_workers(void)
+{
+	int err;
+
+	work.workers = xcalloc(n_workers * sizeof(*work.workers));
+	for(int i = 1; i < n_workers; i++)	{
+		err = pthread_create(&work.workers[i].tid, NULL, worker_main,
+				     &work.workers[i]);
+		if(err != 0)
+			log_exit("Error starting worker thread: %s",
+				 strerror(err));
+		work.started++;
+	}
+}
+
+static void stop_workers(void)
+{
+	if(work.workers == NULL)
+		return;
+
+	pthread_mutex_lock(&work.lock);
+	work.quit = true;
+	pthread_cond_broadcast(&work.start);
+	pthread_mutex_unlock(&work.lock);
+
+	for(int i = 1; i <= work.started; i++)
+		pthread_join(work.workers[i].tid, NULL);
+	for(int i = 0; i < n_workers; i++)
+		free(work.workers[i].buf.data);
+
+	free(work.workers);
+	work.workers = NULL;
+	work.started = work.n = 0;
+	work.quit = false;
+}
+
+void set_cgroup_root(const char *root)
+{
+	assert(controllers[0].mount == NULL);
+	cgroup_root = root;
+}
+
+void set_watch_slots(bool watch)
+{
+	assert(controllers[0].mount == NULL);
+	watch_slots = watch;
+}
+
+/* slot_event() for events that come in between reads, when another thread
+ * may be using the slot table */
+static void slot_event_locked(enum slot_event ev, const char *name, int wd)
+{
+	pthread_mutex_lock(&groups_lock);
+	slot_event(ev, name, wd);
+	pthread_mutex_unlock(&groups_lock);
+}
+
+int cgroup_events_fd(void)
+{
+	return slotwatch_fd();
+}
+
+void cgroup_handle_events(void)
+{
+	slotwatch_read(slot_event_locked);
+}
+
+bool cgroup_wait_events(const struct timespec *deadline)
+{
+	uint64_t ns = deadline->tv_sec * 1000000000ULL + deadline->tv_nsec;
+
+	return slotwatch_wait(ns, slot_event_locked);
+}
+
+void cgroup_lock(void)
+{
+	pthread_mutex_lock(&groups_lock);
+}
+
+void cgroup_unlock(void)
+{
+	pthread_mutex_unlock(&groups_lock);
+}
+
+uint64_t cgroup_read_time(void)
+{
+	return last_read;
+}
+
+void set_fast_samples(int n)
+{
+	assert(controllers[0].mount == NULL);
+	// Room for the read's own sample as well
+	fast_samples = (n > 0) ? n + 1 : 0;
+}
+
+void cgroup_sample_fast(void)
 {
-	struct found_groups *cgroup, *c;
-	struct condor_group *g;
-	init_controller_paths(cg_name, &cgroup);
-	c = cgroup;
-
-	while(c)	{
-		struct found_groups *tmp;
-		if(NULL == (groups = realloc(groups,
-			(1 + n_groups) * sizeof(struct condor_group))) ) {
-			fputs("!Realloc error on group struct", stderr);
-			exit(ENOMEM);
+	struct read_buf *buf;
+	uint64_t start = monotonic_ns();
+
+	if(fast_samples == 0 || work.workers == NULL)
+		return;
+	buf = &work.workers[0].buf;
+	for(size_t i = 0; i < slots.n_live; i++)	{
+		struct slot_cache *sc = (struct slot_cache *)slots.live[i];
+		struct condor_group s = { .cpu_usage_ns = 0 };
+		uint64_t now = monotonic_ns();
+		int rv = 0;
+
+		if(!sc->key.live || sc->gone || sc->dirfd[0] < 0)
+			continue;
+		for(size_t c = 0; c < n_controllers && rv == 0; c++)	{
+			struct cg_reader r = {
+				.slot = sc,
+				.dirfd = sc->dirfd[c],
+				.pids_dirfd = -1,
+				.buf = buf,
+			};
+
+			if(controllers[c].sample != NULL)
+				rv = controllers[c].sample(&r, &s);
 		}
-		g = &groups[n_groups++];
-		memset(g, 0, sizeof(struct condor_group));
-
-		extract_slot_name(g->slot_name, c->name);
-		g->sort_order = get_slot_number(g->slot_name);
-		for_each_controller(ctrl)	{
-			char *full_path = xstrdup(join_path(ctrl->mount, c->name));
-			ctrl->populate(full_path, g);
-			free(full_path);
+		// A slot that's gone is left for the next read to sort out
+		if(rv == 0)
+			fast_add(sc, &s, now);
+	}
+	stats_count(STAT_FILES_READ, buf->files);
+	buf->files = 0;
+	stats_time(fast_timer, monotonic_ns() - start);
+}
+
+void set_read_workers(int n)
+{
+	assert(work.workers == NULL);
+	n_workers = (n > 0) ? n : 1;
+}
+
+/* Allow as many open files as we're let have, and work out how many slots'
+ * descriptors can be kept open with that
+ */
+static void set_fd_budget(void)
+{
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) != 0)	{
+		max_cached_slots = 0;
+		return;
+	}
+	if(rl.rlim_cur < rl.rlim_max)	{
+		rl.rlim_cur = rl.rlim_max;
+		if(setrlimit(RLIMIT_NOFILE, &rl) != 0)
+			getrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if(rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT32_MAX)
+		max_cached_slots = INT32_MAX / SLOT_FDS;
+	else if(rl.rlim_cur > FD_RESERVE)
+		max_cached_slots = (rl.rlim_cur - FD_RESERVE) / SLOT_FDS;
+}
+
+static void read_info(const char *cg_name, bool peek)
+{
+	uint64_t start = monotonic_ns();
+	uint64_t t0;
+
+	if(controllers[0].mount == NULL)	{
+		char name[32];
+
+		init_controller_paths(cg_name);
+		init_stat_keys();
+		if(watch_slots)
+			slotwatch_open(controllers[0].mount);
+		stats_time(stats_timer("discover"), monotonic_ns() - start);
+		for(size_t c = 0; c < n_controllers; c++)	{
+			snprintf(name, sizeof(name), "populate_%s",
+				 controllers[c].name);
+			populate_timers[c] = stats_timer(name);
 		}
-		// clean up after ourselves as this is the only time through the list
-		tmp = c->next;
-		free(c->name);
-		free(c);
-		c = tmp;
+		scan_timer = stats_timer("scan");
+		read_timer = stats_timer("read");
+		if(fast_samples > 0)
+			fast_timer = stats_timer("fast_sample");
+		set_fd_budget();
 	}
+	if(work.workers == NULL)
+		start_workers();
+	t0 = monotonic_ns();
+	find_condor_groups();
+	stats_time(scan_timer, monotonic_ns() - t0);
+
+	// Hand out the slots to the workers, and read our share of them
+	pthread_mutex_lock(&work.lock);
+	peek_read = peek;
+	work.n = slots.n_live;
+	work.next = 0;
+	work.busy = work.started;
+	work.pass++;
+	pthread_cond_broadcast(&work.start);
+	pthread_mutex_unlock(&work.lock);
+
+	read_groups(&work.workers[0].buf);
+
+	pthread_mutex_lock(&work.lock);
+	while(work.busy > 0)
+		pthread_cond_wait(&work.done, &work.lock);
+	pthread_mutex_unlock(&work.lock);
+
+	// Slots that went away while being read are skipped over
+	n_groups = 0;
+	for(int i = 0; i < work.n; i++)
+		n_groups += ((struct slot_cache *)slots.live[i])->ok;
 
-	// sort by slot-id
-	qsort(groups, n_groups, sizeof(*groups), groupsort);
+	stats_count(STAT_SLOTS, n_groups);
+	last_read = monotonic_ns();
+	stats_time(read_timer, last_read - start);
+}
 
-	// clean up mounts for good measure
-	for_each_controller(c)
-		free(c->mount);
+void read_condor_cgroup_info(const char *cg_name)
+{
+	read_info(cg_name, false);
+}
+
+void peek_condor_cgroup_info(const char *cg_name)
+{
+	read_info(cg_name, true);
 }
 
 
@@ -408,5 +1690,6 @@ int main(void)
 	read_condor_cgroup_info("htcondor");
 	for_each_group(group)
 		printf("%s %x %lu\n", group->slot_name, group->sort_order, group->rss_used);
+	cleanup_groups();
 }
 #endif
@@ -3,29 +3,151 @@
 
 #include <time.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* How a metric in GROUP_METRICS is sent */
+enum metric_kind {
+	KIND_GAUGE,		/* a level, sent as it is */
+	KIND_RATE,		/* a gauge only known from a slot's 2nd sample */
+	KIND_COUNTER,		/* a running total, or its delta */
+	KIND_FAST,		/* a gauge summing up the samples taken between
+				   reads, when there are any (see
+				   set_fast_samples()); their mean is sent
+				   in place of the gauge sampled */
+};
+
+/**
+ * The metrics sent for each slot, in the order they're sent. Adding one here
+ * adds it to struct condor_group and to every output; the cgroup reading
+ * code then only has to fill it in (see STAT_KEYS in cgroup.c).
+ *
+ * X(type, field, name, kind, delta, total)
+ * @type, @field: its member of struct condor_group
+ * @name: what it's called after the slot's "ns.host.slot." prefix
+ * @kind: a metric_kind, without the KIND_
+ * @delta: for a counter, the member holding how much it went up since the
+ *         slot's last sample (for backends that want deltas)
+ * @total: 1 if it's summed up for the node's and each owner's totals
+ */
+#define GROUP_METRICS(X) \
+	X(time_t,   start_time,     starttime,     GAUGE,   -, 0) \
+	X(uint64_t, cpu_shares,     cpu_shares,    GAUGE,   -, 0) \
+	X(uint32_t, num_tasks,      tasks,         GAUGE,   -, 1) \
+	X(uint32_t, num_procs,      procs,         GAUGE,   -, 1) \
+	X(uint64_t, user_cpu_usage, cpu_user,      COUNTER, cpu_user_delta, 0) \
+	X(uint64_t, sys_cpu_usage,  cpu_sys,       COUNTER, cpu_sys_delta, 0) \
+	X(uint32_t, cpu_util,       cpu_util,      RATE,    -, 1) \
+	X(uint32_t, cpu_util_user,  cpu_util_user, RATE,    -, 1) \
+	X(uint32_t, cpu_util_sys,   cpu_util_sys,  RATE,    -, 1) \
+	X(uint64_t, rss_used,       rss,           GAUGE,   -, 1) \
+	X(uint64_t, cache_used,     cache,         GAUGE,   -, 1) \
+	X(uint64_t, swap_used,      swap,          GAUGE,   -, 1) \
+	X(uint64_t, mem_usage,      memusage,      GAUGE,   -, 1) \
+	X(uint64_t, mem_soft_limit, softmemlimit,  GAUGE,   -, 0) \
+	X(uint64_t, rss_min,        rss_min,       FAST,    -, 0) \
+	X(uint64_t, rss_max,        rss_max,       FAST,    -, 0) \
+	X(uint64_t, rss_p95,        rss_p95,       FAST,    -, 0) \
+	X(uint64_t, cache_min,      cache_min,     FAST,    -, 0) \
+	X(uint64_t, cache_max,      cache_max,     FAST,    -, 0) \
+	X(uint64_t, swap_min,       swap_min,      FAST,    -, 0) \
+	X(uint64_t, swap_max,       swap_max,      FAST,    -, 0) \
+	X(uint32_t, cpu_util_min,   cpu_util_min,  FAST,    -, 0) \
+	X(uint32_t, cpu_util_max,   cpu_util_max,  FAST,    -, 0)
+
+struct metric_names;
 
 struct condor_group {
 	char slot_name[12];	/*!< Extracted slot name */
+	char owner[32];		/*!< User the job runs as, "" if not known */
 	uint32_t sort_order;
-	uint32_t num_procs;
-	uint32_t num_tasks;
-	uint64_t cpu_shares;
-	uint64_t user_cpu_usage;
-	uint64_t sys_cpu_usage;
-	uint64_t rss_used;
-	uint64_t swap_used;
-	uint64_t cache_used;
-	uint64_t mem_soft_limit;
-	time_t start_time;
+#define X(type, field, name, kind, delta, total) type field;
+	GROUP_METRICS(X)
+#undef X
+	uint64_t cpu_usage_ns;	/*!< Cumulative counters the rates come from */
+	uint64_t cpu_user_ns;
+	uint64_t cpu_sys_ns;
+	uint64_t cpu_user_delta; /*!< Seconds of cpu_user/sys since last sample */
+	uint64_t cpu_sys_delta;
+	bool has_cpu_util;	/*!< False on a slot's first sample, when the
+				     RATE metrics and counter deltas aren't
+				     known */
+	bool has_fast;		/*!< The FAST metrics were filled in */
+	const struct metric_names *metric_names; /*!< Interned by metrics.c */
 };
 
 extern const char *default_cgroup_name;
 
-#define for_each_group(g) for(struct condor_group *g = NULL; __group_for_each(&g);)
+/* Go through the groups read in slot-id order, can be nested */
+#define for_each_group(g) \
+	for(size_t __pos_##g = 0, __once_##g = 1; __once_##g; __once_##g = 0) \
+		for(struct condor_group *g; \
+		    (g = __group_next(&__pos_##g)) != NULL; __pos_##g++)
 
+/* Most descriptors a slot keeps open between reads, and how many to leave for
+ * everything else: slots past (open files limit - FD_RESERVE) / SLOT_FDS have
+ * their files opened and closed again on every read */
+#define SLOT_FDS 12
+#define FD_RESERVE 64
+
+/* Scan and read all condor slot cgroups under @cg_name -- may be called
+ * repeatedly, the controller mounts are found only on the first call and each
+ * slot's group stays in place in the slot table until its cgroup goes away or
+ * cleanup_groups() */
 void read_condor_cgroup_info(const char *cg_name);
 
-bool __group_for_each(struct condor_group **g);
+/* Read the slots like read_condor_cgroup_info(), but with CPU rates and FAST
+ * metrics over the time since then, leaving its previous samples and any
+ * final counters of exited jobs for the next read_condor_cgroup_info(): for
+ * reads in between those whose deltas are sent */
+void peek_condor_cgroup_info(const char *cg_name);
+
+/* Find the cgroup controllers under @root, laid out like /sys/fs/cgroup, rather
+ * than from /proc/mounts. Call before the first read_condor_cgroup_info() */
+void set_cgroup_root(const char *root);
+
+/* Read the slot cgroups using @n threads (default 1), call before the first
+ * read_condor_cgroup_info() */
+void set_read_workers(int n);
+
+/* Follow slot cgroups coming and going with inotify rather than listing
+ * condor's cgroup directory each time (but for once a minute, to be safe), and
+ * read a v2 job's final counters as it exits so short jobs are still sent.
+ * Call before the first read_condor_cgroup_info() */
+void set_watch_slots(bool watch);
+
+/* Have cgroup_sample_fast() sample the slots up to @n times between reads,
+ * for each read to give the min, max and mean of the slots' rss, cache, swap
+ * and CPU use over those samples (and its own), and rss's 95th percentile, as
+ * the FAST metrics. Call before the first read_condor_cgroup_info() */
+void set_fast_samples(int n);
+
+/* Sample the memory.stat and CPU usage of each slot found by the last read,
+ * and nothing else, for the next read's FAST metrics. Slots whose files
+ * aren't kept open between reads are skipped. Call with the groups locked. */
+void cgroup_sample_fast(void);
+
+/* Handle slot changes until @deadline on CLOCK_MONOTONIC, returning false if
+ * interrupted by a signal. Returns at once if slots aren't being watched. */
+bool cgroup_wait_events(const struct timespec *deadline);
+
+/* The descriptor cgroup_wait_events() waits on, to wait on it along with
+ * others, and handle the slot changes on it with cgroup_handle_events() when
+ * it's readable. -1 if slots aren't being watched. */
+int cgroup_events_fd(void);
+void cgroup_handle_events(void);
+
+/* Hold off other threads reading or changing the groups (like a scrape being
+ * served) from before read_condor_cgroup_info() until done with for_each_group.
+ * Only needed when more than one thread uses them. */
+void cgroup_lock(void);
+void cgroup_unlock(void);
+
+/* When read_condor_cgroup_info() last finished, on the monotonic clock in ns
+ * (0 if it hasn't yet) */
+uint64_t cgroup_read_time(void);
+
+struct condor_group *__group_next(size_t *pos);
 bool groups_empty(void);
 void cleanup_groups(void);
 
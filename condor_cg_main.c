@@ -5,68 +5,405 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
 
 #include "graphite.h"
+#include "influx.h"
+#include "prometheus.h"
 #include "statsd.h"
+#include "sendq.h"
+#include "spool.h"
 
 #include "cgroup.h"
 #include "metrics.h"
+#include "selfstats.h"
 #include "util.h"
 
 static char hostname[256];
 static char *root_ns = "htcondor.cgroups";
 
-static inline int min(int a, int b) { return (a < b) ? a : b; }
+/* Whether to send each slot's metrics, and the node's and owners' totals */
+static bool send_slots = true;
+static bool send_totals = false;
+
+/* Where to serve Prometheus scrapes from, if anywhere, and the oldest reading
+ * of the cgroups they're given */
+static const char *listen_on = NULL;
+static uint64_t prom_max_age = PROM_DEFAULT_MAX_AGE * 1000000000ULL;
+
+/* Time taken making the metric lines and sending them off, each cycle */
+static struct stat_timer *format_timer, *flush_timer;
+
+/* Most samples between reports with -F */
+#define MAX_FAST_SAMPLES 3600
+
+/* Most bytes queued for each TCP sink that isn't keeping up */
+static size_t queue_max = SENDQ_DEFAULT_MAX;
+
+/* Cleared by SIGTERM/SIGINT to end the sampling loop in daemon mode */
+static volatile sig_atomic_t running = 1;
 
 enum backend {
 	GRAPHITE,
 	STATSD,
+	INFLUX,
+};
+
+/* Somewhere to send the metrics, all of them from the same scan */
+struct sink {
+	enum backend mode;
+	enum graphite_contype conn_class;	/* TCP or UDP, or PICKLE */
+	char host[128];
+	char port[16];
+	int fd;
+	const struct metric_backend *b;
 };
 
+static struct sink sinks[MAX_SINKS];
+static int n_sinks = 0;
+
+/* The schemes of the -o sinks, and the port each defaults to */
+static const struct {
+	const char *scheme;
+	enum backend mode;
+	enum graphite_contype conn_class;
+	const char *port;
+} sink_schemes[] = {
+	{ "graphite",		GRAPHITE,	GRAPHITE_UDP,		"2003" },
+	{ "graphite+udp",	GRAPHITE,	GRAPHITE_UDP,		"2003" },
+	{ "graphite+tcp",	GRAPHITE,	GRAPHITE_TCP,		"2003" },
+	{ "graphite+pickle",	GRAPHITE,	GRAPHITE_PICKLE,	"2004" },
+	{ "statsd",		STATSD,		GRAPHITE_UDP,		"8125" },
+	{ "influx",		INFLUX,		GRAPHITE_UDP,		"8089" },
+	{ "influx+udp",		INFLUX,		GRAPHITE_UDP,		"8089" },
+	{ "influx+tcp",		INFLUX,		GRAPHITE_TCP,		"8094" },
+};
+#define N_SINK_SCHEMES (sizeof(sink_schemes) / sizeof(*sink_schemes))
+
+static void stop_running(int sig)
+{
+	(void)sig;
+	running = 0;
+}
+
 static void usage(const char *progname, enum backend b)
 {
 	if(b == GRAPHITE) {
 		fprintf(stderr,
-"Usage: %s [-p PATH] [-c CGROUP] GRAPHITE_DEST\n\n"
+"Usage: %s [-p PATH] [-c CGROUP] [-o SINKS] [GRAPHITE_DEST]\n\n"
 "GRAPHITE_DEST is either host:port or just host with port defaulting to the\n"
-"standard line-protocol port 2003\n\n"
+"standard line-protocol port 2003 (2004, the pickle port, with -P)\n\n"
 "Options:\n\t-c CGROUP: condor cgroup name (default %s)\n"
-"\t-p PATH: metric path prefix for graphite (default %s)\n\n"
+"\t-o SINKS: also send to each of a comma-separated list of\n"
+"\t      graphite[+udp|+tcp|+pickle]://host[:port], statsd://host[:port]\n"
+"\t      or influx[+udp|+tcp]://host[:port]\n"
+"\t-l [ADDR:]PORT: serve /metrics for Prometheus to scrape on PORT\n"
+"\t-T SECONDS: serve scrapes readings up to SECONDS old (default %d)\n"
+"\t-p PATH: metric path prefix for graphite (default %s)\n"
+"\t-M BYTES: most bytes of metrics in each UDP datagram (default %d)\n"
+"\t-Q BYTES: most bytes to queue for a slow TCP connection (default %d)\n"
+"\t-S FILE: spool what can't be sent over TCP to FILE, to send later\n"
+"\t-Z BYTES: size of a new spool file (default %d)\n"
+"\t-D INTERVAL: stay running and sample every INTERVAL seconds\n"
+"\t-F SECONDS: with -D, also sample memory and CPU every SECONDS and send\n"
+"\t      their min, max and mean each INTERVAL\n"
+"\t-j N: read the slot cgroups with N threads (default 1)\n"
+"\t-r ROOT: find the cgroup controllers under ROOT (like /sys/fs/cgroup)\n"
+"\t      instead of from /proc/mounts\n"
+"\t-R both|only: send the node's and each job owner's totals as well as\n"
+"\t      (both) or instead of (only) each slot's metrics\n\n"
 "Flags:\n\t-d Debug mode: print metrics to screen and don't send to graphite\n"
 "\t-t Use TCP connection instead of the default (UDP). All metrics will\n"
-"\t      be sent in one connection instead of 1 packet per metric\n"
+"\t      be sent in one connection instead of packed into datagrams\n"
+"\t-P Use the pickle protocol over TCP, sending each sample as one batch\n"
 "\t-h show this help message\n\n",
-		progname, default_cgroup_name, root_ns);
+		progname, default_cgroup_name, PROM_DEFAULT_MAX_AGE, root_ns,
+		GRAPHITE_DGRAM_SIZE, SENDQ_DEFAULT_MAX, SPOOL_DEFAULT_SIZE);
 
 	} else {
 		fprintf(stderr,
-"Usage: %s [-p PATH] [-c CGROUP] STATSD_HOST\n\n"
+"Usage: %s [-p PATH] [-c CGROUP] [-o SINKS] [STATSD_HOST]\n\n"
 "STATSD_HOST is either host:port or just host with port defaulting to the\n"
 "standard statsd port 8125\n\n"
+"Levels are sent as gauges, and CPU time as a counter of the seconds used\n"
+"since the last sample, so is only sent from the second sample in -D mode\n\n"
 "Options:\n\t-c CGROUP: condor cgroup name (default %s)\n"
-"\t-p PATH: metric path prefix for statsd (default %s)\n\n"
+"\t-o SINKS: also send to each of a comma-separated list of\n"
+"\t      statsd://host[:port], graphite[+udp|+tcp|+pickle]://host[:port]\n"
+"\t      or influx[+udp|+tcp]://host[:port]\n"
+"\t-l [ADDR:]PORT: serve /metrics for Prometheus to scrape on PORT\n"
+"\t-T SECONDS: serve scrapes readings up to SECONDS old (default %d)\n"
+"\t-p PATH: metric path prefix for statsd (default %s)\n"
+"\t-D INTERVAL: stay running and sample every INTERVAL seconds\n"
+"\t-F SECONDS: with -D, also sample memory and CPU every SECONDS and send\n"
+"\t      their min, max and mean each INTERVAL\n"
+"\t-j N: read the slot cgroups with N threads (default 1)\n"
+"\t-r ROOT: find the cgroup controllers under ROOT (like /sys/fs/cgroup)\n"
+"\t      instead of from /proc/mounts\n"
+"\t-R both|only: send the node's and each job owner's totals as well as\n"
+"\t      (both) or instead of (only) each slot's metrics\n\n"
 "Flags:\n\t-d Debug mode: print metrics to screen and don't send to statsd\n"
 "\t-h show this help message\n\n",
-		progname, default_cgroup_name, root_ns);
+		progname, default_cgroup_name, PROM_DEFAULT_MAX_AGE, root_ns);
 	}
 	exit(EXIT_FAILURE);
 }
 
+/* Parse a positive number of (possibly fractional) seconds into @ts */
+static void parse_interval(const char *str, struct timespec *ts)
+{
+	char *p;
+	double secs;
+
+	errno = 0;
+	secs = strtod(str, &p);
+	if(errno != 0 || *p != '\0' || p == str || secs <= 0.0)
+		log_exit("Invalid interval '%s', must be a positive number", str);
+	ts->tv_sec = (time_t)secs;
+	ts->tv_nsec = (long)((secs - ts->tv_sec) * 1e9);
+}
+
+/* Parse a positive integer from @str, up to @max */
+static int parse_count(const char *str, long max)
+{
+	char *p;
+	long n;
+
+	errno = 0;
+	n = strtol(str, &p, 10);
+	if(errno != 0 || *p != '\0' || p == str || n <= 0 || n > max)
+		log_exit("Invalid number '%s', must be from 1 to %ld", str, max);
+	return (int)n;
+}
+
+/* Parse the -R option: send totals along with, or instead of, the slots */
+static void parse_totals(const char *str)
+{
+	if(STREQ(str, "both"))
+		send_slots = true;
+	else if(STREQ(str, "only"))
+		send_slots = false;
+	else
+		log_exit("Invalid totals '%s', must be both or only", str);
+	send_totals = true;
+}
+
+/* Add a sink of type @mode sending to the @len bytes at @dest, which are
+ * host:port or just host, with @port by default
+ */
+static void add_sink(enum backend mode, enum graphite_contype conn_class,
+		     const char *dest, size_t len, const char *port)
+{
+	struct sink *s;
+	const char *p;
+	size_t hlen = len, plen = strlen(port);
+
+	if(n_sinks == MAX_SINKS)
+		log_exit("Too many sinks, there can be up to %d", MAX_SINKS);
+	s = &sinks[n_sinks++];
+	s->mode = mode;
+	s->conn_class = conn_class;
+	s->fd = -1;
+	if(mode == GRAPHITE)
+		s->b = &graphite_backend;
+	else if(mode == STATSD)
+		s->b = &statsd_backend;
+	else
+		s->b = &influx_backend;
+
+	if((p = memchr(dest, ':', len)) != NULL)	{
+		hlen = p - dest;
+		port = p + 1;
+		plen = dest + len - port;
+	}
+	if(hlen == 0 || hlen >= sizeof(s->host) || plen == 0 ||
+	   plen >= sizeof(s->port))
+		log_exit("Invalid destination '%.*s'", (int)len, dest);
+	snprintf(s->host, sizeof(s->host), "%.*s", (int)hlen, dest);
+	snprintf(s->port, sizeof(s->port), "%.*s", (int)plen, port);
+}
+
+/* Parse the -o option: a comma-separated list of SCHEME://host[:port] */
+static void parse_sinks(const char *str)
+{
+	while(*str != '\0')	{
+		size_t len = strcspn(str, ",");
+		const char *dest = strstr(str, "://");
+		size_t i, slen = (dest != NULL) ? (size_t)(dest - str) : 0;
+
+		for(i = 0; i < N_SINK_SCHEMES; i++)
+			if(slen > 0 && slen < len &&
+			   strlen(sink_schemes[i].scheme) == slen &&
+			   strncmp(sink_schemes[i].scheme, str, slen) == 0)
+				break;
+		if(i == N_SINK_SCHEMES)
+			log_exit("Invalid sink '%.*s', must be "
+				 "SCHEME://host[:port] with SCHEME graphite, "
+				 "graphite+udp, graphite+tcp, graphite+pickle, "
+				 "statsd, influx, influx+udp or influx+tcp",
+				 (int)len, str);
+
+		add_sink(sink_schemes[i].mode, sink_schemes[i].conn_class,
+			 dest + 3, len - slen - 3, sink_schemes[i].port);
+		str += len;
+		if(*str == ',')
+			str++;
+	}
+}
+
+/* Advance @t by @interval */
+static void timespec_add(struct timespec *t, const struct timespec *interval)
+{
+	t->tv_sec += interval->tv_sec;
+	t->tv_nsec += interval->tv_nsec;
+	if(t->tv_nsec >= 1000000000L)	{
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000L;
+	}
+}
+
+static bool timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec) ||
+	       (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Move @next ahead to the following tick and sleep until that absolute
+ * monotonic time. If a cycle overran, skip the ticks we missed rather than
+ * firing them off back-to-back. Returns early if a signal stops us.
+ */
+static void wait_next_tick(struct timespec *next, const struct timespec *interval)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	do {
+		timespec_add(next, interval);
+	} while(timespec_before(next, &now));
+
+	/* Use the time to catch up on anything a slow TCP sink didn't take,
+	 * and on slots coming and going and jobs exiting meanwhile (watched
+	 * along with the sinks, so one that's down doesn't hold them up)
+	 */
+	sendq_wait(next);
+	if(running)
+		cgroup_wait_events(next);
+	while(running && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					 next, NULL) == EINTR)
+		;
+}
+
+/* Read all the cgroups once and send them off to every sink, each into its
+ * own buffer so a sink that's down or slow doesn't hold up the others
+ */
+static void sample_groups(const char *cgroup_name)
+{
+	uint64_t t0;
+
+	graphite_update_time();
+	influx_update_time();
+	cgroup_lock();
+	read_condor_cgroup_info(cgroup_name);
+
+	if(groups_empty() && debug)
+		fputs("No condor cgroups groups found\n", stderr);
+
+	t0 = monotonic_ns();
+	for_each_group(g)	{
+		for(int i = 0; i < n_sinks && send_slots; i++)
+			send_group_metrics(g, sinks[i].fd, sinks[i].b);
+		if(send_totals)
+			total_add_group(g);
+	}
+	if(send_totals)	{
+		for(int i = 0; i < n_sinks; i++)
+			send_total_metrics(sinks[i].fd, sinks[i].b);
+		total_reset();
+	}
+	cgroup_unlock();
+	stats_time(format_timer, monotonic_ns() - t0);
+
+	/* The collector's own stats go out even with no slots, with the flush
+	 * time from the cycle before as this one's isn't known yet
+	 */
+	stats_end_cycle();
+	for(int i = 0; i < n_sinks; i++)
+		send_collector_metrics(sinks[i].fd, sinks[i].b);
+
+	if(debug)	{
+		fflush(stdout);
+		return;
+	}
+	t0 = monotonic_ns();
+	for(int i = 0; i < n_sinks; i++)
+		sinks[i].b->flush(sinks[i].fd);
+	stats_time(flush_timer, monotonic_ns() - t0);
+}
+
+/* Connect to every sink, the spool going with the first TCP graphite one */
+static void connect_sinks(int dgram_size)
+{
+	bool spool = spool_enabled();
+
+	for(int i = 0; i < n_sinks; i++)	{
+		struct sink *s = &sinks[i];
+
+		if(s->mode == STATSD)	{
+			s->fd = statsd_connect(s->host, s->port);
+			continue;
+		}
+		if(s->mode == INFLUX)	{
+			s->fd = influx_connect(s->host, s->port,
+					       s->conn_class == GRAPHITE_TCP,
+					       queue_max);
+			if(s->conn_class == GRAPHITE_UDP)
+				buf_set_datagram_size(s->fd, dgram_size);
+			continue;
+		}
+		s->fd = graphite_connect(s->host, s->port, s->conn_class,
+					 spool && s->conn_class != GRAPHITE_UDP);
+		if(s->conn_class == GRAPHITE_UDP)
+			buf_set_datagram_size(s->fd, dgram_size);
+		else
+			spool = false;
+	}
+}
+
+static void close_sinks(void)
+{
+	for(int i = 0; i < n_sinks; i++)	{
+		if(sinks[i].mode == GRAPHITE)
+			graphite_close(sinks[i].fd);
+		else if(sinks[i].mode == STATSD)
+			statsd_close(sinks[i].fd);
+		else
+			influx_close(sinks[i].fd);
+	}
+}
+
 int main(int argc, char *argv[])
 {
-	char dest[128];
 	const char *cgroup_name = default_cgroup_name;
-	char *port = "2003";
-	char *p;
-	int fd = -1;
+	const char *port;
+	bool stream_sink = false;
 	int c;
 	int conn_class = GRAPHITE_UDP;
+	bool daemon_mode = false, sample_on_tick;
+	int dgram_size = GRAPHITE_DGRAM_SIZE;
+	const char *spool_path = NULL;
+	int spool_size = SPOOL_DEFAULT_SIZE;
+	struct timespec interval, next;
+	struct timespec fast_interval = { 0, 0 };
+	int fast_per_report = 0, fast_ticks = 0;
 	enum backend mode;
 
 	mode = strstr(argv[0], "statsd") ? STATSD : GRAPHITE;
 
 	while ((c = getopt(argc, argv, (mode == GRAPHITE) ?
-					"hdc:p:t" : "hdc:p:")) != -1) {
+					"hdc:p:r:tPD:F:j:l:M:o:Q:R:S:T:Z:" :
+					"hdc:p:r:D:F:j:l:o:R:T:")) != -1) {
 		switch (c) {
 		case 'd':
 			debug = 1;
@@ -77,14 +414,63 @@ int main(int argc, char *argv[])
 		case 'p':
 			root_ns = optarg;
 			break;
+		case 'r':
+			set_cgroup_root(optarg);
+			break;
 		case 'h':
 			usage(argv[0], mode);
 			break;
 		case 't':
 			conn_class = GRAPHITE_TCP;
 			break;
+		case 'P':
+			conn_class = GRAPHITE_PICKLE;
+			break;
+		case 'D':
+			parse_interval(optarg, &interval);
+			daemon_mode = true;
+			break;
+		case 'F':
+			parse_interval(optarg, &fast_interval);
+			break;
+		case 'j':
+			set_read_workers(parse_count(optarg, 1024));
+			break;
+		case 'l':
+			listen_on = optarg;
+			break;
+		case 'M':
+			dgram_size = parse_count(optarg, 65000);
+			break;
+		case 'o':
+			parse_sinks(optarg);
+			break;
+		case 'Q':
+			queue_max = parse_count(optarg, 1 << 30);
+			graphite_set_queue_max(queue_max);
+			break;
+		case 'R':
+			parse_totals(optarg);
+			break;
+		case 'S':
+			spool_path = optarg;
+			break;
+		case 'T':	{
+			struct timespec ts;
+
+			parse_interval(optarg, &ts);
+			prom_max_age = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+			break;
+		}
+		case 'Z':
+			spool_size = parse_count(optarg, 1 << 30);
+			break;
 		case '?':
-			if (optopt == 'p' || optopt == 'c')
+			if (optopt == 'p' || optopt == 'c' || optopt == 'r' ||
+			    optopt == 'D' || optopt == 'F' || optopt == 'j' ||
+			    optopt == 'l' || optopt == 'M' || optopt == 'o' ||
+			    optopt == 'Q' || optopt == 'R' || optopt == 'S' ||
+			    optopt == 'T' || optopt == 'Z')
 				fprintf (stderr,
 					 "Option -%c requires an argument.\n",
 					 optopt);
@@ -101,51 +487,108 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	if(optind >= argc)
+	/* The destination given on its own is the sink the program is named
+	 * for, and is needed unless there are sinks given with -o
+	 */
+	if(optind < argc)	{
+		if(mode == STATSD)
+			port = "8125";
+		else
+			port = (conn_class == GRAPHITE_PICKLE) ? "2004" : "2003";
+		add_sink(mode, conn_class, argv[optind], strlen(argv[optind]),
+			 port);
+	}
+	if(n_sinks == 0 && listen_on == NULL)
 		usage(argv[0], mode);
 
-	if((p = strchr(argv[optind], ':')) != NULL)	{
-		size_t hlen = min(p - argv[optind], sizeof(dest)-1);
-		port = p + 1;
-		strncpy(dest, argv[optind], hlen);
-		*(dest + hlen) = '\0';
-	} else {
-		strncpy(dest, argv[optind], sizeof(dest) - 1);
+	/* Serving scrapes keeps running, only reading the cgroups when asked
+	 * unless there's an interval to sample at as well
+	 */
+	sample_on_tick = daemon_mode;
+	if(listen_on != NULL && !daemon_mode)	{
+		if(n_sinks > 0)
+			log_exit("Serving scrapes along with sinks needs -D");
+		interval.tv_sec = 60;
+		interval.tv_nsec = 0;
+		daemon_mode = true;
+	}
+
+	/* Sampling between reports, every so many of which is a report, so the
+	 * interval is rounded to a whole number of samples
+	 */
+	if(fast_interval.tv_sec > 0 || fast_interval.tv_nsec > 0)	{
+		uint64_t fast_ns, report_ns;
+
+		if(!sample_on_tick)
+			log_exit("Sampling between reports (-F) needs -D");
+		fast_ns = fast_interval.tv_sec * 1000000000ULL +
+			  fast_interval.tv_nsec;
+		report_ns = interval.tv_sec * 1000000000ULL + interval.tv_nsec;
+		fast_per_report = (report_ns + fast_ns / 2) / fast_ns;
+		if(fast_per_report < 2 || fast_per_report > MAX_FAST_SAMPLES)
+			log_exit("-F must be from 1/%d of the -D interval to "
+				 "half of it", MAX_FAST_SAMPLES);
+		set_fast_samples(fast_per_report - 1);
 	}
 
+	for(int i = 0; i < n_sinks; i++)
+		if(sinks[i].mode == GRAPHITE &&
+		   sinks[i].conn_class != GRAPHITE_UDP)
+			stream_sink = true;
+
 	gethostname(hostname, sizeof(hostname));
-	graphite_init(conn_class);
+	metrics_init(root_ns, hostname);
+	format_timer = stats_timer("format");
+	flush_timer = stats_timer("flush");
+	graphite_init();
+	if(spool_path != NULL && !stream_sink)
+		log_exit("Spooling needs a TCP connection (-t or -P)");
+
 	if(!debug)	{
-		if(mode == GRAPHITE)
-			fd = graphite_connect(dest, port);
-		else
-			fd = statsd_connect(dest, port);
+		if(spool_path != NULL)
+			spool_open(spool_path, spool_size);
+		connect_sinks(dgram_size);
 	}
 
-	read_condor_cgroup_info(cgroup_name);
+	if(!daemon_mode)	{
+		sample_groups(cgroup_name);
+	} else {
+		struct sigaction sa = { .sa_handler = stop_running };
 
+		/* No SA_RESTART, so the sleep between samples is interrupted */
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGTERM, &sa, NULL);
+		sigaction(SIGINT, &sa, NULL);
+		signal(SIGPIPE, SIG_IGN);
 
-	if(groups_empty())	{
-		if(debug) {
-			fputs("No condor cgroups groups found...exiting\n",
-			      stderr);
+		set_watch_slots(true);
+		clock_gettime(CLOCK_MONOTONIC, &next);
+		sample_groups(cgroup_name);
+		sendq_watch(cgroup_events_fd(), cgroup_handle_events);
+		if(listen_on != NULL)
+			prom_start(listen_on, cgroup_name, root_ns, hostname,
+				   prom_max_age, sample_on_tick);
+		while(running)	{
+			wait_next_tick(&next, fast_per_report ? &fast_interval :
+								&interval);
+			if(!running || !sample_on_tick)
+				continue;
+			if(fast_per_report && ++fast_ticks < fast_per_report) {
+				cgroup_lock();
+				cgroup_sample_fast();
+				cgroup_unlock();
+				continue;
+			}
+			fast_ticks = 0;
+			sample_groups(cgroup_name);
 		}
-		return 0;
+		prom_stop();
 	}
 
-	for_each_group(g)	{
-		send_group_metrics(g, hostname, root_ns, fd,
-			(mode == GRAPHITE) ?
-			&graphite_send_uint : &statsd_send_uint
-		);
-	}
-	if(!debug)	{
-		if(mode == GRAPHITE)
-			graphite_close(fd);
-		else
-			statsd_close(fd);
-	}
+	if(!debug)
+		close_sinks();
 
+	spool_close();
 	cleanup_groups();
 	return 0;
 }
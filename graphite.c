@@ -9,90 +9,338 @@
 #include <syslog.h>
 #include <unistd.h>
 #include <assert.h>
+#include <errno.h>
 
 #include "graphite.h"
+#include "sendq.h"
 
 static time_t _current_time = 0;
 
-static int (_contype) = 0;
+/* " <timestamp>\n" that ends every line, formatted once per sample */
+static char _ts_suffix[MAX_DIGITS + 3];
+static size_t _ts_len = 0;
 
-void graphite_init(enum graphite_contype ctype)
+static size_t _queue_max = SENDQ_DEFAULT_MAX;
+
+/* Each connection's type, and for GRAPHITE_PICKLE the frame being built this
+ * cycle: a 4-byte big-endian length, then a protocol 2 pickle of a list of
+ * (path, (timestamp, value)) tuples
+ */
+struct graphite_conn {
+	bool in_use;
+	int fd;
+	enum graphite_contype type;
+	char *pickle;
+	size_t pickle_len;
+	size_t pickle_size;
+};
+
+static struct graphite_conn _conns[MAX_SINKS];
+
+/* The last descriptor looked up and its connection, as metrics for one come in
+ * runs -- reset whenever connections come or go */
+static int _last_fd = -2;
+static struct graphite_conn *_last_conn = NULL;
+
+/* The connection @fd is, or NULL if it's not one (like in debug mode), which
+ * gets the line protocol */
+static struct graphite_conn *_conn(int fd)
+{
+	if(fd == _last_fd)
+		return _last_conn;
+	_last_fd = fd;
+	_last_conn = NULL;
+	for(int i = 0; i < MAX_SINKS && _last_conn == NULL; i++)
+		if(_conns[i].in_use && _conns[i].fd == fd)
+			_last_conn = &_conns[i];
+	return _last_conn;
+}
+
+/* The connection @fd is if it's sending pickles, otherwise NULL */
+static inline struct graphite_conn *_pickler(int fd)
+{
+	struct graphite_conn *c = _conn(fd);
+
+	return (!debug && c != NULL && c->type == GRAPHITE_PICKLE) ? c : NULL;
+}
+
+/* Pickle opcodes used */
+#define PK_PROTO	'\x80'
+#define PK_EMPTY_LIST	']'
+#define PK_MARK		'('
+#define PK_APPENDS	'e'
+#define PK_STOP		'.'
+#define PK_BININT	'J'	/* 4-byte little-endian signed */
+#define PK_LONG1	'\x8a'	/* 1-byte length, little-endian two's complement */
+#define PK_BINFLOAT	'G'	/* 8-byte big-endian double */
+#define PK_BINUNICODE	'X'	/* 4-byte little-endian length, then UTF-8 */
+#define PK_TUPLE2	'\x86'
+
+/* Most bytes _pickle_int() takes: a LONG1 of 8 bytes, and of 9 unsigned */
+#define PK_INT_MAX_SIGNED	10
+#define PK_INT_MAX_UNSIGNED	11
+
+#define PICKLE_HEAD 8	/* length, PROTO 2, EMPTY_LIST, MARK */
+
+static void _set_time(time_t t)
+{
+	_current_time = t;
+	_ts_suffix[0] = ' ';
+	_ts_len = 1 + itoa(_ts_suffix + 1, t);
+	_ts_suffix[_ts_len++] = '\n';
+}
+
+void graphite_init(void)
 {
-	_current_time = time(NULL);
-	_contype = ctype;
+	_set_time(time(NULL));
 	openlog("graphite-lib", LOG_ODELAY | LOG_PID, LOG_DAEMON);
 }
 
-int graphite_connect(const char *server, const char *port)
+void graphite_update_time(void)
 {
-	if(_contype == GRAPHITE_TCP) {
-		return server_connect(server, port, SOCK_STREAM);
+	_set_time(time(NULL));
+}
+
+void graphite_set_queue_max(size_t bytes)
+{
+	_queue_max = bytes;
+}
+
+int graphite_connect(const char *server, const char *port,
+		     enum graphite_contype ctype, bool spool)
+{
+	struct graphite_conn *c = NULL;
+	int fd;
+
+	for(int i = 0; i < MAX_SINKS && c == NULL; i++)
+		if(!_conns[i].in_use)
+			c = &_conns[i];
+	if(c == NULL)
+		log_exit("More than %d graphite connections", MAX_SINKS);
+
+	if(ctype == GRAPHITE_TCP || ctype == GRAPHITE_PICKLE) {
+		/* Carry on without it if carbon's down to start with */
+		fd = server_try_connect(server, port, SOCK_STREAM, true);
+		fd = sendq_open(fd, server, port, _queue_max, spool);
+		if(ctype == GRAPHITE_PICKLE)
+			sendq_set_whole_records(fd);
 	} else {
-		return server_connect(server, port, SOCK_DGRAM);
+		fd = server_connect(server, port, SOCK_DGRAM);
+		buf_set_datagram_size(fd, GRAPHITE_DGRAM_SIZE);
 	}
+
+	memset(c, 0, sizeof(*c));
+	c->in_use = true;
+	c->fd = fd;
+	c->type = ctype;
+	_last_fd = -2;
+	return fd;
 }
 
 void graphite_close(int fd)
 {
-	if(_contype == GRAPHITE_TCP)	{
-		buf_close(fd);
-		if (shutdown(fd, SHUT_RDWR) != 0)
+	struct graphite_conn *c = _conn(fd);
+
+	graphite_flush(fd);
+	buf_close(fd);
+	if(c != NULL && c->type != GRAPHITE_UDP)	{
+		sendq_close(fd);
+		if (shutdown(fd, SHUT_RDWR) != 0 && errno != ENOTCONN)
 			perror("TCP Shutdown");
 	}
+	if(c != NULL)	{
+		free(c->pickle);
+		c->in_use = false;
+		_last_fd = -2;
+	}
 	if(close(fd) < 0)
 		perror("Close fd");
 }
 
-static char *_make_metric(const char *name, const char *val)
+/* Send "<metric.name.path> <value> <timestamp>\n", the value already being
+ * formatted with the space before it as @vlen bytes at @val
+ */
+static int _send_metric(int fd, const char *m, const char *val, size_t vlen)
 {
-	/* lengths + (generous)len of time + spaces + null */
-	size_t len = strlen(name) + strlen(val) + 16 + 2 + 1;
-	char *str;
+	assert(_current_time > 0);
+	return metric_line_gather(fd, m, strlen(m), val, vlen, _ts_suffix,
+				  _ts_len);
+}
 
-	str = xcalloc(len);
+/* Make room for @len more bytes in the pickle frame, starting it if need be,
+ * and return where they go. Carbon drops frames over PICKLE_MAX_FRAME, so
+ * send what we have first if they'd go over that.
+ */
+static char *_pickle_reserve(struct graphite_conn *c, size_t len)
+{
+	if(c->pickle_len > 0 && c->pickle_len + len + 2 > PICKLE_MAX_FRAME)
+		graphite_flush(c->fd);
+
+	if(c->pickle_len + len + 2 > c->pickle_size)	{
+		size_t size = c->pickle_size ? c->pickle_size : 4096;
+		while(size < c->pickle_len + len + 2)
+			size *= 2;
+		if((c->pickle = realloc(c->pickle, size)) == NULL)
+			log_exit("Out of memory for %zu byte pickle", size);
+		c->pickle_size = size;
+	}
+
+	if(c->pickle_len == 0)	{
+		c->pickle[4] = PK_PROTO;
+		c->pickle[5] = 2;
+		c->pickle[6] = PK_EMPTY_LIST;
+		c->pickle[7] = PK_MARK;
+		c->pickle_len = PICKLE_HEAD;
+	}
+	return c->pickle + c->pickle_len;
+}
+
+static inline char *_put_le32(char *p, uint32_t v)
+{
+	for(int i = 0; i < 4; i++, v >>= 8)
+		*p++ = (char)(v & 0xff);
+	return p;
+}
+
+/* Pickle @v as a BININT if it fits in one, otherwise as a LONG1 of all 8
+ * bytes, plus a 0 byte so it doesn't come out negative if @is_signed isn't set
+ */
+static char *_pickle_int(char *p, uint64_t v, bool is_signed)
+{
+	int64_t sv = (int64_t)v;
+
+	if(is_signed ? (sv >= INT32_MIN && sv <= INT32_MAX) : v <= INT32_MAX) {
+		*p++ = PK_BININT;
+		return _put_le32(p, (uint32_t)v);
+	}
+
+	*p++ = PK_LONG1;
+	*p++ = is_signed ? 8 : 9;
+	for(int i = 0; i < 8; i++, v >>= 8)
+		*p++ = (char)(v & 0xff);
+	if(!is_signed)
+		*p++ = 0;
+	return p;
+}
+
+static char *_pickle_float(char *p, double d)
+{
+	uint64_t bits;
+
+	memcpy(&bits, &d, sizeof(bits));
+	*p++ = PK_BINFLOAT;
+	for(int i = 7; i >= 0; i--)
+		*p++ = (char)((bits >> (i * 8)) & 0xff);
+	return p;
+}
+
+/* Start the (path, (timestamp, value)) tuple for @m in the frame, for the
+ * value to be pickled at the pointer returned, taking up to @vlen bytes (such
+ * as PK_INT_MAX_UNSIGNED)
+ */
+static char *_pickle_start(struct graphite_conn *c, const char *m,
+			   size_t vlen)
+{
+	size_t mlen = strlen(m);
+	char *p;
 
 	assert(_current_time > 0);
 
-	/* <metric.name.path> <value> <timestamp> */
-	snprintf(str, len, "%s %s %ld\n", name, val, _current_time);
+	/* path, timestamp, value, two TUPLE2s */
+	p = _pickle_reserve(c, 5 + mlen + PK_INT_MAX_SIGNED + vlen + 2);
+	*p++ = PK_BINUNICODE;
+	p = _put_le32(p, (uint32_t)mlen);
+	memcpy(p, m, mlen);
+	p += mlen;
+	return _pickle_int(p, (uint64_t)_current_time, true);
+}
 
-	return str;
+static int _pickle_end(struct graphite_conn *c, char *p)
+{
+	*p++ = PK_TUPLE2;
+	*p++ = PK_TUPLE2;
+	c->pickle_len = p - c->pickle;
+	return 0;
 }
 
-static int _send_metric(int fd, const char *m, const char *v)
+/**
+ * Finish off the pickle frame and send it, or for the plaintext protocols send
+ * anything still in the buffer
+ */
+void graphite_flush(int fd)
 {
-	char *mstr = _make_metric(m, v);
-	int rv;
+	struct graphite_conn *c = _conn(fd);
+	size_t len;
+
+	if(c == NULL || c->pickle_len == 0)	{
+		buf_flush(fd);
+		return;
+	}
 
-	rv = util_metric_send(fd, mstr, (_contype == GRAPHITE_TCP));
-	free(mstr);
+	c->pickle[c->pickle_len++] = PK_APPENDS;
+	c->pickle[c->pickle_len++] = PK_STOP;
+	len = c->pickle_len - 4;
+	c->pickle[0] = (char)(len >> 24);
+	c->pickle[1] = (char)(len >> 16);
+	c->pickle[2] = (char)(len >> 8);
+	c->pickle[3] = (char)len;
 
-	return rv;
+	buf_send_frame(fd, c->pickle, c->pickle_len);
+	c->pickle_len = 0;
 }
 
 #define VAL_BUF 32 /* 64-bit values go up to 10^19, so this should be enough */
 
 int graphite_send_uint(int fd, const char *metric, uint64_t value)
 {
+	struct graphite_conn *c;
 	char s[VAL_BUF];
 	if(value & 0xff00000000000000)	{
 		syslog(LOG_ERR, "Really large int for graphite: %s = %lx (%lu)",
 		       metric, value, value);
 	}
-	snprintf(s, sizeof(s), "%lu", value);
-	return _send_metric(fd, metric, s);
+	if((c = _pickler(fd)) != NULL)
+		return _pickle_end(c, _pickle_int(_pickle_start(c, metric,
+							PK_INT_MAX_UNSIGNED),
+						  value, false));
+	s[0] = ' ';
+	return _send_metric(fd, metric, s, 1 + utoa(s + 1, value));
+}
+
+static int _send_typed(int fd, const char *metric, uint64_t value,
+		       enum metric_type type)
+{
+	(void)type;
+	return graphite_send_uint(fd, metric, value);
 }
 
+const struct metric_backend graphite_backend = {
+	.send = _send_typed,
+	.flush = graphite_flush,
+	.counter_deltas = false,
+};
+
 int graphite_send_int(int fd, const char *metric, int64_t value)
 {
+	struct graphite_conn *c;
 	char s[VAL_BUF];
-	snprintf(s, sizeof(s), "%ld", value);
-	return _send_metric(fd, metric, s);
+	if((c = _pickler(fd)) != NULL)
+		return _pickle_end(c, _pickle_int(_pickle_start(c, metric,
+							PK_INT_MAX_SIGNED),
+						  (uint64_t)value, true));
+	s[0] = ' ';
+	return _send_metric(fd, metric, s, 1 + itoa(s + 1, value));
 }
 
 int graphite_send_float(int fd, const char *metric, float value)
 {
+	struct graphite_conn *c;
 	char s[VAL_BUF];
-	snprintf(s, sizeof(s), "%f", value);
-	return _send_metric(fd, metric, s);
+	int len;
+
+	if((c = _pickler(fd)) != NULL)
+		return _pickle_end(c, _pickle_float(_pickle_start(c, metric, 9),
+						    value));
+	len = snprintf(s, sizeof(s), " %f", value);
+	return _send_metric(fd, metric, s, len);
 }
@@ -7,26 +7,56 @@
 
 enum graphite_contype {
 	GRAPHITE_TCP,
-	GRAPHITE_UDP
+	GRAPHITE_UDP,
+	GRAPHITE_PICKLE		/* over TCP, one pickled batch per flush */
 };
 
+/* Carbon's pickle receiver drops bigger frames than this, so longer batches
+ * are split over several */
+#define PICKLE_MAX_FRAME (1 << 20)
+
+/* Default most bytes of metric lines to pack in a UDP datagram, leaving room
+ * for IP/UDP headers in a 1500-byte MTU */
+#define GRAPHITE_DGRAM_SIZE 1400
+
 /**
- * Initilize graphite library and choose the connection type (see header)
- *
- * @param[in] ctype  GRAPHITE_(TCP|UDP) for TCP/UDP connection
+ * Initilize graphite library, call before connecting or sending. Anything
+ * sent on a descriptor that isn't a graphite connection (like -1 in debug
+ * mode) is in the line protocol.
+ */
+void graphite_init(void);
+
+/**
+ * Update the timestamp sent with each metric to the current time, call at the
+ * start of each sampling cycle when running continuously
  */
-void graphite_init(enum graphite_contype ctype);
+void graphite_update_time(void);
 
 /**
- * Connect to a graphite server and get a socket file-descripter back. Will
- * be either TCP/UDP based on how library was initalized.
+ * Set the most bytes to hold for a TCP connection that isn't keeping up before
+ * dropping the oldest (default SENDQ_DEFAULT_MAX), call before connecting
+ */
+void graphite_set_queue_max(size_t bytes);
+
+/**
+ * Connect to a graphite server and get a socket file-descripter back. There
+ * can be up to MAX_SINKS connections at once, each of its own type. TCP sends
+ * never block, anything carbon isn't taking is queued and the connection is
+ * remade if it's lost (or couldn't be made at all), so @server and @port must
+ * stay around until it's closed. UDP metrics are packed into datagrams of up
+ * to GRAPHITE_DGRAM_SIZE, which can be changed with buf_set_datagram_size()
+ * afterwards.
  *
  * @param[in] server host to connect to (passed to getaddrinfo)
  * @param[in] port port number (string) or name (passed to getaddrinfo)
+ * @param[in] ctype  GRAPHITE_(TCP|UDP) for TCP/UDP connection with the line
+ *                   protocol, or GRAPHITE_PICKLE for the pickle protocol
+ * @param[in] spool whether a TCP connection's queue overflows to the spool
  *
  * @return socket file-descriptor
  */
-int graphite_connect(const char *server, const char *port);
+int graphite_connect(const char *server, const char *port,
+		     enum graphite_contype ctype, bool spool);
 
 /**
  * Send unsigned-integer to graphite
@@ -39,6 +69,9 @@ int graphite_connect(const char *server, const char *port);
  */
 int graphite_send_uint(int fd, const char *metric, uint64_t value);
 
+/* For send_group_metrics(), everything is sent as-is with graphite_send_uint */
+extern const struct metric_backend graphite_backend;
+
 /**
  * Send signed integer to graphite
  * @see graphite_send_uint
@@ -52,7 +85,15 @@ int graphite_send_int(int fd, const char *metric, int64_t value);
 int graphite_send_float(int fd, const char *metric, float value);
 
 /**
- * Closes a graphite connection and de-initalizes the library
+ * Send everything held for the current cycle, as a single length-prefixed
+ * pickle frame for GRAPHITE_PICKLE. Call at the end of each cycle.
+ *
+ * @param[in] fd graphite file-descriptor
+ */
+void graphite_flush(int fd);
+
+/**
+ * Closes a graphite connection, sending anything still held for it
  *
  * @param[in] fd the socket-descripter returned by graphite connect
  */
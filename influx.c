@@ -0,0 +1,141 @@
+/**
+ * Functions to format records in InfluxDB's line protocol: one line for each
+ * series, naming it by measurement and tags, with all its fields at once
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "influx.h"
+#include "graphite.h"
+#include "selfstats.h"
+#include "sendq.h"
+
+/* " <timestamp in ns>\n" that ends every line, formatted once per sample */
+static char _ts_suffix[MAX_DIGITS + 12];
+static size_t _ts_len = 0;
+
+void influx_update_time(void)
+{
+	size_t len;
+
+	/* The protocol's timestamps are in ns unless the server's told
+	 * otherwise, and the seconds are all we have */
+	_ts_suffix[0] = ' ';
+	len = 1 + itoa(_ts_suffix + 1, time(NULL));
+	memcpy(_ts_suffix + len, "000000000\n", 10);
+	_ts_len = len + 10;
+}
+
+int influx_connect(const char *server, const char *port, bool tcp,
+		   size_t queue_max)
+{
+	int fd;
+
+	if(tcp)	{
+		fd = server_try_connect(server, port, SOCK_STREAM, true);
+		return sendq_open(fd, server, port, queue_max, false);
+	}
+	fd = server_connect(server, port, SOCK_DGRAM);
+	buf_set_datagram_size(fd, GRAPHITE_DGRAM_SIZE);
+	return fd;
+}
+
+void influx_close(int fd)
+{
+	bool stream = sendq_owns(fd);
+
+	buf_close(fd);
+	if(stream)	{
+		sendq_close(fd);
+		if(shutdown(fd, SHUT_RDWR) != 0 && errno != ENOTCONN)
+			perror("TCP Shutdown");
+	}
+	if(close(fd) < 0)
+		perror("Close fd");
+}
+
+/* Put @c at @p if there's room before @end, returning the new end or NULL */
+static inline char *_put(char *p, char *end, char c)
+{
+	if(p == NULL || p == end)
+		return NULL;
+	*p++ = c;
+	return p;
+}
+
+/* Append @s at @p up to @end, with a backslash before each of the characters
+ * in @special, returning the new end or NULL if it doesn't fit
+ */
+static char *_escaped(char *p, char *end, const char *s,
+		      const char *special)
+{
+	for(; *s != '\0' && p != NULL; s++)	{
+		if(strchr(special, *s) != NULL)
+			p = _put(p, end, '\\');
+		p = _put(p, end, *s);
+	}
+	return p;
+}
+
+/* Measurements escape commas and spaces, tag keys and values and field keys
+ * equals signs as well */
+#define MEASUREMENT_SPECIAL ", "
+#define KEY_SPECIAL ",= "
+
+/* Build "measurement,tag=value,... key=123i,... timestamp\n" in a line of its
+ * own, then copy it into the send buffer to be packed with the others
+ */
+static int _send_record(int fd, const char *measurement,
+			const struct metric_tag *tags, int n_tags,
+			const struct metric_field *fields, int n_fields)
+{
+	char line[INFLUX_MAX_LINE];
+	char *end = line + sizeof(line) - _ts_len;
+	char *p = line;
+
+	if(n_fields == 0)
+		return 0;
+
+	p = _escaped(p, end, measurement, MEASUREMENT_SPECIAL);
+	for(int i = 0; i < n_tags; i++)	{
+		/* Empty tag values aren't allowed, so leave those out */
+		if(tags[i].value[0] == '\0')
+			continue;
+		p = _escaped(_put(p, end, ','), end, tags[i].key, KEY_SPECIAL);
+		p = _escaped(_put(p, end, '='), end, tags[i].value,
+			     KEY_SPECIAL);
+	}
+	for(int i = 0; i < n_fields; i++)	{
+		p = _escaped(_put(p, end, i ? ',' : ' '), end, fields[i].key,
+			     KEY_SPECIAL);
+		if(p != NULL && end - p < MAX_DIGITS + 2)
+			p = NULL;
+		if(p == NULL)
+			break;
+		*p++ = '=';
+		p += utoa(p, fields[i].value);
+		*p++ = 'i';
+	}
+	if(p == NULL)	{
+		fprintf(stderr, "Dropped %s record over %d bytes\n",
+			measurement, INFLUX_MAX_LINE);
+		stats_count(STAT_SEND_ERRORS, 1);
+		return -1;
+	}
+	memcpy(p, _ts_suffix, _ts_len);
+	p += _ts_len;
+
+	memcpy(metric_line_start(fd, p - line), line, p - line);
+	return metric_line_end(fd, p - line, true);
+}
+
+const struct metric_backend influx_backend = {
+	.send_record = _send_record,
+	.flush = buf_flush,
+	.counter_deltas = false,
+};
@@ -0,0 +1,49 @@
+#ifndef _INFLUX_H
+#define _INFLUX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util.h"
+#include "metrics.h"
+
+/* Most bytes in one line, a record with every slot metric takes under 1KB */
+#define INFLUX_MAX_LINE 2048
+
+/**
+ * Update the timestamp sent with each record to the current time, call at the
+ * start of each sampling cycle
+ */
+void influx_update_time(void);
+
+/**
+ * Connect to InfluxDB (or anything else taking its line protocol, like
+ * telegraf's socket listener) and get a socket file-descriptor back. Over UDP
+ * lines are packed into datagrams of up to GRAPHITE_DGRAM_SIZE, which can be
+ * changed with buf_set_datagram_size() afterwards. TCP sends never block, as
+ * for graphite, so @server and @port must stay around until it's closed.
+ *
+ * @param[in] server host to connect to (passed to getaddrinfo)
+ * @param[in] port port number (string) or name (passed to getaddrinfo)
+ * @param[in] tcp connect over TCP instead of UDP
+ * @param[in] queue_max most bytes to hold for a TCP connection that isn't
+ *                      keeping up before dropping the oldest
+ *
+ * @return socket file-descriptor
+ */
+int influx_connect(const char *server, const char *port, bool tcp,
+		   size_t queue_max);
+
+/* For send_group_metrics(): each slot's metrics go as one line,
+ * "ns,host=H,owner=O,slot=S rss=123i,cache=45i,... TIMESTAMP", with counters
+ * as their running totals */
+extern const struct metric_backend influx_backend;
+
+/**
+ * Close a connection, sending anything still held for it
+ *
+ * @param[in] fd the socket-descriptor returned by influx_connect()
+ */
+void influx_close(int fd);
+
+#endif
@@ -1,7 +1,9 @@
 /**
- * Functions to send the metrics over the network (using a buffer for TCP) and
- * to turn the cgroup structure into actual metric strings
+ * Functions to send the metrics over the network (using a buffer for TCP and
+ * packing lines into datagrams for UDP) and to turn the cgroup structure into
+ * actual metric strings
  */
+#define _GNU_SOURCE	/* for sendmmsg() */
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,135 +17,771 @@
 #include "metrics.h"
 #include "util.h"
 #include "cgroup.h"
+#include "selfstats.h"
+#include "sendq.h"
+#include "slottab.h"
 
 
-#define BUFSIZE 4096
+#define BUFSIZE 65536
+
+/* A stream's buffer is sent whenever it gets this full */
+#define STREAM_FLUSH 4096
+
+/* Most datagrams built up before they're all sent in one go */
+#define MAX_DGRAMS 64
+
+/* Most pieces of lines gathered before they're sent, Linux's IOV_MAX */
+#define GATHER_IOVS 1024
 
 
 int debug = 0;
-char buf[BUFSIZE];
-static size_t buf_used = 0;
 
-/* Sends buffer over TCP connections */
-static void _flush_buf(int fd)
+/* Each sink's send buffer. When packing lines into datagrams, @dgram_size is
+ * the most bytes in each (0 when not), and @dgram_ends where each complete
+ * datagram in the buffer ends. When gathering, @iov holds the pieces of the
+ * lines to send in order, some in @data and some wherever the caller keeps
+ * them.
+ */
+struct out_buf {
+	int fd;
+	bool in_use;
+	size_t used;
+	size_t dgram_size;
+	size_t dgram_ends[MAX_DGRAMS];
+	int n_dgrams;
+	bool gather;
+	int n_iov;
+	struct iovec iov[GATHER_IOVS];
+	char data[BUFSIZE];
+};
+
+static struct out_buf bufs[MAX_SINKS];
+static struct out_buf *last_buf = NULL;
+
+/* The buffer for @fd, taking a free one the first time it's used. Lines for
+ * one sink tend to come in runs, so the last one found is tried first.
+ */
+static struct out_buf *_buf(int fd)
+{
+	struct out_buf *free_buf = NULL;
+
+	if(last_buf != NULL && last_buf->fd == fd)
+		return last_buf;
+	for(int i = 0; i < MAX_SINKS; i++)	{
+		if(bufs[i].in_use && bufs[i].fd == fd)
+			return last_buf = &bufs[i];
+		if(!bufs[i].in_use && free_buf == NULL)
+			free_buf = &bufs[i];
+	}
+	if(free_buf == NULL)
+		log_exit("More than %d sinks", MAX_SINKS);
+	free_buf->fd = fd;
+	free_buf->in_use = true;
+	free_buf->used = 0;
+	free_buf->dgram_size = 0;
+	free_buf->n_dgrams = 0;
+	free_buf->gather = false;
+	free_buf->n_iov = 0;
+	return last_buf = free_buf;
+}
+
+void buf_set_datagram_size(int fd, size_t size)
+{
+	assert(size < BUFSIZE && !_buf(fd)->gather);
+	_buf(fd)->dgram_size = size;
+}
+
+void buf_set_gather(int fd, bool gather)
+{
+	struct out_buf *b = _buf(fd);
+
+	assert(b->used == 0 && b->dgram_size == 0);
+	assert(!gather || sendq_owns(fd));
+	b->gather = gather;
+}
+
+/* Add @len bytes at @p to the pieces to send, as part of the last one if it
+ * carries straight on from it
+ */
+static void _gather(struct out_buf *b, const char *p, size_t len)
+{
+	struct iovec *last = b->n_iov ? &b->iov[b->n_iov - 1] : NULL;
+
+	if(last != NULL && (char *)last->iov_base + last->iov_len == p)	{
+		last->iov_len += len;
+		return;
+	}
+	assert(b->n_iov < GATHER_IOVS);
+	b->iov[b->n_iov].iov_base = (char *)p;
+	b->iov[b->n_iov++].iov_len = len;
+}
+
+/* Mark the end of the datagram being built, if it has anything in it */
+static void _end_dgram(struct out_buf *b)
+{
+	size_t start = b->n_dgrams ? b->dgram_ends[b->n_dgrams - 1] : 0;
+
+	if(b->used > start)
+		b->dgram_ends[b->n_dgrams++] = b->used;
+}
+
+/* Sends the buffered datagrams with as few sendmmsg() calls as it takes, the
+ * kernel may not take them all at once. Any that fail to send are dropped
+ * like a lost UDP packet would be.
+ */
+static void _flush_dgrams(struct out_buf *b)
+{
+	struct mmsghdr msgs[MAX_DGRAMS];
+	struct iovec iov[MAX_DGRAMS];
+	size_t start = 0;
+	int sent = 0;
+	int rv;
+
+	_end_dgram(b);
+	memset(msgs, 0, sizeof(msgs));
+	for(int i = 0; i < b->n_dgrams; i++)	{
+		iov[i].iov_base = b->data + start;
+		iov[i].iov_len = b->dgram_ends[i] - start;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		start = b->dgram_ends[i];
+	}
+
+	while(sent < b->n_dgrams)	{
+		rv = sendmmsg(b->fd, msgs + sent, b->n_dgrams - sent, 0);
+		if(rv < 0 && errno == EINTR)
+			continue;
+		if(rv < 0 && errno == ENOSYS)	{
+			/* Old kernel, one at a time then */
+			if(send(b->fd, iov[sent].iov_base, iov[sent].iov_len,
+				0) < 0)
+				rv = -1;
+			else
+				rv = 1;
+		}
+		if(rv < 0)	{
+			fprintf(stderr, "send() error, dropped %d datagrams: "
+					"%s\n", b->n_dgrams - sent,
+					strerror(errno));
+			stats_count(STAT_SEND_ERRORS, 1);
+			break;
+		}
+		for(int i = sent; i < sent + rv; i++)
+			stats_count(STAT_BYTES_SENT, iov[i].iov_len);
+		stats_count(STAT_DGRAMS_SENT, rv);
+		sent += rv;
+	}
+	for(int i = sent; i < b->n_dgrams; i++)
+		stats_count(STAT_DROPPED_BYTES, iov[i].iov_len);
+	b->n_dgrams = 0;
+	b->used = 0;
+}
+
+/* Send all @len bytes at @data over a stream */
+static void _send_all(int fd, const char *data, size_t len)
 {
 	size_t sent = 0;
 	ssize_t this_send;
 
-	while(sent < buf_used)	{
-		this_send = send(fd, buf + sent, buf_used - sent, 0);
+	while(sent < len)	{
+		this_send = send(fd, data + sent, len - sent, 0);
 		if(this_send < 0 && errno != EINTR)	{
 			fprintf(stderr, "send() error: %s", strerror(errno));
 			exit(EXIT_FAILURE);
 		}
-		sent += this_send;
+		if(this_send > 0)
+			sent += this_send;
+	}
+	stats_count(STAT_BYTES_SENT, len);
+}
+
+/* Queue stream data to be sent without blocking if a send queue is looking
+ * after @fd, otherwise send it now
+ */
+static void _send_stream(int fd, const char *data, size_t len)
+{
+	if(sendq_owns(fd))
+		sendq_push(fd, data, len);
+	else
+		_send_all(fd, data, len);
+}
+
+/* Sends buffer over TCP connections, or as datagrams when packing them */
+static void _flush_buf(struct out_buf *b)
+{
+	if(b->dgram_size > 0)	{
+		_flush_dgrams(b);
+		return;
+	}
+	if(b->gather)	{
+		sendq_pushv(b->fd, b->iov, b->n_iov);
+		b->n_iov = 0;
+		b->used = 0;
+		return;
+	}
+
+	_send_stream(b->fd, b->data, b->used);
+	b->used = 0;
+}
+
+/**
+ * Get space to write a metric line of up to @len bytes straight into, at the
+ * end of @fd's send buffer -- flushing the buffer first if it's too full
+ */
+char *metric_line_start(int fd, size_t len)
+{
+	struct out_buf *b = _buf(fd);
+
+	assert(len < STREAM_FLUSH - 1);
+	if(debug)
+		return b->data + b->used;
+
+	if(b->dgram_size > 0)	{
+		/* Start a new datagram if this line won't fit in the current */
+		size_t start = b->n_dgrams ? b->dgram_ends[b->n_dgrams - 1] : 0;
+		if(b->used + len - start > b->dgram_size)
+			_end_dgram(b);
+		if(b->n_dgrams == MAX_DGRAMS || b->used + len >= BUFSIZE)
+			_flush_buf(b);
+	} else if(b->gather)	{
+		if(b->n_iov == GATHER_IOVS || b->used + len >= BUFSIZE)
+			_flush_buf(b);
+	} else if(b->used + len >= STREAM_FLUSH)	{
+		_flush_buf(b);
 	}
-	buf_used = 0;
+	return b->data + b->used;
 }
 
 /**
- * Construct the actual metric-string and either send over UDP or add to
- * buffer to be send in bulk over TCP
+ * Finish the line of @len bytes written at metric_line_start()'s pointer and
+ * either send it now or keep it in the buffer to be sent in bulk over TCP or
+ * packed into datagrams over UDP
  */
-int util_metric_send(int fd, const char *metric, bool buffer)
+int metric_line_end(int fd, size_t len, bool buffer)
 {
-	ssize_t len = strlen(metric);
+	struct out_buf *b = _buf(fd);
+	char *line = b->data + b->used;
 
 	if(debug) {
-		printf("%s", metric);
+		fwrite(line, 1, len, stdout);
 		return 0;
 	}
 
 	if(buffer)	{
-		assert(len < BUFSIZE - 1);
-		if(buf_used + len >= BUFSIZE)	{
-			_flush_buf(fd);
-		}
-		strncpy(buf + buf_used, metric, len);
-		buf_used += len;
+		if(b->gather)
+			_gather(b, line, len);
+		b->used += len;
 	} else {
-		if (send(fd, metric, len, 0) != len)	{
-			fprintf(stderr, "short / failed send for %s\nerror: "
-					"%s\n", metric, strerror(errno));
+		if (send(fd, line, len, 0) != (ssize_t)len)	{
+			fprintf(stderr, "short / failed send for %.*s\nerror: "
+					"%s\n", (int)len, line, strerror(errno));
+			stats_count(STAT_SEND_ERRORS, 1);
+			stats_count(STAT_DROPPED_BYTES, len);
 			return -1;
 		}
+		stats_count(STAT_BYTES_SENT, len);
 	}
 	return 0;
 }
 
+/* Send anything left in the buffer, to be called at the end of each cycle */
+void buf_flush(int fd)
+{
+	struct out_buf *b = _buf(fd);
+
+	if(b->used > 0 || b->n_iov > 0)	{
+		_flush_buf(b);
+	}
+}
+
+/* Set while send_group_metrics() is sending, as its names are interned for
+ * the rest of the run and gathered lines can point to them
+ */
+static bool names_interned = false;
+
+/**
+ * Send the line @name, @value, @suffix. When gathering, and @name is
+ * interned, the value and suffix are copied into the buffer and the name
+ * only pointed to. Otherwise it's all copied into the buffer as usual.
+ */
+int metric_line_gather(int fd, const char *name, size_t name_len,
+		       const char *value, size_t value_len,
+		       const char *suffix, size_t suffix_len)
+{
+	struct out_buf *b = _buf(fd);
+	char *line, *p;
+
+	if(debug || !b->gather || !names_interned)	{
+		p = line = metric_line_start(fd, name_len + value_len +
+					     suffix_len);
+		memcpy(p, name, name_len);
+		memcpy(p += name_len, value, value_len);
+		memcpy(p += value_len, suffix, suffix_len);
+		return metric_line_end(fd, p + suffix_len - line, true);
+	}
+
+	if(b->n_iov + 2 > GATHER_IOVS ||
+	   b->used + value_len + suffix_len >= BUFSIZE)
+		_flush_buf(b);
+	p = b->data + b->used;
+	memcpy(p, value, value_len);
+	memcpy(p + value_len, suffix, suffix_len);
+	b->used += value_len + suffix_len;
+	_gather(b, name, name_len);
+	_gather(b, p, value_len + suffix_len);
+	return 0;
+}
+
+/**
+ * Send @len bytes already framed by the caller over a stream, after anything
+ * still in the buffer so the order is kept
+ */
+void buf_send_frame(int fd, const char *data, size_t len)
+{
+	if(debug)
+		return;
+	buf_flush(fd);
+	_send_stream(fd, data, len);
+}
+
 void buf_close(int fd)
 {
-	if(buf_used > 0)	{
-		_flush_buf(fd);
+	struct out_buf *b = _buf(fd);
+
+	buf_flush(fd);
+	b->in_use = false;
+	if(last_buf == b)
+		last_buf = NULL;
+}
+
+/* Longest metric name we'll build */
+#define MAX_NAME 512
+
+/* Append @len bytes of @src at @p, returning the new end */
+static inline char *append(char *p, const char *src, size_t len)
+{
+	memcpy(p, src, len);
+	return p + len;
+}
+
+/* Put @suffix (with its nul) after the base name of length @b_len in @name */
+static inline const char *with_suffix(char *name, size_t b_len,
+				      const char *suffix)
+{
+	memcpy(name + b_len, suffix, strlen(suffix) + 1);
+	return name;
+}
+
+/* Send a counter's running @total, or its @delta since the last sample if
+ * that's what the backend wants and there is one
+ */
+static void send_counter(const struct metric_backend *b, int fd,
+			 const char *name, uint64_t total, uint64_t delta,
+			 bool has_delta)
+{
+	if(!b->counter_deltas)
+		b->send(fd, name, total, METRIC_COUNTER);
+	else if(has_delta)
+		b->send(fd, name, delta, METRIC_COUNTER);
+}
+
+/* "ns.host." that every metric name starts with, from metrics_init() */
+static char prefix[MAX_NAME];
+static size_t prefix_len = 0;
+
+/* Room left after the prefix for the rest of a name, and its longest suffix */
+#define MAX_SUFFIX 64
+
+/* What each kind of record is a measurement of, for tagged backends */
+enum record_kind {
+	REC_SLOT,
+	REC_TOTAL,
+	REC_OWNER,
+	REC_COLLECTOR,
+	N_RECORD_KINDS
+};
+
+/* Each kind's measurement ("ns", "ns.total" and so on) and the host tag, from
+ * metrics_init() */
+static char *measurement[N_RECORD_KINDS];
+static const char *host_tag;
+
+void metrics_init(const char *ns, const char *hostname)
+{
+	static const char *const kind_suffix[N_RECORD_KINDS] = {
+		"", ".total", ".owner", ".collector",
+	};
+	char *p = prefix;
+
+	if(strlen(ns) + strlen(hostname) + 2 + MAX_SUFFIX >= sizeof(prefix))
+		log_exit("Metric name too long for %s", hostname);
+
+	/* Sanitize the hostname on the way in (. -> _) */
+	p = append(p, ns, strlen(ns));
+	*p++ = '.';
+	for(const char *h = hostname; *h != '\0'; h++)
+		*p++ = (*h == '.') ? '_' : *h;
+	*p++ = '.';
+	*p = '\0';
+	prefix_len = p - prefix;
+
+	for(int i = 0; i < N_RECORD_KINDS; i++)	{
+		size_t len = strlen(ns) + strlen(kind_suffix[i]) + 1;
+
+		measurement[i] = xcalloc(len);
+		snprintf(measurement[i], len, "%s%s", ns, kind_suffix[i]);
 	}
+	host_tag = xstrdup(hostname);
 }
 
+/* Start a name at @name with the prefix, returning where it ends */
+static char *with_prefix(char *name)
+{
+	assert(prefix_len > 0);
+	return append(name, prefix, prefix_len);
+}
+
+enum group_metric {
+#define X(type, field, metric, kind, delta, total) GM_##metric,
+	GROUP_METRICS(X)
+#undef X
+	N_GROUP_METRICS
+};
+
 /**
- * Sanitize hostname for metric inclusion (. -> _)
- * WARNING: Returns new storage
+ * Every metric name of a slot, built the first time a slot of that name is
+ * sent and kept for the rest of the run, so sending a sample involves no
+ * string building at all. Slot names are reused by job after job, so there
+ * are only ever as many of these as slots the node has had.
  */
-static char *sanitize_host(const char *host)
+struct metric_names {
+	struct slot_key key;			/* the slot name */
+	const char *name[N_GROUP_METRICS];
+};
+
+static struct slot_table names = { .entry_size = sizeof(struct metric_names) };
+
+static const struct metric_names *intern_names(const char *slot)
 {
-	char *q = xstrdup(host);
-	char *p = q;
-	do {
-		if(*p == '.')
-			*p = '_';
-	} while(*++p);
-	return q;
+	static const char *const suffix[N_GROUP_METRICS] = {
+#define X(type, field, metric, kind, delta, total) "." #metric,
+		GROUP_METRICS(X)
+#undef X
+	};
+	struct metric_names *n;
+	size_t slot_len = strlen(slot);
+	size_t len = 0;
+	char *p;
+
+	if((n = slottab_find(&names, slot)) != NULL)
+		return n;
+
+	if(prefix_len + slot_len + MAX_SUFFIX >= MAX_NAME)
+		log_exit("Metric name too long for %s", slot);
+	for(int i = 0; i < N_GROUP_METRICS; i++)
+		len += prefix_len + slot_len + strlen(suffix[i]) + 1;
+
+	n = slottab_add(&names, slot);
+	p = xcalloc(len);
+	for(int i = 0; i < N_GROUP_METRICS; i++)	{
+		n->name[i] = p;
+		p = append(with_prefix(p), slot, slot_len);
+		p = append(p, suffix[i], strlen(suffix[i]) + 1);
+	}
+	return n;
 }
 
+/* Add a field to the @n_f fields of the record being built at @f */
+#define RECORD_FIELD(f, n_f, name, v) \
+	do { \
+		(f)[n_f].key = (name); \
+		(f)[(n_f)++].value = (v); \
+	} while(0)
 
-void send_group_metrics(struct condor_group *g, const char *hostname,
-			const char *ns, int fd,
-			int (*send_fn)(int, const char *, uint64_t))
+/* Send all of group @g's metrics as one record, the series being named by its
+ * host, owner and slot. Which metrics those are comes from GROUP_METRICS, as
+ * with one metric at a time.
+ */
+static void send_group_record(const struct condor_group *g, int fd,
+			      const struct metric_backend *b)
+{
+	const struct metric_tag tags[] = {
+		{ "host", host_tag },
+		{ "owner", (g->owner[0] != '\0') ? g->owner : "unknown" },
+		{ "slot", g->slot_name },
+	};
+	struct metric_field f[N_GROUP_METRICS];
+	int n = 0;
+
+#define FIELD_GAUGE(metric, field, delta) \
+	RECORD_FIELD(f, n, #metric, g->field)
+#define FIELD_RATE(metric, field, delta) \
+	if(g->has_cpu_util) \
+		RECORD_FIELD(f, n, #metric, g->field)
+#define FIELD_FAST(metric, field, delta) \
+	if(g->has_fast) \
+		RECORD_FIELD(f, n, #metric, g->field)
+#define FIELD_COUNTER(metric, field, delta) \
+	if(!b->counter_deltas) \
+		RECORD_FIELD(f, n, #metric, g->field); \
+	else if(g->has_cpu_util) \
+		RECORD_FIELD(f, n, #metric, g->delta)
+#define X(type, field, metric, kind, delta, total) \
+	FIELD_##kind(metric, field, delta);
+
+	GROUP_METRICS(X)
+#undef X
+#undef FIELD_GAUGE
+#undef FIELD_RATE
+#undef FIELD_FAST
+#undef FIELD_COUNTER
+	b->send_record(fd, measurement[REC_SLOT], tags, 3, f, n);
+}
+
+/* Send the metrics for one group, under the names interned for its slot the
+ * first time round. What's sent comes from GROUP_METRICS.
+ */
+void send_group_metrics(struct condor_group *g, int fd,
+			const struct metric_backend *b)
 {
+	const struct metric_names *n;
+
+	if(b->send_record != NULL)	{
+		send_group_record(g, fd, b);
+		return;
+	}
+	if(g->metric_names == NULL)
+		g->metric_names = intern_names(g->slot_name);
+	n = g->metric_names;
+
+#define SEND_GAUGE(n, field, delta) \
+	b->send(fd, n, g->field, METRIC_GAUGE)
+#define SEND_RATE(n, field, delta) \
+	if(g->has_cpu_util) \
+		b->send(fd, n, g->field, METRIC_GAUGE)
+#define SEND_FAST(n, field, delta) \
+	if(g->has_fast) \
+		b->send(fd, n, g->field, METRIC_GAUGE)
+#define SEND_COUNTER(n, field, delta) \
+	send_counter(b, fd, n, g->field, g->delta, g->has_cpu_util)
+#define X(type, field, metric, kind, delta, total) \
+	SEND_##kind(n->name[GM_##metric], field, delta);
+
+	names_interned = true;
+	GROUP_METRICS(X)
+	names_interned = false;
+#undef X
+#undef SEND_GAUGE
+#undef SEND_RATE
+#undef SEND_FAST
+#undef SEND_COUNTER
+}
+
+/* Usage summed over a set of groups, in the GROUP_METRICS marked for totals */
+struct group_total {
+	char owner[sizeof(((struct condor_group *)0)->owner)];
+	uint32_t slots;
+	struct condor_group sum;
+};
+
+static void add_to_total(struct group_total *t, const struct condor_group *g)
+{
+	t->slots++;
+#define X(type, field, metric, kind, delta, total) \
+	if(total && (KIND_##kind != KIND_RATE || g->has_cpu_util)) \
+		t->sum.field += g->field;
+
+	GROUP_METRICS(X)
+#undef X
+	t->sum.has_cpu_util |= g->has_cpu_util;
+}
+
+/* Send total @t under the base name of length @b_len in @name, all as gauges.
+ * The summed CPU time counters would go backwards as jobs finish, so they're
+ * left out of the totals and only the rates are sent.
+ */
+static void send_total(const struct metric_backend *b, int fd, char *name,
+		       size_t b_len, const struct group_total *t)
+{
+	b->send(fd, with_suffix(name, b_len, ".slots"), t->slots,
+		METRIC_GAUGE);
+#define X(type, field, metric, kind, delta, total) \
+	if(total && (KIND_##kind != KIND_RATE || t->sum.has_cpu_util)) \
+		b->send(fd, with_suffix(name, b_len, "." #metric), \
+			t->sum.field, METRIC_GAUGE);
+
+	GROUP_METRICS(X)
+#undef X
+}
+
+/* Send total @t as one record of kind @rec, tagged with the host and for an
+ * owner's total the owner
+ */
+static void send_total_record(const struct metric_backend *b, int fd,
+			      enum record_kind rec, const struct group_total *t)
+{
+	const struct metric_tag tags[] = {
+		{ "host", host_tag },
+		{ "owner", t->owner },
+	};
+	struct metric_field f[N_GROUP_METRICS + 1];
+	int n = 0;
+
+	RECORD_FIELD(f, n, "slots", t->slots);
+#define X(type, field, metric, kind, delta, total) \
+	if(total && (KIND_##kind != KIND_RATE || t->sum.has_cpu_util)) \
+		RECORD_FIELD(f, n, #metric, t->sum.field);
+
+	GROUP_METRICS(X)
+#undef X
+	b->send_record(fd, measurement[rec], tags, (rec == REC_OWNER) ? 2 : 1,
+		       f, n);
+}
+
+/* The node's total and each owner's, in the order owners were first seen this
+ * cycle. There are only ever a few owners on a node, so they're searched in
+ * order, and the array is kept between cycles so it's only ever grown.
+ */
+static struct group_total host_total;
+static struct group_total *owners = NULL;
+static size_t n_owners = 0, owners_alloc = 0;
+
+void total_add_group(const struct condor_group *g)
+{
+	const char *owner = (g->owner[0] != '\0') ? g->owner : "unknown";
+	struct group_total *t = NULL;
+
+	add_to_total(&host_total, g);
+	for(size_t i = 0; i < n_owners && t == NULL; i++)
+		if(STREQ(owners[i].owner, owner))
+			t = &owners[i];
+	if(t == NULL)	{
+		if(n_owners == owners_alloc)	{
+			owners_alloc = owners_alloc ? 2 * owners_alloc : 16;
+			owners = realloc(owners, owners_alloc *
+					 sizeof(*owners));
+			if(owners == NULL)
+				log_exit("Realloc error on owner totals");
+		}
+		t = &owners[n_owners++];
+		memset(t, 0, sizeof(*t));
+		snprintf(t->owner, sizeof(t->owner), "%s", owner);
+	}
+	add_to_total(t, g);
+}
+
+/* Send the node's total as "ns.host.total.*" and each owner's as
+ * "ns.host.owner.OWNER.*" (owners that can't be found go under "unknown"), so
+ * per-user and per-node usage needn't be summed over every slot's series when
+ * graphing
+ */
+void send_total_metrics(int fd, const struct metric_backend *b)
+{
+	char name[MAX_NAME + sizeof(host_total.owner)];
 	char *base;
-	char *metric;
 	size_t b_len;
-	char *sanitized_host = sanitize_host(hostname);
 
-	b_len = strlen(ns) +
-			strlen(sanitized_host) +
-			strlen(g->slot_name) +
-			4;
-	base = xcalloc(b_len);
-	metric = xcalloc(b_len + 32);
+	if(b->send_record != NULL)	{
+		send_total_record(b, fd, REC_TOTAL, &host_total);
+		for(size_t i = 0; i < n_owners; i++)
+			send_total_record(b, fd, REC_OWNER, &owners[i]);
+		return;
+	}
 
-	snprintf(base, b_len, "%s.%s.%s",
-		 ns, sanitized_host, g->slot_name);
-	free(sanitized_host);
+	base = with_prefix(name);
+	b_len = append(base, "total", 5) - name;
+	send_total(b, fd, name, b_len, &host_total);
 
-	snprintf(metric, b_len + 32, "%s.starttime", base);
-	(*send_fn)(fd, metric, g->start_time);
+	base = append(base, "owner.", 6);
+	for(size_t i = 0; i < n_owners; i++)	{
+		char *p = base;
 
-	snprintf(metric, b_len + 32, "%s.cpu_shares", base);
-	(*send_fn)(fd, metric, g->cpu_shares);
+		/* Dots in a user name would split the path */
+		for(const char *o = owners[i].owner; *o != '\0'; o++)
+			*p++ = (*o == '.') ? '_' : *o;
+		send_total(b, fd, name, p - name, &owners[i]);
+	}
+}
 
-	snprintf(metric, b_len + 32, "%s.tasks", base);
-	(*send_fn)(fd, metric, g->num_tasks);
+void total_reset(void)
+{
+	memset(&host_total, 0, sizeof(host_total));
+	n_owners = 0;
+}
 
-	snprintf(metric, b_len + 32, "%s.procs", base);
-	(*send_fn)(fd, metric, g->num_procs);
+/* Send the collector's own stats as records: each phase's timings as one
+ * tagged with the phase, then all the counters as another
+ */
+static void send_collector_records(int fd, const struct metric_backend *b)
+{
+	struct metric_tag tags[] = {
+		{ "host", host_tag },
+		{ "phase", NULL },
+	};
+	struct metric_field f[STAT_NUM_COUNTERS];
+	int n = 0;
 
-	snprintf(metric, b_len + 32, "%s.cpu_user", base);
-	(*send_fn)(fd, metric, g->user_cpu_usage);
+	for_each_stat_timer(t)	{
+		const struct metric_field times[] = {
+			{ "ns", t->last },
+			{ "ns_min", t->min },
+			{ "ns_max", t->max },
+		};
 
-	snprintf(metric, b_len + 32, "%s.cpu_sys", base);
-	(*send_fn)(fd, metric, g->sys_cpu_usage);
+		tags[1].value = t->name;
+		b->send_record(fd, measurement[REC_COLLECTOR], tags, 2,
+			       times, 3);
+	}
 
-	snprintf(metric, b_len + 32, "%s.rss", base);
-	(*send_fn)(fd, metric, g->rss_used);
+	for(int c = 0; c < STAT_NUM_COUNTERS; c++)	{
+		uint64_t delta;
 
-	snprintf(metric, b_len + 32, "%s.cache", base);
-	(*send_fn)(fd, metric, g->cache_used);
+		if(stats_counter_is_gauge(c) || !b->counter_deltas)
+			RECORD_FIELD(f, n, stats_counter_name(c),
+				     stats_counter(c));
+		else if(stats_counter_delta(c, &delta))
+			RECORD_FIELD(f, n, stats_counter_name(c), delta);
+	}
+	b->send_record(fd, measurement[REC_COLLECTOR], tags, 1, f, n);
+}
 
-	snprintf(metric, b_len + 32, "%s.swap", base);
-	(*send_fn)(fd, metric, g->swap_used);
+/* Send the collector's own timings and counts as "ns.host.collector.*": each
+ * phase's time last cycle and its min and max since starting (as NAME_ns,
+ * NAME_ns_min and NAME_ns_max), then the counters
+ */
+void send_collector_metrics(int fd, const struct metric_backend *b)
+{
+	char name[MAX_NAME];
+	size_t b_len;
+
+	if(b->send_record != NULL)	{
+		send_collector_records(fd, b);
+		return;
+	}
 
-	snprintf(metric, b_len + 32, "%s.softmemlimit", base);
-	(*send_fn)(fd, metric, g->mem_soft_limit);
+	/* Timer names are under 32 bytes, so this leaves room for them */
+	b_len = append(with_prefix(name), "collector.", 10) - name;
 
-	free(base);
-	free(metric);
+	for_each_stat_timer(t)	{
+		size_t t_len = strlen(t->name);
+
+		memcpy(name + b_len, t->name, t_len);
+		b->send(fd, with_suffix(name, b_len + t_len, "_ns"), t->last,
+			METRIC_GAUGE);
+		b->send(fd, with_suffix(name, b_len + t_len, "_ns_min"),
+			t->min, METRIC_GAUGE);
+		b->send(fd, with_suffix(name, b_len + t_len, "_ns_max"),
+			t->max, METRIC_GAUGE);
+	}
+
+	for(int c = 0; c < STAT_NUM_COUNTERS; c++)	{
+		uint64_t v = stats_counter(c), delta;
+		bool has_delta = stats_counter_delta(c, &delta);
+
+		with_suffix(name, b_len, stats_counter_name(c));
+		if(stats_counter_is_gauge(c))
+			b->send(fd, name, v, METRIC_GAUGE);
+		else
+			send_counter(b, fd, name, v, delta, has_delta);
+	}
 }
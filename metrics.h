@@ -4,14 +4,85 @@
 #include "cgroup.h"
 #include <stdbool.h>
 
-int util_metric_send(int fd, const char *metric, bool buffer);
+/* Lines are written straight into @fd's send buffer, between these two calls.
+ * A buffer is set up for each descriptor the first time it's used. */
+char *metric_line_start(int fd, size_t len);
+int metric_line_end(int fd, size_t len, bool buffer);
+/* Pack lines buffered for @fd into datagrams of at most @size bytes, 0 to go
+ * back to sending the buffer as a stream */
+void buf_set_datagram_size(int fd, size_t size);
+/* Send the lines for @fd, which has to be a send queue's, with one sendmsg()
+ * over the buffer and the interned metric names they point to, rather than
+ * copying the names into the buffer first */
+void buf_set_gather(int fd, bool gather);
+/* Send the line made of @name, @value and @suffix, pointing to @name rather
+ * than copying it when gathering and it's one of a slot's interned names */
+int metric_line_gather(int fd, const char *name, size_t name_len,
+		       const char *value, size_t value_len,
+		       const char *suffix, size_t suffix_len);
+void buf_flush(int fd);
+/* Send a whole frame the caller built itself, in order with the buffer */
+void buf_send_frame(int fd, const char *data, size_t len);
+/* Send what's left in @fd's buffer and give the buffer up */
 void buf_close(int fd);
 
-/* Send metrics to a backend... a pointer to the the backend-specific sending-
- * function is passed in as @send_fn taking file-descriptor, metric, and value
+enum metric_type {
+	METRIC_GAUGE,		/* a level, sent as-is each time */
+	METRIC_COUNTER,		/* only ever goes up, like CPU time used */
+};
+
+/* A tag naming the series a record belongs to, like host=node1 */
+struct metric_tag {
+	const char *key;
+	const char *value;
+};
+
+/* One of a record's metrics: the last part of its graphite name, and value */
+struct metric_field {
+	const char *key;
+	uint64_t value;
+};
+
+/* A backend to send metrics to: @send takes the file-descriptor, metric name,
+ * value and type, and @flush sends whatever it's holding at the end of each
+ * cycle. If @counter_deltas is set, counters are sent as how much they went up
+ * since the slot's last sample (and not at all on its first), otherwise as
+ * their running total.
+ *
+ * Tagged backends set @send_record instead of @send, and get all of a slot's
+ * metrics (or a total's, or a phase's timings) as one record: a measurement,
+ * the tags naming the series and the fields, with the host, slot and owner as
+ * tags rather than parts of each metric's name.
  */
-void send_group_metrics(struct condor_group *g, const char *hostname,
-			const char *ns, int fd,
-			int (*send_fn)(int, const char *, uint64_t));
+struct metric_backend {
+	int (*send)(int, const char *, uint64_t, enum metric_type);
+	int (*send_record)(int fd, const char *measurement,
+			   const struct metric_tag *tags, int n_tags,
+			   const struct metric_field *fields, int n_fields);
+	void (*flush)(int);
+	bool counter_deltas;
+};
+
+/* Start every metric name with "@ns.@hostname." (with dots in the hostname
+ * made underscores), and records' measurements with "@ns" and their host tag
+ * @hostname, call once before sending any metrics */
+void metrics_init(const char *ns, const char *hostname);
+
+/* Send metrics for group @g to backend @b on @fd */
+void send_group_metrics(struct condor_group *g, int fd,
+			const struct metric_backend *b);
+
+/* Add group @g to the node's totals and its owner's */
+void total_add_group(const struct condor_group *g);
+
+/* Send the totals of the groups added since the last total_reset() (the
+ * node's, and each owner's) to backend @b on @fd */
+void send_total_metrics(int fd, const struct metric_backend *b);
+
+/* Start the totals again from zero, once they've gone to every backend */
+void total_reset(void);
+
+/* Send the collector's own stats (see selfstats.h) to backend @b on @fd */
+void send_collector_metrics(int fd, const struct metric_backend *b);
 
 #endif
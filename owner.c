@@ -0,0 +1,96 @@
+/**
+ * Who a slot's job belongs to, going by the uid its processes run as. Condor
+ * runs each job as its submitter (or a slot user mapped to them), so this is
+ * the owner to sum usage up by.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <pthread.h>
+
+#include "owner.h"
+#include "util.h"
+
+/* Longest user name kept, like utmp's */
+#define OWNER_MAX 32
+
+struct uid_name {
+	uid_t uid;
+	char name[OWNER_MAX];
+};
+
+/* Few users run jobs on a node at a time, so a short list searched in order
+ * is all the cache needs
+ */
+static struct uid_name *names = NULL;
+static size_t n_names = 0, names_alloc = 0;
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Real uid of @pid into @uid, false if it's gone */
+static bool pid_uid(pid_t pid, uid_t *uid)
+{
+	char path[32], buf[1024];
+	char *p;
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return false;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(n <= 0)
+		return false;
+	buf[n] = '\0';
+
+	/* "Uid:\treal\teffective\tsaved\tfs", well within the first 1KB */
+	if((p = strstr(buf, "\nUid:")) == NULL)
+		return false;
+	*uid = strtoul(p + 5, NULL, 10);
+	return true;
+}
+
+/* Name of @uid, looked up the first time and remembered */
+static void uid_name(uid_t uid, char *name, size_t len)
+{
+	struct uid_name *u = NULL;
+
+	pthread_mutex_lock(&names_lock);
+	for(size_t i = 0; i < n_names && u == NULL; i++)
+		if(names[i].uid == uid)
+			u = &names[i];
+
+	if(u == NULL)	{
+		struct passwd pw, *res = NULL;
+		char pwbuf[1024];
+
+		if(n_names == names_alloc)	{
+			names_alloc = names_alloc ? 2 * names_alloc : 16;
+			names = realloc(names, names_alloc * sizeof(*names));
+			if(names == NULL)
+				log_exit("Realloc error on user names");
+		}
+		u = &names[n_names++];
+		u->uid = uid;
+		if(getpwuid_r(uid, &pw, pwbuf, sizeof(pwbuf), &res) == 0 &&
+		   res != NULL)
+			snprintf(u->name, sizeof(u->name), "%s", pw.pw_name);
+		else
+			snprintf(u->name, sizeof(u->name), "%u", (unsigned)uid);
+	}
+	snprintf(name, len, "%s", u->name);
+	pthread_mutex_unlock(&names_lock);
+}
+
+bool pid_owner(pid_t pid, char *name, size_t len)
+{
+	uid_t uid;
+
+	if(!pid_uid(pid, &uid))
+		return false;
+	uid_name(uid, name, len);
+	return true;
+}
@@ -0,0 +1,20 @@
+#ifndef _OWNER_H
+#define _OWNER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Find the name of the user process @pid runs as, from the real uid in
+ * /proc/@pid/status. Names are looked up once per uid and cached, and a uid
+ * with no passwd entry is given as its number. Safe to call from any thread.
+ *
+ * @param[in] pid process to look at
+ * @param[out] name where the user name goes
+ * @param[in] len size of @name, longer names are cut short
+ * @return false if the process has gone
+ */
+bool pid_owner(pid_t pid, char *name, size_t len);
+
+#endif
@@ -0,0 +1,491 @@
+/**
+ * A small HTTP server for Prometheus to scrape the slots' metrics from, run
+ * in a thread of its own so a slow scraper or carbon never holds up the other.
+ * Scrapes are answered from a rendered snapshot of the slot table that's
+ * shared by every scrape until the table is read again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "cgroup.h"
+#include "prometheus.h"
+#include "util.h"
+
+/* Longest request (line and headers) taken */
+#define PROM_REQUEST_MAX 4096
+
+/* The metrics as of one reading of the cgroups, freed once the last scrape
+ * sending it is done
+ */
+struct snapshot {
+	unsigned int refs;
+	uint64_t read_time;	/* the cgroup_read_time() it's from */
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+struct client {
+	int fd;
+	char req[PROM_REQUEST_MAX];
+	size_t req_len;
+	bool responding;
+	char head[256];		/* status line and headers, or a whole error */
+	size_t head_len;
+	struct snapshot *body;
+	size_t sent;		/* of head then body */
+	uint64_t deadline;
+};
+
+static struct {
+	int listen_fd;
+	int stop_pipe[2];
+	pthread_t tid;
+	bool running;
+	const char *cgroup_name;
+	char prefix[128];	/* "ns_" with dots made underscores */
+	char labels[128];	/* ",host=\"...\"" */
+	uint64_t max_age;
+	bool peek;		/* the sampling loop's reads are the ones sent */
+	struct snapshot *current;
+	struct client clients[PROM_MAX_CLIENTS];
+	int n_clients;
+} srv = { .listen_fd = -1 };
+
+/* Grow @s to take @len more bytes, returning where they go */
+static char *_reserve(struct snapshot *s, size_t len)
+{
+	if(s->len + len > s->size)	{
+		size_t size = s->size ? s->size : 65536;
+
+		while(size < s->len + len)
+			size *= 2;
+		if((s->data = realloc(s->data, size)) == NULL)
+			log_exit("Out of memory for %zu byte snapshot", size);
+		s->size = size;
+	}
+	return s->data + s->len;
+}
+
+static void _append(struct snapshot *s, const char *str, size_t len)
+{
+	memcpy(_reserve(s, len), str, len);
+	s->len += len;
+}
+
+/* Append @v as a label value, escaped as the text format wants */
+static void _append_label(struct snapshot *s, const char *v)
+{
+	for(; *v != '\0'; v++)	{
+		if(*v == '\\' || *v == '"')
+			_append(s, "\\", 1);
+		if(*v == '\n')
+			_append(s, "\\n", 2);
+		else
+			_append(s, v, 1);
+	}
+}
+
+/* One sample line of family @name for group @g */
+static void _append_sample(struct snapshot *s, const char *name,
+			   const struct condor_group *g, uint64_t v)
+{
+	char *p;
+
+	_append(s, name, strlen(name));
+	_append(s, "{slot=\"", 7);
+	_append_label(s, g->slot_name);
+	_append(s, "\",owner=\"", 9);
+	_append_label(s, g->owner[0] != '\0' ? g->owner : "unknown");
+	_append(s, "\"", 1);
+	_append(s, srv.labels, strlen(srv.labels));
+	_append(s, "} ", 2);
+	p = _reserve(s, MAX_DIGITS + 1);
+	p += utoa(p, v);
+	*p++ = '\n';
+	s->len = p - s->data;
+}
+
+static void _unref(struct snapshot *s)
+{
+	if(s != NULL && --s->refs == 0)	{
+		free(s->data);
+		free(s);
+	}
+}
+
+/* Render the groups as they are now, a family at a time as the format needs,
+ * from GROUP_METRICS, counters being named NAME_total as OpenMetrics wants.
+ * Rates and the FAST metrics are left out for slots without them. Called
+ * with the groups locked.
+ */
+static struct snapshot *_render(void)
+{
+	struct snapshot *s = xcalloc(sizeof(*s));
+	char name[sizeof(srv.prefix) + 32];
+	size_t p_len = strlen(srv.prefix);
+
+	s->refs = 1;
+	s->read_time = cgroup_read_time();
+	memcpy(name, srv.prefix, p_len);
+
+#define TYPE_GAUGE "gauge"
+#define TYPE_RATE "gauge"
+#define TYPE_FAST "gauge"
+#define TYPE_COUNTER "counter"
+#define SUFFIX_GAUGE ""
+#define SUFFIX_RATE ""
+#define SUFFIX_FAST ""
+#define SUFFIX_COUNTER "_total"
+#define X(type, field, metric, kind, delta, total) \
+	strcpy(name + p_len, #metric SUFFIX_##kind); \
+	_append(s, "# TYPE ", 7); \
+	_append(s, name, strlen(name)); \
+	_append(s, " " TYPE_##kind "\n", sizeof(" " TYPE_##kind "\n") - 1); \
+	for_each_group(g) \
+		if((KIND_##kind != KIND_RATE || g->has_cpu_util) && \
+		   (KIND_##kind != KIND_FAST || g->has_fast)) \
+			_append_sample(s, name, g, g->field);
+
+	GROUP_METRICS(X)
+#undef X
+#undef TYPE_GAUGE
+#undef TYPE_RATE
+#undef TYPE_FAST
+#undef TYPE_COUNTER
+#undef SUFFIX_GAUGE
+#undef SUFFIX_RATE
+#undef SUFFIX_FAST
+#undef SUFFIX_COUNTER
+	return s;
+}
+
+/* The snapshot to answer a scrape with, reading the cgroups first if nobody
+ * has for the max age and rendering them if that's not been done since
+ */
+static struct snapshot *_snapshot(void)
+{
+	cgroup_lock();
+	if(monotonic_ns() - cgroup_read_time() > srv.max_age)	{
+		if(srv.peek)
+			peek_condor_cgroup_info(srv.cgroup_name);
+		else
+			read_condor_cgroup_info(srv.cgroup_name);
+	}
+	if(srv.current == NULL ||
+	   srv.current->read_time != cgroup_read_time())	{
+		_unref(srv.current);
+		srv.current = _render();
+	}
+	cgroup_unlock();
+
+	srv.current->refs++;
+	return srv.current;
+}
+
+/* Set @c up to send a bodiless @status, or the metrics if @body is set */
+static void _respond(struct client *c, const char *status,
+		     struct snapshot *body)
+{
+	if(body != NULL)
+		c->head_len = snprintf(c->head, sizeof(c->head),
+			"HTTP/1.1 %s\r\n"
+			"Content-Type: text/plain; version=0.0.4; "
+			"charset=utf-8\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n", status, body->len);
+	else
+		c->head_len = snprintf(c->head, sizeof(c->head),
+			"HTTP/1.1 %s\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n\r\n%s\n", status,
+			strlen(status) + 1, status);
+	c->body = body;
+	c->sent = 0;
+	c->responding = true;
+}
+
+/* Answer the request in @c once it's all come */
+static void _handle_request(struct client *c)
+{
+	char *path, *end;
+
+	c->req[c->req_len] = '\0';
+	if(strncmp(c->req, "GET ", 4) != 0)	{
+		_respond(c, "405 Method Not Allowed", NULL);
+		return;
+	}
+	path = c->req + 4;
+	if((end = strpbrk(path, " ?\r\n")) == NULL)	{
+		_respond(c, "400 Bad Request", NULL);
+		return;
+	}
+	if(end - path != 8 || strncmp(path, "/metrics", 8) != 0)	{
+		_respond(c, "404 Not Found", NULL);
+		return;
+	}
+	_respond(c, "200 OK", _snapshot());
+}
+
+static void _drop_client(int i)
+{
+	struct client *c = &srv.clients[i];
+
+	close(c->fd);
+	_unref(c->body);
+	if(i != --srv.n_clients)
+		memcpy(c, &srv.clients[srv.n_clients], sizeof(*c));
+}
+
+/* Read what's come of @c's request, answering it once it's all there.
+ * Returns false if the client's gone.
+ */
+static bool _read_request(struct client *c)
+{
+	ssize_t n;
+
+	n = recv(c->fd, c->req + c->req_len, sizeof(c->req) - 1 - c->req_len,
+		 MSG_DONTWAIT);
+	if(n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ||
+		       errno == EINTR;
+	if(n == 0)
+		return false;
+	c->req_len += n;
+	c->req[c->req_len] = '\0';
+
+	if(strstr(c->req, "\r\n\r\n") != NULL ||
+	   strstr(c->req, "\n\n") != NULL)
+		_handle_request(c);
+	else if(c->req_len == sizeof(c->req) - 1)
+		_respond(c, "431 Request Header Fields Too Large", NULL);
+	return true;
+}
+
+/* Send as much of the response as @c will take. Returns false once it's all
+ * gone or the client has.
+ */
+static bool _send_response(struct client *c)
+{
+	struct iovec iov[2];
+	struct msghdr msg = { .msg_iov = iov };
+	size_t total = c->head_len + (c->body ? c->body->len : 0);
+	ssize_t n;
+
+	if(c->sent < c->head_len)	{
+		iov[msg.msg_iovlen].iov_base = c->head + c->sent;
+		iov[msg.msg_iovlen++].iov_len = c->head_len - c->sent;
+	}
+	if(c->body != NULL)	{
+		size_t off = (c->sent > c->head_len) ?
+			     c->sent - c->head_len : 0;
+
+		iov[msg.msg_iovlen].iov_base = c->body->data + off;
+		iov[msg.msg_iovlen++].iov_len = c->body->len - off;
+	}
+
+	n = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if(n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ||
+		       errno == EINTR;
+	c->sent += n;
+	return c->sent < total;
+}
+
+static void _accept(void)
+{
+	struct client *c;
+	int fd;
+
+	while(srv.n_clients < PROM_MAX_CLIENTS &&
+	      (fd = accept(srv.listen_fd, NULL, NULL)) >= 0)	{
+		if(fcntl(fd, F_SETFL, O_NONBLOCK) != 0)	{
+			close(fd);
+			continue;
+		}
+		c = &srv.clients[srv.n_clients++];
+		memset(c, 0, sizeof(*c));
+		c->fd = fd;
+		c->deadline = monotonic_ns() +
+			      (uint64_t)PROM_CLIENT_TIMEOUT * 1000000;
+	}
+}
+
+static void *_serve(void *arg)
+{
+	struct pollfd pfds[PROM_MAX_CLIENTS + 2];
+
+	(void)arg;
+	for(;;)	{
+		uint64_t now = monotonic_ns(), first = UINT64_MAX;
+		int n = 0, ms;
+
+		pfds[n].fd = srv.stop_pipe[0];
+		pfds[n++].events = POLLIN;
+		pfds[n].fd = srv.listen_fd;
+		pfds[n++].events =
+			(srv.n_clients < PROM_MAX_CLIENTS) ? POLLIN : 0;
+		for(int i = 0; i < srv.n_clients; i++)	{
+			struct client *c = &srv.clients[i];
+
+			pfds[n].fd = c->fd;
+			pfds[n++].events = c->responding ? POLLOUT : POLLIN;
+			if(c->deadline < first)
+				first = c->deadline;
+		}
+		if(first == UINT64_MAX)
+			ms = -1;
+		else
+			ms = (first > now) ?
+			     (first - now + 999999) / 1000000 : 0;
+
+		if(poll(pfds, n, ms) < 0 && errno != EINTR)
+			log_exit("poll() failed: %s", strerror(errno));
+		if(pfds[0].revents != 0)
+			break;
+
+		/* Backwards, as dropping a client moves the last into its
+		 * place */
+		now = monotonic_ns();
+		for(int i = srv.n_clients - 1; i >= 0; i--)	{
+			struct client *c = &srv.clients[i];
+			short ev = pfds[i + 2].revents;
+			bool keep = true;
+
+			if(!c->responding && ev != 0)
+				keep = _read_request(c);
+			if(keep && c->responding)
+				keep = _send_response(c);
+			if(!keep || now >= c->deadline)
+				_drop_client(i);
+		}
+		if(pfds[1].revents & POLLIN)
+			_accept();
+	}
+
+	while(srv.n_clients > 0)
+		_drop_client(srv.n_clients - 1);
+	return NULL;
+}
+
+/* Listening socket on @rp, or -1 */
+static int _try_listen(const struct addrinfo *rp)
+{
+	int fd, one = 1;
+
+	fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+	if(fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if(bind(fd, rp->ai_addr, rp->ai_addrlen) == 0 &&
+	   listen(fd, PROM_MAX_CLIENTS) == 0 &&
+	   fcntl(fd, F_SETFL, O_NONBLOCK) == 0)
+		return fd;
+	close(fd);
+	return -1;
+}
+
+/* Listen on @listen_on, "[ADDR:]PORT" */
+static int _listen(const char *listen_on)
+{
+	struct addrinfo hints = {0};
+	struct addrinfo *result, *rp;
+	const char *colon = strrchr(listen_on, ':');
+	char host[128];
+	const char *port = listen_on;
+	int fd = -1;
+
+	host[0] = '\0';
+	if(colon != NULL)	{
+		/* An IPv6 address can be in brackets, as in a URL */
+		size_t len = colon - listen_on;
+
+		if(len >= 2 && listen_on[0] == '[' && listen_on[len - 1] == ']')
+			snprintf(host, sizeof(host), "%.*s", (int)len - 2,
+				 listen_on + 1);
+		else
+			snprintf(host, sizeof(host), "%.*s", (int)len,
+				 listen_on);
+		port = colon + 1;
+	}
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if(getaddrinfo(host[0] ? host : NULL, port, &hints, &result) != 0)
+		log_exit("Can't look up %s to listen on", listen_on);
+
+	/* With no address, the IPv6 wildcard takes IPv4 as well so try that
+	 * first, falling back on IPv4 alone where there's no IPv6
+	 */
+	for(int pass = 0; pass < 2 && fd < 0; pass++)	{
+		for(rp = result; rp != NULL && fd < 0; rp = rp->ai_next)
+			if((rp->ai_family == AF_INET6) == (pass == 0))
+				fd = _try_listen(rp);
+	}
+	freeaddrinfo(result);
+	if(fd < 0)
+		log_exit("Can't listen on %s: %s", listen_on, strerror(errno));
+	return fd;
+}
+
+void prom_start(const char *listen_on, const char *cgroup_name,
+		const char *ns, const char *hostname, uint64_t max_age_ns,
+		bool sampling)
+{
+	sigset_t all, old;
+	char *p;
+	int err;
+
+	if(strlen(ns) + 2 > sizeof(srv.prefix) ||
+	   strlen(hostname) + 9 > sizeof(srv.labels))
+		log_exit("Metric name too long for %s", hostname);
+	snprintf(srv.prefix, sizeof(srv.prefix), "%s_", ns);
+	for(p = srv.prefix; *p != '\0'; p++)
+		if(*p == '.' || *p == '-')
+			*p = '_';
+	snprintf(srv.labels, sizeof(srv.labels), ",host=\"%s\"", hostname);
+	srv.cgroup_name = cgroup_name;
+	srv.max_age = max_age_ns;
+	srv.peek = sampling;
+
+	srv.listen_fd = _listen(listen_on);
+	if(pipe(srv.stop_pipe) != 0)
+		log_exit("pipe() failed: %s", strerror(errno));
+
+	/* Signals are for the sampling loop */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = pthread_create(&srv.tid, NULL, _serve, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if(err != 0)
+		log_exit("Error starting scrape thread: %s", strerror(err));
+	srv.running = true;
+}
+
+void prom_stop(void)
+{
+	if(!srv.running)
+		return;
+	if(write(srv.stop_pipe[1], "", 1) != 1)
+		log_exit("write() failed: %s", strerror(errno));
+	pthread_join(srv.tid, NULL);
+	srv.running = false;
+
+	close(srv.stop_pipe[0]);
+	close(srv.stop_pipe[1]);
+	close(srv.listen_fd);
+	srv.listen_fd = -1;
+	_unref(srv.current);
+	srv.current = NULL;
+}
@@ -0,0 +1,44 @@
+#ifndef _PROMETHEUS_H
+#define _PROMETHEUS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Default most seconds old a snapshot can be before a scrape reads the
+ * cgroups again */
+#define PROM_DEFAULT_MAX_AGE 10
+
+/* Most scrapes being served at once, more wait to be accepted */
+#define PROM_MAX_CLIENTS 32
+
+/* How long a client gets to send its request and take the response (ms) */
+#define PROM_CLIENT_TIMEOUT 10000
+
+/**
+ * Serve the slots' metrics at /metrics in the Prometheus text format from a
+ * thread of its own, until prom_stop(). Each metric is a family named
+ * "@ns_METRIC" (with dots made underscores), with a sample for each slot
+ * labelled by host, slot and job owner.
+ *
+ * Scrapes are served from a snapshot of the slot table, which is only made
+ * again once the table has been read since. The cgroups are read again for a
+ * scrape only if they haven't been for @max_age_ns, by this or the sampling
+ * loop, so however many scrapers there are it's at most once in that time.
+ * Anything else using the groups has to hold cgroup_lock() meanwhile. With
+ * @sampling the loop's reads are the ones whose CPU deltas and FAST metrics
+ * are sent on, so a scrape only peeks (peek_condor_cgroup_info()) in between.
+ *
+ * @param[in] listen [ADDR:]PORT to listen on, all addresses if no ADDR
+ * @param[in] cgroup_name condor's cgroup, for read_condor_cgroup_info()
+ * @param[in] ns metric name prefix
+ * @param[in] hostname host label
+ * @param[in] max_age_ns oldest reading of the cgroups a scrape is served
+ * @param[in] sampling whether there's a sampling loop reading the cgroups too
+ */
+void prom_start(const char *listen, const char *cgroup_name, const char *ns,
+		const char *hostname, uint64_t max_age_ns, bool sampling);
+
+/* Stop serving, dropping any scrapes in progress */
+void prom_stop(void);
+
+#endif
@@ -0,0 +1,123 @@
+/**
+ * The collector's own timings and counts, to be sent along with the slots'
+ * metrics so its cost on each node (and a slow kernel or relay) shows up
+ */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "selfstats.h"
+#include "util.h"
+
+#define MAX_TIMERS 32
+
+static struct stat_timer timers[MAX_TIMERS];
+static size_t n_timers = 0;
+static pthread_mutex_t timers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t counters[STAT_NUM_COUNTERS];
+
+/* The counters as of the end of the last two cycles, so every sink is sent
+ * the same values and the same deltas */
+static uint64_t snapshot[STAT_NUM_COUNTERS], prev[STAT_NUM_COUNTERS];
+static unsigned int n_snapshots = 0;
+
+static const struct {
+	const char *name;
+	bool gauge;
+} counter_info[STAT_NUM_COUNTERS] = {
+	[STAT_SLOTS]		= { "slots", true },
+	[STAT_FILES_READ]	= { "files_read", false },
+	[STAT_BYTES_SENT]	= { "bytes_sent", false },
+	[STAT_DGRAMS_SENT]	= { "datagrams_sent", false },
+	[STAT_SEND_ERRORS]	= { "send_errors", false },
+	[STAT_DROPPED_BYTES]	= { "dropped_bytes", false },
+};
+
+struct stat_timer *stats_timer(const char *name)
+{
+	struct stat_timer *t = NULL;
+
+	pthread_mutex_lock(&timers_lock);
+	for(size_t i = 0; i < n_timers && t == NULL; i++)
+		if(strcmp(timers[i].name, name) == 0)
+			t = &timers[i];
+	if(t == NULL)	{
+		if(n_timers == MAX_TIMERS || strlen(name) >= sizeof(t->name))
+			log_exit("Can't make a timer called %s", name);
+		t = &timers[n_timers++];
+		strcpy(t->name, name);
+	}
+	pthread_mutex_unlock(&timers_lock);
+	return t;
+}
+
+void stats_time(struct stat_timer *t, uint64_t ns)
+{
+	__sync_fetch_and_add(&t->cycle, ns);
+	t->pending = true;
+}
+
+void stats_count(enum stat_counter c, uint64_t n)
+{
+	if(counter_info[c].gauge)
+		counters[c] = n;
+	else
+		__sync_fetch_and_add(&counters[c], n);
+}
+
+const char *stats_counter_name(enum stat_counter c)
+{
+	return counter_info[c].name;
+}
+
+bool stats_counter_is_gauge(enum stat_counter c)
+{
+	return counter_info[c].gauge;
+}
+
+uint64_t stats_counter(enum stat_counter c)
+{
+	return snapshot[c];
+}
+
+bool stats_counter_delta(enum stat_counter c, uint64_t *delta)
+{
+	*delta = snapshot[c] - prev[c];
+	return n_snapshots > 1;
+}
+
+void stats_end_cycle(void)
+{
+	for(size_t i = 0; i < n_timers; i++)	{
+		struct stat_timer *t = &timers[i];
+
+		if(!t->pending)
+			continue;
+		t->last = t->cycle;
+		if(t->samples == 0 || t->last < t->min)
+			t->min = t->last;
+		if(t->last > t->max)
+			t->max = t->last;
+		t->samples++;
+		t->cycle = 0;
+		t->pending = false;
+	}
+
+	memcpy(prev, snapshot, sizeof(prev));
+	for(int c = 0; c < STAT_NUM_COUNTERS; c++)
+		snapshot[c] = __sync_fetch_and_add(&counters[c], 0);
+	if(n_snapshots < 2)
+		n_snapshots++;
+}
+
+/* Timers that have been through a cycle, in the order they were made */
+bool __stat_timer_each(const struct stat_timer **t)
+{
+	const struct stat_timer *end = timers + n_timers;
+
+	for(*t = (*t == NULL) ? timers : *t + 1; *t < end; (*t)++)
+		if((*t)->samples > 0)
+			return true;
+	return false;
+}
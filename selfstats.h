@@ -0,0 +1,62 @@
+#ifndef _SELFSTATS_H
+#define _SELFSTATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* How long one phase of collecting took each cycle, in ns */
+struct stat_timer {
+	char name[32];
+	uint64_t cycle;		/* added up so far this cycle */
+	bool pending;		/* something was added this cycle */
+	uint64_t last, min, max;
+	uint64_t samples;	/* cycles it's been timed in */
+};
+
+/* What the collector counts about itself */
+enum stat_counter {
+	STAT_SLOTS,		/* slots read last cycle, a gauge */
+	STAT_FILES_READ,
+	STAT_BYTES_SENT,
+	STAT_DGRAMS_SENT,
+	STAT_SEND_ERRORS,
+	STAT_DROPPED_BYTES,	/* lost to send errors or a full queue/spool */
+	STAT_NUM_COUNTERS
+};
+
+/**
+ * Get the timer named @name, made the first time it's asked for. There's room
+ * for a few dozen, so make them once and keep hold of them.
+ *
+ * @param[in] name metric name under the collector's namespace
+ * @return timer, which lives until exit
+ */
+struct stat_timer *stats_timer(const char *name);
+
+/* Add @ns to @t's time for this cycle, safe to call from several threads */
+void stats_time(struct stat_timer *t, uint64_t ns);
+
+/* Add @n to counter @c, or for a gauge set it to @n -- thread-safe */
+void stats_count(enum stat_counter c, uint64_t n);
+
+/* The metric name of counter @c, and whether it's a gauge */
+const char *stats_counter_name(enum stat_counter c);
+bool stats_counter_is_gauge(enum stat_counter c);
+
+/* Counter @c as of the last stats_end_cycle() */
+uint64_t stats_counter(enum stat_counter c);
+
+/* How much counter @c went up between the last two stats_end_cycle()s into
+ * @delta, false if there haven't been two yet */
+bool stats_counter_delta(enum stat_counter c, uint64_t *delta);
+
+/* Fold this cycle's times into each timer's last, min and max, and take a
+ * snapshot of the counters */
+void stats_end_cycle(void);
+
+#define for_each_stat_timer(t) \
+	for(const struct stat_timer *t = NULL; __stat_timer_each(&t);)
+
+bool __stat_timer_each(const struct stat_timer **t);
+
+#endif
@@ -0,0 +1,602 @@
+/**
+ * A bounded queue in front of each TCP sink, so a stalled or dead carbon never
+ * holds up sampling: sends never block, what the socket won't take waits in
+ * the queue (oldest dropped first when it's full), and a lost connection is
+ * remade with exponential backoff. With a spool, what would be dropped and
+ * anything sent while there's no connection goes there instead, and is sent
+ * again at a limited rate whenever the queue is idle.
+ *
+ * The server's looked up once when the queue's opened, and reconnects go to the
+ * addresses found then. Only after a connect fails is it looked up again, in
+ * the background with getaddrinfo_a(), so a slow or dead DNS server never holds
+ * up a reconnect attempt -- it just goes on with the old addresses meanwhile.
+ */
+#define _GNU_SOURCE	/* for getaddrinfo_a() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "selfstats.h"
+#include "sendq.h"
+#include "spool.h"
+#include "util.h"
+
+/* One lot of data to send whole, @off bytes of it already sent. If it's
+ * being replayed from the spool, @spool_id is its batch there.
+ */
+struct sendq_rec {
+	struct sendq_rec *next;
+	size_t len;
+	size_t off;
+	bool spooled;
+	uint64_t spool_id;
+	char data[];
+};
+
+struct sendq {
+	bool in_use;
+	int fd;
+	bool spool;	/* this is the queue that uses the spool */
+	bool whole;	/* records go again whole after a lost connection */
+	const char *server;
+	const char *port;
+	struct addrinfo *addrs;	/* the server's, from the latest lookup */
+	struct gaicb lookup;	/* a new lookup going on, if looking_up */
+	struct addrinfo hints;
+	bool looking_up;
+	bool connected;
+	bool sent;		/* something went over this connection */
+	uint64_t next_try;	/* monotonic ns of the next reconnect */
+	unsigned int backoff;	/* ms to wait after the next failure */
+	uint64_t next_replay;	/* monotonic ns the spool can next be sent from */
+	struct sendq_rec *head, *tail;
+	size_t bytes;
+	size_t max_bytes;
+	size_t dropped;		/* bytes dropped since the queue last emptied */
+};
+
+/* A queue for each stream sink, found by descriptor */
+static struct sendq queues[MAX_SINKS];
+
+/* A descriptor to handle as well while waiting, from sendq_watch() */
+static int watch_fd = -1;
+static void (*watch_ready)(void);
+
+static struct sendq *_find(int fd)
+{
+	for(int i = 0; i < MAX_SINKS; i++)
+		if(queues[i].in_use && queues[i].fd == fd)
+			return &queues[i];
+	return NULL;
+}
+
+/* Look the server up again in the background, for a reconnect after it's
+ * done to use, unless that's already going on
+ */
+static void _lookup_start(struct sendq *q)
+{
+	struct gaicb *list[] = { &q->lookup };
+	int err;
+
+	if(q->looking_up)
+		return;
+	memset(&q->hints, 0, sizeof(q->hints));
+	q->hints.ai_family = AF_UNSPEC;
+	q->hints.ai_socktype = SOCK_STREAM;
+	memset(&q->lookup, 0, sizeof(q->lookup));
+	q->lookup.ar_name = q->server;
+	q->lookup.ar_service = q->port;
+	q->lookup.ar_request = &q->hints;
+	if((err = getaddrinfo_a(GAI_NOWAIT, list, 1, NULL)) != 0)
+		fprintf(stderr, "Can't look up %s:%s: %s\n", q->server,
+			q->port, gai_strerror(err));
+	else
+		q->looking_up = true;
+}
+
+/* Take the addresses from the background lookup if it's done, keeping the old
+ * ones if it failed
+ */
+static void _lookup_finish(struct sendq *q)
+{
+	int err;
+
+	if(!q->looking_up || (err = gai_error(&q->lookup)) == EAI_INPROGRESS)
+		return;
+	q->looking_up = false;
+	if(err != 0)	{
+		fprintf(stderr, "Error looking up %s:%s: %s\n", q->server,
+			q->port, gai_strerror(err));
+		return;
+	}
+	if(q->addrs != NULL)
+		freeaddrinfo(q->addrs);
+	q->addrs = q->lookup.ar_result;
+}
+
+int sendq_open(int fd, const char *server, const char *port, size_t max_bytes,
+	       bool spool)
+{
+	struct sendq *q = NULL;
+
+	for(int i = 0; i < MAX_SINKS && q == NULL; i++)
+		if(!queues[i].in_use)
+			q = &queues[i];
+	if(q == NULL)
+		log_exit("More than %d stream sinks", MAX_SINKS);
+	memset(q, 0, sizeof(*q));
+
+	q->connected = (fd >= 0);
+	/* Somewhere to dup2() the connection onto when it's made */
+	if(fd < 0 && (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		log_exit("socket() failed: %s", strerror(errno));
+	q->in_use = true;
+	q->fd = fd;
+	q->server = server;
+	q->port = port;
+	q->backoff = SENDQ_BACKOFF_MIN;
+	q->next_try = 0;
+	q->max_bytes = max_bytes;
+	q->spool = spool;
+	/* The lookup just worked for the connection, but if it didn't it can
+	 * be left to finish in its own time */
+	if(server != NULL && q->connected)
+		q->addrs = server_lookup(server, port, SOCK_STREAM);
+	else if(server != NULL)
+		_lookup_start(q);
+	return fd;
+}
+
+void sendq_set_whole_records(int fd)
+{
+	_find(fd)->whole = true;
+}
+
+bool sendq_owns(int fd)
+{
+	return _find(fd) != NULL;
+}
+
+static bool _spooling(struct sendq *q)
+{
+	return q->spool && spool_enabled();
+}
+
+static void _drop_head(struct sendq *q)
+{
+	struct sendq_rec *r = q->head;
+
+	q->head = r->next;
+	if(q->head == NULL)
+		q->tail = NULL;
+	q->bytes -= r->len;
+	free(r);
+}
+
+/* Put @len bytes that can't be sent (yet) in the spool, or drop them */
+static void _spill(struct sendq *q, const char *data, size_t len)
+{
+	if(!_spooling(q) || !spool_write(data, len))	{
+		q->dropped += len;
+		stats_count(STAT_DROPPED_BYTES, len);
+	}
+}
+
+/* Spill a batch from the queue, unless it's still in the spool anyway */
+static void _spill_rec(struct sendq *q, struct sendq_rec *r)
+{
+	if(!r->spooled)
+		_spill(q, r->data, r->len);
+}
+
+static void _drop_all(struct sendq *q)
+{
+	while(q->head != NULL)	{
+		_spill_rec(q, q->head);
+		_drop_head(q);
+	}
+}
+
+/* Note what was dropped once the queue has caught up again */
+static void _report_drops(struct sendq *q)
+{
+	if(q->head == NULL && q->dropped > 0)	{
+		fprintf(stderr, "Send queue caught up, %zu bytes of metrics were "
+			"dropped\n", q->dropped);
+		q->dropped = 0;
+	}
+}
+
+/* Back off before the next reconnect, for longer each time in a row */
+static void _retry_later(struct sendq *q)
+{
+	q->next_try = monotonic_ns() + (uint64_t)q->backoff * 1000000;
+	q->backoff = (q->backoff * 2 > SENDQ_BACKOFF_MAX) ?
+		SENDQ_BACKOFF_MAX : q->backoff * 2;
+}
+
+/* Go back in part sent @r to where the next connection should start it from.
+ * The receiver never sees the line the connection was lost in the middle of,
+ * having no newline, so the lines before it that went in full aren't sent
+ * again, and the cut one is resent from its start. A queue of whole records
+ * (pickle frames) sends @r again from the beginning, as a frame cut short is
+ * thrown away by the receiver.
+ */
+static void _rewind(struct sendq *q, struct sendq_rec *r)
+{
+	if(q->whole)	{
+		r->off = 0;
+		return;
+	}
+	while(r->off > 0 && r->data[r->off - 1] != '\n')
+		r->off--;
+}
+
+static void _disconnect(struct sendq *q, int err)
+{
+	q->connected = false;
+	stats_count(STAT_SEND_ERRORS, 1);
+	if(q->server == NULL)	{
+		fprintf(stderr, "Lost connection: %s\n", strerror(err));
+		_drop_all(q);
+		return;
+	}
+
+	fprintf(stderr, "Lost connection to %s:%s: %s, retrying in %u ms\n",
+		q->server, q->port, strerror(err), q->backoff);
+	if(q->head != NULL)
+		_rewind(q, q->head);
+	/* Nothing got through, so the connect itself failed */
+	if(!q->sent)
+		_lookup_start(q);
+	_retry_later(q);
+}
+
+/* Try to connect again if it's time to, onto the same descriptor number */
+static bool _reconnect(struct sendq *q)
+{
+	int fd;
+
+	if(q->server == NULL || monotonic_ns() < q->next_try)
+		return false;
+
+	_lookup_finish(q);
+	fd = (q->addrs != NULL) ? addr_try_connect(q->addrs, true) : -1;
+	if(fd < 0)	{
+		fprintf(stderr, "Couldn't reconnect to %s:%s, retrying in %u "
+			"ms\n", q->server, q->port, q->backoff);
+		_lookup_start(q);
+		_retry_later(q);
+		return false;
+	}
+	if(dup2(fd, q->fd) < 0)
+		log_exit("dup2() failed: %s", strerror(errno));
+	close(fd);
+	q->connected = true;
+	q->sent = false;
+	return true;
+}
+
+static void _enqueue(struct sendq *q, struct sendq_rec *r)
+{
+	if(q->tail != NULL)
+		q->tail->next = r;
+	else
+		q->head = r;
+	q->tail = r;
+	q->bytes += r->len;
+}
+
+static bool _spool_pending(struct sendq *q)
+{
+	uint64_t id;
+
+	return _spooling(q) && spool_peek(NULL, &id) > 0;
+}
+
+/* Queue the oldest spooled batch to send if the queue's idle and it's been
+ * long enough since the last one to keep to SPOOL_REPLAY_RATE. It's only taken
+ * out of the spool once it's all been sent.
+ */
+static void _replay(struct sendq *q, uint64_t now)
+{
+	struct sendq_rec *r;
+	uint64_t id;
+	size_t len;
+
+	if(!_spooling(q) || q->head != NULL || now < q->next_replay ||
+	   (len = spool_peek(NULL, &id)) == 0)
+		return;
+
+	r = xcalloc(sizeof(*r) + len);
+	spool_peek(r->data, &r->spool_id);
+	r->len = len;
+	r->spooled = true;
+	_enqueue(q, r);
+
+	if(q->next_replay < now)
+		q->next_replay = now;
+	q->next_replay += (uint64_t)len * 1000000000 / SPOOL_REPLAY_RATE;
+}
+
+/* Send as much as the socket will take right now */
+static void _pump(struct sendq *q)
+{
+	ssize_t n;
+
+	if(!q->connected && !_reconnect(q))
+		return;
+
+	_replay(q, monotonic_ns());
+	while(q->head != NULL)	{
+		struct sendq_rec *r = q->head;
+
+		n = send(q->fd, r->data + r->off, r->len - r->off,
+			 MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(n < 0)	{
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				_disconnect(q, errno);
+			return;
+		}
+		q->backoff = SENDQ_BACKOFF_MIN;
+		q->sent = true;
+		stats_count(STAT_BYTES_SENT, n);
+		r->off += n;
+		if(r->off == r->len)	{
+			if(r->spooled)
+				spool_consume(r->spool_id);
+			_drop_head(q);
+		}
+		if(q->head == NULL)
+			_replay(q, monotonic_ns());
+	}
+	_report_drops(q);
+}
+
+/* A record of what's in @iov, @len bytes in all, with the first @sent of them
+ * already gone. It's kept whole so a reconnect can go back in it (_rewind()).
+ */
+static struct sendq_rec *_rec(const struct iovec *iov, int iovcnt,
+			      size_t len, size_t sent)
+{
+	struct sendq_rec *r = xcalloc(sizeof(*r) + len);
+	char *p = r->data;
+
+	for(int i = 0; i < iovcnt; i++)	{
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+	r->len = len;
+	r->off = sent;
+	return r;
+}
+
+/* Queue @r, taking it over, and send what the socket will take -- or if
+ * sending it straight away just failed with @err, drop the connection
+ */
+static void _push_rec(struct sendq *q, struct sendq_rec *r, int err)
+{
+	struct sendq_rec **pp, *old;
+
+	/* Nowhere to send it, so straight to the spool if there is one */
+	if(!q->connected && !_reconnect(q) && _spooling(q))	{
+		_spill(q, r->data, r->len);
+		free(r);
+		return;
+	}
+
+	/* Make room by dropping the oldest, but not one that's part sent */
+	while(q->bytes + r->len > q->max_bytes)	{
+		pp = &q->head;
+		if(*pp != NULL && (*pp)->off > 0)
+			pp = &(*pp)->next;
+		if((old = *pp) == NULL)
+			break;
+		if(q->dropped == 0 && !_spooling(q))
+			fputs("Send queue full, dropping the oldest metrics\n",
+			      stderr);
+		_spill_rec(q, old);
+		q->bytes -= old->len;
+		*pp = old->next;
+		if(q->tail == old)
+			q->tail = (pp == &q->head) ? NULL : q->head;
+		free(old);
+	}
+	if(q->bytes + r->len > q->max_bytes && r->off == 0)	{
+		_spill(q, r->data, r->len);
+		free(r);
+		return;
+	}
+
+	_enqueue(q, r);
+	if(err != 0)
+		_disconnect(q, err);
+	else
+		_pump(q);
+}
+
+void sendq_push(int fd, const char *data, size_t len)
+{
+	struct iovec iov = { .iov_base = (char *)data, .iov_len = len };
+
+	sendq_pushv(fd, &iov, 1);
+}
+
+void sendq_pushv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct sendq *q = _find(fd);
+	struct msghdr msg = {
+		.msg_iov = (struct iovec *)iov,
+		.msg_iovlen = iovcnt,
+	};
+	size_t len = 0;
+	ssize_t n = 0;
+	int err = 0;
+
+	for(int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if(len == 0)
+		return;
+
+	/* With nothing queued ahead of it, it can go straight from the caller's
+	 * memory, and only what the socket won't take now is copied to wait
+	 */
+	if(q->connected && q->head == NULL)	{
+		do
+			n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		while(n < 0 && errno == EINTR);
+		if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			err = errno;
+		if(n < 0)
+			n = 0;
+		if(n > 0)	{
+			q->backoff = SENDQ_BACKOFF_MIN;
+			q->sent = true;
+			stats_count(STAT_BYTES_SENT, n);
+		}
+		if((size_t)n == len)	{
+			_pump(q);
+			return;
+		}
+	}
+	_push_rec(q, _rec(iov, iovcnt, len, n), err);
+}
+
+/* When @q, if it's not waiting on its socket, next has something to do (a
+ * reconnect or sending from the spool), or UINT64_MAX if it's done
+ */
+static uint64_t _next_due(struct sendq *q)
+{
+	if(!q->in_use || (q->head == NULL && !_spool_pending(q)))
+		return UINT64_MAX;
+	if(!q->connected && q->server == NULL)
+		return UINT64_MAX;
+	return q->connected ? q->next_replay : q->next_try;
+}
+
+static bool _on_socket(struct sendq *q)
+{
+	return q->in_use && q->connected && q->head != NULL;
+}
+
+void sendq_watch(int fd, void (*ready)(void))
+{
+	watch_fd = fd;
+	watch_ready = ready;
+}
+
+/* Keep sending on queue @only (or all of them if it's NULL, along with the
+ * watched descriptor) until there's nothing left to send or it's
+ * CLOCK_MONOTONIC @end in ns
+ */
+static void _wait(struct sendq *only, uint64_t end)
+{
+	bool watching = (only == NULL && watch_fd >= 0);
+	uint64_t now, until;
+
+	while((now = monotonic_ns()) < end)	{
+		struct pollfd pfds[MAX_SINKS + 1];
+		struct sendq *polled[MAX_SINKS];
+		int n = 0;
+
+		/* Poll the queues waiting on their sockets all together, up to
+		 * when the first of the rest is due to reconnect or replay
+		 */
+		until = UINT64_MAX;
+		for(int i = 0; i < MAX_SINKS; i++)	{
+			struct sendq *q = &queues[i];
+			uint64_t due;
+
+			if(only != NULL && q != only)
+				continue;
+			if(_on_socket(q))	{
+				pfds[n].fd = q->fd;
+				pfds[n].events = POLLOUT;
+				polled[n++] = q;
+			} else if((due = _next_due(q)) < until)	{
+				until = due;
+			}
+		}
+		if(n == 0 && until == UINT64_MAX)
+			return;
+		if(until > end)
+			until = end;
+		if(watching)	{
+			pfds[n].fd = watch_fd;
+			pfds[n].events = POLLIN;
+		}
+
+		if(n > 0 || watching)	{
+			int ms = (until > now) ?
+				 (until - now + 999999) / 1000000 : 0;
+
+			if(poll(pfds, n + watching, ms) < 0)
+				return;
+			for(int i = 0; i < n; i++)
+				if(pfds[i].revents != 0)
+					_pump(polled[i]);
+			if(watching && pfds[n].revents != 0)
+				watch_ready();
+		} else if(now < until)	{
+			struct timespec ts;
+
+			ts.tv_sec = until / 1000000000;
+			ts.tv_nsec = until % 1000000000;
+			if(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					   &ts, NULL) != 0)
+				return;
+		}
+
+		now = monotonic_ns();
+		for(int i = 0; i < MAX_SINKS; i++)	{
+			struct sendq *q = &queues[i];
+
+			if((only == NULL || q == only) && !_on_socket(q) &&
+			   _next_due(q) <= now)
+				_pump(q);
+		}
+	}
+}
+
+void sendq_wait(const struct timespec *deadline)
+{
+	_wait(NULL, (uint64_t)deadline->tv_sec * 1000000000 +
+		    deadline->tv_nsec);
+}
+
+void sendq_close(int fd)
+{
+	struct sendq *q = _find(fd);
+
+	if(q == NULL)
+		return;
+	/* No point waiting around for a reconnect if it can all be spooled */
+	if(q->connected || !_spooling(q))
+		_wait(q, monotonic_ns() +
+			 (uint64_t)SENDQ_CLOSE_WAIT * 1000000);
+
+	_drop_all(q);
+	if(q->dropped > 0)
+		fprintf(stderr, "Dropped %zu bytes of unsent metrics\n",
+			q->dropped);
+	/* A lookup that's got as far as the resolver can't be called off, and
+	 * has to be waited for before its gaicb can go */
+	if(q->looking_up && gai_cancel(&q->lookup) == EAI_NOTCANCELED)	{
+		const struct gaicb *list[] = { &q->lookup };
+
+		while(gai_suspend(list, 1, NULL) == EAI_INTR)
+			;
+	}
+	if(q->looking_up && gai_error(&q->lookup) == 0)
+		freeaddrinfo(q->lookup.ar_result);
+	if(q->addrs != NULL)
+		freeaddrinfo(q->addrs);
+	q->in_use = false;
+}
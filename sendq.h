@@ -0,0 +1,91 @@
+#ifndef _SENDQ_H
+#define _SENDQ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/uio.h>
+
+/* Default most bytes held for a stream sink that isn't keeping up */
+#define SENDQ_DEFAULT_MAX	(4 << 20)
+
+/* Reconnect backoff starts at the first and doubles up to the second (ms) */
+#define SENDQ_BACKOFF_MIN	500
+#define SENDQ_BACKOFF_MAX	60000
+
+/* How long closing waits for the queue to drain before giving up (ms) */
+#define SENDQ_CLOSE_WAIT	5000
+
+/**
+ * Take over stream socket @fd, which is sent to without blocking from now on.
+ * Anything the socket won't take straight away is queued, up to @max_bytes
+ * after which the oldest is dropped, or put in the spool if there is one and
+ * @spool is set (only one queue should use the spool). There can be a queue
+ * for each of up to MAX_SINKS sockets. If
+ * the connection fails, it's remade to @server:@port with exponential backoff,
+ * keeping the same descriptor number, and whatever was queued is sent again
+ * (see sendq_set_whole_records() for one that was part sent).
+ *
+ * @param[in] fd connected stream socket, or -1 if the first connect failed
+ *               and it should be retried
+ * @param[in] server host to reconnect to, or NULL to never reconnect
+ * @param[in] port port to reconnect to
+ * @param[in] max_bytes most bytes to queue
+ * @param[in] spool whether to use the spool
+ *
+ * @return the descriptor that stands for the connection from now on
+ */
+int sendq_open(int fd, const char *server, const char *port, size_t max_bytes,
+	       bool spool);
+
+/**
+ * What's pushed on @fd's queue is in frames that only make sense whole (like
+ * graphite's pickle protocol), so one cut short by a lost connection is sent
+ * again in full. Otherwise it's taken to be whole lines, and is sent again
+ * from the start of the line that was cut.
+ */
+void sendq_set_whole_records(int fd);
+
+/* Is @fd the socket of a queue */
+bool sendq_owns(int fd);
+
+/**
+ * Queue @len bytes at @data to be sent as a whole on @fd's queue, after
+ * anything already queued, and send as much as the socket takes without
+ * blocking. If nothing's queued it's sent from @data, and only copied if the
+ * socket won't take it all.
+ */
+void sendq_push(int fd, const char *data, size_t len);
+
+/**
+ * sendq_push() what the @iovcnt buffers at @iov hold, one after another, as a
+ * whole. With nothing queued they go in one sendmsg() straight from where
+ * they are, so the caller's done with them once this returns.
+ */
+void sendq_pushv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Keep sending on every queue (and reconnecting, and replaying the spool)
+ * until there's nothing left to send or it's the absolute CLOCK_MONOTONIC time
+ * @deadline, calling the sendq_watch() function whenever its descriptor is
+ * readable meanwhile. Returns early on a signal.
+ */
+void sendq_wait(const struct timespec *deadline);
+
+/**
+ * Have sendq_wait() call @ready whenever @fd is readable, so something else
+ * waiting on a descriptor isn't held up by a sink that's down or behind
+ *
+ * @param[in] fd descriptor to poll for reading, or -1 for none
+ * @param[in] ready handles what's come in on @fd without blocking
+ */
+void sendq_watch(int fd, void (*ready)(void));
+
+/**
+ * Wait up to SENDQ_CLOSE_WAIT for @fd's queue to drain (unless there's no
+ * connection and it can all go in the spool), then spool or drop anything left
+ * and let go of the socket, which is left for the caller to close
+ */
+void sendq_close(int fd);
+
+#endif
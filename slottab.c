@@ -0,0 +1,193 @@
+/**
+ * Slot table: an arena of per-slot entries with a hash index on cgroup name,
+ * so a persistent collector only allocates when a node gets more slots than
+ * it's had before
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "slottab.h"
+#include "util.h"
+
+/* Entries in each arena chunk, and the first number of hash buckets */
+#define SLOTTAB_CHUNK 64
+#define SLOTTAB_BUCKETS 64
+
+/* FNV-1a */
+static uint32_t _hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	for(; *s != '\0'; s++)	{
+		h ^= (unsigned char)*s;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+void slottab_init(struct slot_table *t, size_t entry_size)
+{
+	memset(t, 0, sizeof(*t));
+	t->entry_size = entry_size;
+}
+
+void *slottab_find(struct slot_table *t, const char *name)
+{
+	uint32_t h = _hash(name);
+	struct slot_key *k;
+
+	if(t->n_buckets == 0)
+		return NULL;
+	for(k = t->buckets[h & (t->n_buckets - 1)]; k != NULL; k = k->hash_next)
+		if(k->hash == h && STREQ(k->name, name))
+			return k;
+	return NULL;
+}
+
+/* Double the buckets once there are as many entries, rehashing into them */
+static void _grow_buckets(struct slot_table *t)
+{
+	size_t n = t->n_buckets ? 2 * t->n_buckets : SLOTTAB_BUCKETS;
+	struct slot_key **b = xcalloc(n * sizeof(*b));
+
+	for(size_t i = 0; i < t->n_buckets; i++)	{
+		struct slot_key *k = t->buckets[i];
+
+		while(k != NULL)	{
+			struct slot_key *next = k->hash_next;
+
+			k->hash_next = b[k->hash & (n - 1)];
+			b[k->hash & (n - 1)] = k;
+			k = next;
+		}
+	}
+	free(t->buckets);
+	t->buckets = b;
+	t->n_buckets = n;
+}
+
+/* Space for a new entry, a retired one or the next out of the arena */
+static struct slot_key *_alloc(struct slot_table *t)
+{
+	struct slot_key *k;
+
+	if(t->free != NULL)	{
+		k = t->free;
+		t->free = k->hash_next;
+		return k;
+	}
+
+	if(t->n_chunks == 0 || t->chunk_used == SLOTTAB_CHUNK)	{
+		if(t->n_chunks == t->chunks_alloc)	{
+			t->chunks_alloc = t->chunks_alloc ?
+					  2 * t->chunks_alloc : 16;
+			t->chunks = realloc(t->chunks, t->chunks_alloc *
+					    sizeof(*t->chunks));
+			if(t->chunks == NULL)
+				log_exit("Realloc error on slot table");
+		}
+		t->chunks[t->n_chunks++] = xcalloc(SLOTTAB_CHUNK *
+						   t->entry_size);
+		t->chunk_used = 0;
+	}
+	return (struct slot_key *)(t->chunks[t->n_chunks - 1] +
+				   t->chunk_used++ * t->entry_size);
+}
+
+void *slottab_add(struct slot_table *t, const char *name)
+{
+	struct slot_key *k;
+	uint32_t h = _hash(name);
+
+	if(strlen(name) >= sizeof(k->name))
+		log_exit("cgroup name too long: %s", name);
+	if(t->n_entries >= t->n_buckets)
+		_grow_buckets(t);
+
+	k = _alloc(t);
+	memset(k, 0, t->entry_size);
+	strcpy(k->name, name);
+	k->hash = h;
+	k->live = true;
+	k->indexed = true;
+	k->hash_next = t->buckets[h & (t->n_buckets - 1)];
+	t->buckets[h & (t->n_buckets - 1)] = k;
+
+	if(t->n_entries == t->live_alloc)	{
+		t->live_alloc = t->live_alloc ? 2 * t->live_alloc : 64;
+		t->live = realloc(t->live, t->live_alloc * sizeof(*t->live));
+		if(t->live == NULL)
+			log_exit("Realloc error on slot table");
+	}
+	t->live[t->n_entries++] = k;
+	t->changed = true;
+	return k;
+}
+
+void slottab_unlink(struct slot_table *t, void *entry)
+{
+	struct slot_key *k = entry;
+	struct slot_key **kp = &t->buckets[k->hash & (t->n_buckets - 1)];
+
+	if(!k->indexed)
+		return;
+	while(*kp != k)
+		kp = &(*kp)->hash_next;
+	*kp = k->hash_next;
+	k->indexed = false;
+}
+
+void slottab_retire(struct slot_table *t, void *entry)
+{
+	struct slot_key *k = entry;
+
+	slottab_unlink(t, k);
+	k->live = false;
+	t->changed = true;
+}
+
+static int (*_cmp)(const struct slot_key *, const struct slot_key *);
+
+static int _qsort_cmp(const void *a, const void *b)
+{
+	return _cmp(*(struct slot_key * const *)a,
+		    *(struct slot_key * const *)b);
+}
+
+size_t slottab_order(struct slot_table *t,
+		     int (*cmp)(const struct slot_key *,
+				const struct slot_key *))
+{
+	size_t n = 0;
+
+	if(!t->changed)
+		return t->n_live;
+
+	/* Squeeze out the retired, which can be reused from now on */
+	for(size_t i = 0; i < t->n_entries; i++)	{
+		struct slot_key *k = t->live[i];
+
+		if(k->live)	{
+			t->live[n++] = k;
+		} else {
+			k->hash_next = t->free;
+			t->free = k;
+		}
+	}
+	t->n_entries = t->n_live = n;
+
+	_cmp = cmp;
+	qsort(t->live, n, sizeof(*t->live), _qsort_cmp);
+	t->changed = false;
+	return n;
+}
+
+void slottab_free(struct slot_table *t)
+{
+	for(size_t i = 0; i < t->n_chunks; i++)
+		free(t->chunks[i]);
+	free(t->chunks);
+	free(t->buckets);
+	free(t->live);
+	slottab_init(t, t->entry_size);
+}
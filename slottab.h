@@ -0,0 +1,74 @@
+#ifndef _SLOTTAB_H
+#define _SLOTTAB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/limits.h>
+
+/* Put first in each entry of a slot table, which the table keys on @name */
+struct slot_key {
+	struct slot_key *hash_next;	/* in its bucket, or the free list */
+	uint32_t hash;
+	bool live;			/* not retired */
+	bool indexed;			/* can be found by name */
+	char name[NAME_MAX + 1];
+};
+
+/**
+ * Table of per-slot entries keyed by cgroup name. Entries are carved out of
+ * an arena of fixed-size chunks, so they never move and stay put across
+ * cycles; a retired entry's space goes to the next new one. The live entries
+ * are also kept in an array in sorted order, which is only redone when
+ * entries come or go.
+ */
+struct slot_table {
+	size_t entry_size;
+	char **chunks;			/* the arena */
+	size_t n_chunks, chunks_alloc;
+	size_t chunk_used;		/* entries used in the last chunk */
+	struct slot_key *free;		/* retired and reusable */
+	struct slot_key **buckets;
+	size_t n_buckets;
+	size_t n_entries;		/* in live[], retired or not */
+	struct slot_key **live;		/* sorted by slottab_order() */
+	size_t n_live, live_alloc;
+	bool changed;			/* live[] needs redoing */
+};
+
+/* Set up @t for entries of @entry_size bytes, starting with a slot_key */
+void slottab_init(struct slot_table *t, size_t entry_size);
+
+/* The live entry keyed @name, or NULL */
+void *slottab_find(struct slot_table *t, const char *name);
+
+/**
+ * Add an entry keyed @name, which mustn't be in the table already. It's
+ * zeroed except for its key, and is in live[] from the next slottab_order().
+ *
+ * @return the new entry
+ */
+void *slottab_add(struct slot_table *t, const char *name);
+
+/* Stop @entry being found by name, so another can be added with the same one,
+ * while leaving it in live[] until it's retired */
+void slottab_unlink(struct slot_table *t, void *entry);
+
+/* Take @entry out of the table. It stays in live[] (with key.live cleared)
+ * until the next slottab_order(), so it's safe to do while going through it */
+void slottab_retire(struct slot_table *t, void *entry);
+
+/**
+ * Bring live[] up to date after entries were added or retired, sorting it
+ * with @cmp (given pointers to two entries' keys) -- does nothing if none were
+ *
+ * @return number of live entries
+ */
+size_t slottab_order(struct slot_table *t,
+		     int (*cmp)(const struct slot_key *,
+				const struct slot_key *));
+
+/* Free everything, leaving @t empty and ready for slottab_init() */
+void slottab_free(struct slot_table *t);
+
+#endif
@@ -0,0 +1,135 @@
+/**
+ * Follow slot cgroups being made and removed with inotify, so a persistent
+ * collector needn't list condor's cgroup directory every cycle, and can read
+ * a job's final counters as soon as its last process exits
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <sys/inotify.h>
+
+#include "slotwatch.h"
+#include "util.h"
+
+#define DIR_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+		    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static int ifd = -1;
+static int dir_wd = -1;
+
+bool slotwatch_open(const char *dir)
+{
+	if((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)	{
+		fprintf(stderr, "Can't watch for new slots, inotify_init1() "
+			"failed: %s\n", strerror(errno));
+		return false;
+	}
+	if((dir_wd = inotify_add_watch(ifd, dir, DIR_EVENTS)) < 0)	{
+		fprintf(stderr, "Can't watch %s for new slots: %s\n", dir,
+			strerror(errno));
+		slotwatch_close();
+		return false;
+	}
+	return true;
+}
+
+bool slotwatch_active(void)
+{
+	return ifd >= 0;
+}
+
+int slotwatch_fd(void)
+{
+	return ifd;
+}
+
+int slotwatch_add_events(const char *dir)
+{
+	char path[PATH_MAX];
+
+	if(ifd < 0)
+		return -1;
+	join_path(path, sizeof(path), dir, "cgroup.events");
+	return inotify_add_watch(ifd, path, IN_MODIFY);
+}
+
+void slotwatch_rm(int wd)
+{
+	if(ifd >= 0 && wd >= 0)
+		inotify_rm_watch(ifd, wd);
+}
+
+static void _handle(const struct inotify_event *ev, slot_event_fn fn)
+{
+	if(ev->mask & IN_Q_OVERFLOW)	{
+		fn(SLOT_RESCAN, NULL, -1);
+	} else if(ev->wd != dir_wd)	{
+		if(ev->mask & IN_MODIFY)
+			fn(SLOT_EVENTS, NULL, ev->wd);
+	} else if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))	{
+		/* Condor's own cgroup went, the rescan will say so */
+		fn(SLOT_RESCAN, NULL, -1);
+	} else if(ev->len > 0 && (ev->mask & IN_ISDIR) && ev->name[0] != '.') {
+		if(ev->mask & (IN_CREATE | IN_MOVED_TO))
+			fn(SLOT_ADDED, ev->name, -1);
+		else if(ev->mask & (IN_DELETE | IN_MOVED_FROM))
+			fn(SLOT_REMOVED, ev->name, -1);
+	}
+}
+
+void slotwatch_read(slot_event_fn fn)
+{
+	/* Aligned for the events, as the man page says */
+	char buf[16384]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+
+	if(ifd < 0)
+		return;
+	while((n = read(ifd, buf, sizeof(buf))) != 0)	{
+		if(n < 0)	{
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN)
+				log_exit("Error reading inotify events: %s",
+					 strerror(errno));
+			return;
+		}
+		for(char *p = buf; p < buf + n;)	{
+			const struct inotify_event *ev = (void *)p;
+
+			_handle(ev, fn);
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+}
+
+bool slotwatch_wait(uint64_t deadline_ns, slot_event_fn fn)
+{
+	uint64_t now;
+
+	while(ifd >= 0 && (now = monotonic_ns()) < deadline_ns)	{
+		struct pollfd pfd = { .fd = ifd, .events = POLLIN };
+		int ms = (deadline_ns - now + 999999) / 1000000;
+		int rv = poll(&pfd, 1, ms);
+
+		if(rv < 0 && errno == EINTR)
+			return false;
+		if(rv < 0)
+			log_exit("poll() failed: %s", strerror(errno));
+		if(rv > 0)
+			slotwatch_read(fn);
+	}
+	return true;
+}
+
+void slotwatch_close(void)
+{
+	if(ifd >= 0)
+		close(ifd);
+	ifd = dir_wd = -1;
+}
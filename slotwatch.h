@@ -0,0 +1,57 @@
+#ifndef _SLOTWATCH_H
+#define _SLOTWATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* What happened to condor's cgroup directory */
+enum slot_event {
+	SLOT_ADDED,		/* a slot cgroup called @name was made */
+	SLOT_REMOVED,		/* ... or removed */
+	SLOT_EVENTS,		/* the cgroup.events watched as @wd changed */
+	SLOT_RESCAN,		/* events were lost, list the directory again */
+};
+
+typedef void (*slot_event_fn)(enum slot_event ev, const char *name, int wd);
+
+/**
+ * Watch directory @dir with inotify for slot cgroups being made and removed
+ *
+ * @param[in] dir condor's cgroup directory
+ * @return false if it can't be watched (e.g. out of inotify instances), in
+ *         which case it'll have to be listed every time
+ */
+bool slotwatch_open(const char *dir);
+
+/* Whether slotwatch_open() succeeded */
+bool slotwatch_active(void);
+
+/* The inotify descriptor to poll for events, or -1 if there isn't one */
+int slotwatch_fd(void);
+
+/**
+ * Also watch a v2 slot cgroup's cgroup.events, which changes when its last
+ * process exits. Returns the watch descriptor given to SLOT_EVENTS, or -1 if
+ * it can't be watched.
+ *
+ * @param[in] dir the slot's cgroup directory
+ */
+int slotwatch_add_events(const char *dir);
+
+/* Stop watching cgroup.events watch @wd, if it's not -1 */
+void slotwatch_rm(int wd);
+
+/* Handle the events waiting, calling @fn for each, without blocking */
+void slotwatch_read(slot_event_fn fn);
+
+/**
+ * Wait for events until @deadline_ns on the monotonic clock, handling them
+ * with @fn as they come
+ *
+ * @return false if interrupted by a signal
+ */
+bool slotwatch_wait(uint64_t deadline_ns, slot_event_fn fn);
+
+void slotwatch_close(void);
+
+#endif
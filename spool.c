@@ -0,0 +1,174 @@
+/**
+ * A fixed-size spool file holding metric batches that couldn't be sent, so
+ * they outlive a carbon outage or a restart of the collector. It's a ring of
+ * length-prefixed batches, memory-mapped, with the read and write positions
+ * kept in the file's header as ever-increasing offsets into the ring.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "selfstats.h"
+#include "spool.h"
+#include "util.h"
+
+#define SPOOL_MAGIC "CGSPOOL1"
+
+struct spool_header {
+	char magic[8];
+	uint64_t size;		/* bytes in the ring after the header */
+	uint64_t head;		/* offset of the oldest batch */
+	uint64_t tail;		/* offset the next batch goes at */
+	char pad[32];		/* ring starts on a cache line */
+};
+
+static struct spool_header *hdr = NULL;
+static char *ring;
+static size_t map_len;
+static uint64_t dropped = 0;	/* bytes dropped since the spool last emptied */
+
+/* Copy @len bytes in or out of the ring at offset @off, wrapping around */
+static void _ring_write(uint64_t off, const void *src, size_t len)
+{
+	size_t pos = off % hdr->size;
+	size_t first = (len < hdr->size - pos) ? len : hdr->size - pos;
+
+	memcpy(ring + pos, src, first);
+	memcpy(ring, (const char *)src + first, len - first);
+}
+
+static void _ring_read(uint64_t off, void *dst, size_t len)
+{
+	size_t pos = off % hdr->size;
+	size_t first = (len < hdr->size - pos) ? len : hdr->size - pos;
+
+	memcpy(dst, ring + pos, first);
+	memcpy((char *)dst + first, ring, len - first);
+}
+
+static uint32_t _batch_len(uint64_t off)
+{
+	uint32_t len;
+
+	_ring_read(off, &len, sizeof(len));
+	return len;
+}
+
+/* Is the header one of ours, and consistent with a file of @file_size */
+static bool _header_ok(off_t file_size)
+{
+	return memcmp(hdr->magic, SPOOL_MAGIC, sizeof(hdr->magic)) == 0 &&
+	       hdr->size + sizeof(*hdr) == (uint64_t)file_size &&
+	       hdr->head <= hdr->tail && hdr->tail - hdr->head <= hdr->size;
+}
+
+void spool_open(const char *path, size_t size)
+{
+	struct stat st;
+	bool fresh;
+	int fd;
+
+	if((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+		log_exit("Can't open spool file %s: %s", path, strerror(errno));
+	if(fstat(fd, &st) != 0)
+		log_exit("Can't stat spool file %s: %s", path, strerror(errno));
+
+	fresh = (size_t)st.st_size < sizeof(*hdr);
+	if(fresh)	{
+		if(ftruncate(fd, sizeof(*hdr) + size) != 0)
+			log_exit("Can't size spool file %s: %s", path,
+				 strerror(errno));
+		st.st_size = sizeof(*hdr) + size;
+	}
+
+	map_len = st.st_size;
+	hdr = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(hdr == MAP_FAILED)
+		log_exit("Can't map spool file %s: %s", path, strerror(errno));
+	close(fd);
+	ring = (char *)(hdr + 1);
+
+	if(fresh)	{
+		memcpy(hdr->magic, SPOOL_MAGIC, sizeof(hdr->magic));
+		hdr->size = size;
+		hdr->head = hdr->tail = 0;
+	} else if(!_header_ok(st.st_size))	{
+		log_exit("%s isn't a spool file, or it's damaged", path);
+	} else if(hdr->tail > hdr->head)	{
+		fprintf(stderr, "Spool %s has %" PRIu64 " bytes of metrics to "
+			"replay\n", path, hdr->tail - hdr->head);
+	}
+}
+
+bool spool_enabled(void)
+{
+	return hdr != NULL;
+}
+
+bool spool_write(const char *data, size_t len)
+{
+	uint32_t len32 = len;
+	uint64_t need = sizeof(len32) + len;
+
+	if(need > hdr->size)
+		return false;
+
+	while(hdr->tail + need - hdr->head > hdr->size)	{
+		uint32_t old = _batch_len(hdr->head);
+
+		if(dropped == 0)
+			fputs("Spool full, dropping the oldest metrics\n",
+			      stderr);
+		dropped += old;
+		stats_count(STAT_DROPPED_BYTES, old);
+		hdr->head += sizeof(old) + old;
+	}
+
+	_ring_write(hdr->tail, &len32, sizeof(len32));
+	_ring_write(hdr->tail + sizeof(len32), data, len);
+	/* The batch is all there before the header says so */
+	__sync_synchronize();
+	hdr->tail += need;
+	return true;
+}
+
+size_t spool_peek(char *dst, uint64_t *id)
+{
+	uint32_t len;
+
+	if(hdr == NULL || hdr->head == hdr->tail)
+		return 0;
+
+	len = _batch_len(hdr->head);
+	if(dst != NULL)
+		_ring_read(hdr->head + sizeof(len), dst, len);
+	*id = hdr->head;
+	return len;
+}
+
+void spool_consume(uint64_t id)
+{
+	if(hdr->head != id)
+		return;
+	hdr->head += sizeof(uint32_t) + _batch_len(id);
+	if(hdr->head == hdr->tail && dropped > 0)	{
+		fprintf(stderr, "Spool replayed, %" PRIu64 " bytes of metrics "
+			"were dropped\n", dropped);
+		dropped = 0;
+	}
+}
+
+void spool_close(void)
+{
+	if(hdr == NULL)
+		return;
+	msync(hdr, map_len, MS_SYNC);
+	munmap(hdr, map_len);
+	hdr = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef _SPOOL_H
+#define _SPOOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Default size of the spool file's ring of metric batches */
+#define SPOOL_DEFAULT_SIZE	(64 << 20)
+
+/* Spooled batches are sent again at no more than this many bytes a second, so
+ * carbon isn't swamped when it comes back */
+#define SPOOL_REPLAY_RATE	(512 << 10)
+
+/**
+ * Open (or create) the spool file at @path, memory-mapping it. Batches left in
+ * an existing spool from a previous run are kept to be replayed, and it keeps
+ * the size it was made with; a new one gets a ring of @size bytes.
+ *
+ * @param[in] path spool file
+ * @param[in] size bytes of batches it holds, when creating it
+ */
+void spool_open(const char *path, size_t size);
+
+/* Is there a spool to write to */
+bool spool_enabled(void);
+
+/**
+ * Add a batch of @len bytes at @data to the spool, dropping the oldest
+ * batches to make room for it. Returns false if it's too big to ever fit.
+ */
+bool spool_write(const char *data, size_t len);
+
+/**
+ * Length of the oldest batch in the spool (0 if it's empty), copied to @dst
+ * if that's not NULL and put in @id to pass to spool_consume() once it's sent
+ */
+size_t spool_peek(char *dst, uint64_t *id);
+
+/* Remove batch @id from the spool, if it hasn't been dropped already */
+void spool_consume(uint64_t id);
+
+/* Flush the spool to disk and unmap it */
+void spool_close(void);
+
+#endif
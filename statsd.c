@@ -9,11 +9,14 @@
 #include <stdbool.h>
 #include <unistd.h>
 
-#include "graphite.h"
+#include "statsd.h"
 
 int statsd_connect(const char *server, const char *port)
 {
-	return server_connect(server, port, SOCK_DGRAM);
+	int fd = server_connect(server, port, SOCK_DGRAM);
+
+	buf_set_datagram_size(fd, STATSD_BUFSIZE);
+	return fd;
 }
 
 void statsd_close(int fd)
@@ -23,28 +26,27 @@ void statsd_close(int fd)
 		perror("Close fd");
 }
 
-static char *_make_metric(const char *name, const char *val)
-{
-	size_t len = strlen(name) + strlen(val) + 8;
-	char *str;
-
-	str = xcalloc(len);
-
-	/* <metric.name.path>:<value>|<type> */
-	snprintf(str, len, "%s:%s|c\n", name, val);
-
-	return str;
-}
-
-static int _send_metric(int fd, const char *m, const char *v)
+/* Write "<metric.name.path>:<value>|<type>\n" straight into the send buffer,
+ * the value already being formatted as @vlen bytes at @val and @type being
+ * 'c' for a counter or 'g' for a gauge
+ */
+static int _send_metric(int fd, const char *m, const char *val, size_t vlen,
+			char type)
 {
-	char *mstr = _make_metric(m, v);
-	int rv;
+	size_t mlen = strlen(m);
+	char *line, *p;
 
-	rv = util_metric_send(fd, mstr, true);
-	free(mstr);
+	p = line = metric_line_start(fd, mlen + vlen + 4);
+	memcpy(p, m, mlen);
+	p += mlen;
+	*p++ = ':';
+	memcpy(p, val, vlen);
+	p += vlen;
+	*p++ = '|';
+	*p++ = type;
+	*p++ = '\n';
 
-	return rv;
+	return metric_line_end(fd, p - line, true);
 }
 
 #define VAL_BUF 24 /* 64-bit values go up to 10^19, so this should be enough */
@@ -52,13 +54,31 @@ static int _send_metric(int fd, const char *m, const char *v)
 int statsd_send_uint(int fd, const char *metric, uint64_t value)
 {
 	char s[VAL_BUF];
-	snprintf(s, sizeof(s), "%ld", value);
-	return _send_metric(fd, metric, s);
+	return _send_metric(fd, metric, s, utoa(s, value), 'c');
 }
 
 int statsd_send_int(int fd, const char *metric, int value)
 {
 	char s[VAL_BUF];
-	snprintf(s, sizeof(s), "%d", value);
-	return _send_metric(fd, metric, s);
+	return _send_metric(fd, metric, s, itoa(s, value), 'c');
 }
+
+int statsd_send_gauge(int fd, const char *metric, uint64_t value)
+{
+	char s[VAL_BUF];
+	return _send_metric(fd, metric, s, utoa(s, value), 'g');
+}
+
+static int _send_typed(int fd, const char *metric, uint64_t value,
+		       enum metric_type type)
+{
+	if(type == METRIC_COUNTER)
+		return statsd_send_uint(fd, metric, value);
+	return statsd_send_gauge(fd, metric, value);
+}
+
+const struct metric_backend statsd_backend = {
+	.send = _send_typed,
+	.flush = buf_flush,
+	.counter_deltas = true,
+};
@@ -4,11 +4,17 @@
 #include "util.h"
 #include "metrics.h"
 
+/* Most bytes of metrics packed in each datagram */
 #define STATSD_BUFSIZE 1430
 
 int	statsd_connect(const char *server, const char *port);
 int	statsd_send_int(int fd, const char *metric, int value);
 int	statsd_send_uint(int fd, const char *metric, uint64_t value);
+int	statsd_send_gauge(int fd, const char *metric, uint64_t value);
 void	statsd_close(int fd);
 
+/* For send_group_metrics(): levels are sent as gauges (|g), and counters as
+ * counts (|c) of how much they went up since the last sample */
+extern const struct metric_backend statsd_backend;
+
 #endif
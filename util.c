@@ -7,17 +7,23 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "util.h"
 #include "cgroup.h"
 
 
 
-int server_connect(const char *server, const char *port, int ai_socktype)
+struct addrinfo *server_lookup(const char *server, const char *port,
+			       int ai_socktype)
 {
 	struct addrinfo hints = {0};
-	struct addrinfo *result, *rp;
-	int sfd, s;
+	struct addrinfo *result;
+	int s;
 
 	if (ai_socktype != SOCK_STREAM && ai_socktype != SOCK_DGRAM)	{
 		fputs("BUG!: socket-type must be STREAM/DGRAM!\n", stderr);
@@ -32,41 +38,80 @@ int server_connect(const char *server, const char *port, int ai_socktype)
 
 	s = getaddrinfo(server, port, &hints, &result);
 	if (s != 0) {
-		fprintf(stderr, "Error looking up %s:%s...exit\n",
-			server, port);
-		exit(EXIT_FAILURE);
+		fprintf(stderr, "Error looking up %s:%s\n", server, port);
+		return NULL;
 	}
+	return result;
+}
+
+int addr_try_connect(const struct addrinfo *addrs, bool nonblock)
+{
+	const struct addrinfo *rp;
+	int sfd = -1;
 
 	/* Walk through returned list until we find an address structure
 	 * that can be used to successfully connect a socket */
-	for (rp = result; rp != NULL; rp = rp->ai_next) {
+	for (rp = addrs; rp != NULL; rp = rp->ai_next) {
 		sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
 		if (sfd == -1)
 			continue;
 
-		if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1)
+		if (nonblock && fcntl(sfd, F_SETFL, O_NONBLOCK) != 0)	{
+			close(sfd);
+			continue;
+		}
+
+		if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1 ||
+		    (nonblock && errno == EINPROGRESS))
 			break;
 
 		/* Connect failed: close this socket and try next address */
 		close(sfd);
 	}
 
+	return (rp == NULL) ? -1 : sfd;
+}
+
+/* Look up @server:@port and connect a socket of @ai_socktype to the first of
+ * its addresses that'll take it. With @nonblock the socket is non-blocking and
+ * a TCP connect still in progress counts as connected, any error shows up on
+ * the first send. Returns -1 if it can't connect.
+ */
+int server_try_connect(const char *server, const char *port, int ai_socktype,
+		       bool nonblock)
+{
+	struct addrinfo *result;
+	int sfd;
+
+	if ((result = server_lookup(server, port, ai_socktype)) == NULL)
+		return -1;
+	sfd = addr_try_connect(result, nonblock);
 	freeaddrinfo(result);
 
-	if (rp == NULL)	{
+	if (sfd < 0)	{
 		fprintf(stderr, "Error creating %s socket to %s\n",
 			(ai_socktype == SOCK_DGRAM) ? "UDP" : "TCP", server);
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	return sfd;
 }
 
+int server_connect(const char *server, const char *port, int ai_socktype)
+{
+	int sfd = server_try_connect(server, port, ai_socktype, false);
+
+	if (sfd < 0)	{
+		fputs("...exit\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	return sfd;
+}
+
 
-const char* join_path(const char *c1, const char *c2)
+const char* join_path(char *buf, size_t len, const char *c1, const char *c2)
 {
-	static char buf[512];
-	snprintf(buf, sizeof(buf), "%s/%s", c1, c2);
+	snprintf(buf, len, "%s/%s", c1, c2);
 	return buf;
 }
 
@@ -102,3 +147,92 @@ char *xstrdup(const char *s)
 	}
 	return n;
 }
+
+static const char digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
+/* Fill in digits two at a time from the end of a scratch buffer */
+size_t utoa(char *dst, uint64_t v)
+{
+	char tmp[MAX_DIGITS];
+	char *p = tmp + sizeof(tmp);
+	size_t len;
+
+	while(v >= 100)	{
+		const char *d = digit_pairs + (v % 100) * 2;
+		v /= 100;
+		*--p = d[1];
+		*--p = d[0];
+	}
+	if(v >= 10)	{
+		const char *d = digit_pairs + v * 2;
+		*--p = d[1];
+		*--p = d[0];
+	} else {
+		*--p = '0' + v;
+	}
+
+	len = tmp + sizeof(tmp) - p;
+	memcpy(dst, p, len);
+	return len;
+}
+
+size_t itoa(char *dst, int64_t v)
+{
+	if(v < 0)	{
+		*dst = '-';
+		return 1 + utoa(dst + 1, -(uint64_t)v);
+	}
+	return utoa(dst, v);
+}
+
+/* Compare 16 bytes at a time with SSE2 where we have it, this is what makes
+ * counting a big tasks file cheap
+ */
+size_t count_char(const char *buf, size_t len, char c)
+{
+	size_t n = 0;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i needle = _mm_set1_epi8(c);
+
+	for(; i + 16 <= len; i += 16)	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+		n += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)));
+	}
+#endif
+	for(; i < len; i++)
+		n += (buf[i] == c);
+
+	return n;
+}
+
+uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+ssize_t count_lines_fd(int fd, char *buf, size_t len)
+{
+	size_t n = 0;
+	off_t off = 0;
+	ssize_t r;
+
+	while((r = pread(fd, buf, len, off)) != 0)	{
+		if(r < 0)	{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		n += count_char(buf, r, '\n');
+		off += r;
+	}
+	return n;
+}
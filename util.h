@@ -3,6 +3,8 @@
 
 #include "cgroup.h"
 #include <stdbool.h>
+#include <sys/types.h>
+#include <stdint.h>
 
 #define STREQ(a, b)	(0 == strcmp(a, b))
 #define STRNEQ(a, b)	(!STREQ(a,b))
@@ -11,6 +13,22 @@
  * buffering
  */
 int server_connect(const char *server, const char *port, int ai_socktype);
+int server_try_connect(const char *server, const char *port, int ai_socktype,
+		       bool nonblock);
+
+/* The two halves of server_try_connect(), to connect to the same addresses
+ * again without looking them up every time: the addresses of @server:@port
+ * for sockets of @ai_socktype (to freeaddrinfo()), or NULL after saying why
+ * if they can't be looked up; and a socket connected to the first of @addrs
+ * that takes it, or -1
+ */
+struct addrinfo;
+struct addrinfo *server_lookup(const char *server, const char *port,
+			       int ai_socktype);
+int addr_try_connect(const struct addrinfo *addrs, bool nonblock);
+
+/* Most sinks that metrics can be sent to at once */
+#define MAX_SINKS 8
 
 /* Safe malloc/calloc */
 void *xcalloc(size_t len);
@@ -19,8 +37,26 @@ char *xstrdup(const char *s);
 /* Log message and exit program */
 void log_exit(const char *fmt, ...)  __attribute__((noreturn));
 
-/* Join strings on a path separator, returning a pointer to static storage */
-const char *join_path(const char *c1, const char *c2);
+/* Join strings on a path separator into @buf of @len bytes, returning @buf */
+const char *join_path(char *buf, size_t len, const char *c1, const char *c2);
+
+/* Longest decimal representation of a 64-bit integer, with sign */
+#define MAX_DIGITS 20
+
+/* Write the decimal digits of @v at @dst without printf (or a terminating
+ * nul), returning how many were written -- at most MAX_DIGITS */
+size_t utoa(char *dst, uint64_t v);
+size_t itoa(char *dst, int64_t v);
+
+/* Count occurrences of @c in the @len bytes at @buf */
+size_t count_char(const char *buf, size_t len, char c);
+
+/* Count the lines of file @fd from the start with pread() calls of @len bytes
+ * into @buf, returns -1 on error with errno set */
+ssize_t count_lines_fd(int fd, char *buf, size_t len);
+
+/* Nanoseconds on the monotonic clock */
+uint64_t monotonic_ns(void);
 
 extern int debug;
 